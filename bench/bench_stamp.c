@@ -0,0 +1,19 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Print the date (monotonic clock, in nano-seconds) at which the
+ * program got to run */
+int
+main ()
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  printf ("%llu\n", (unsigned long long) now.tv_sec * 1000000000ULL +
+	  now.tv_nsec);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,347 @@
+/* Microbenchmarks of the hot paths of librlimit. Each benchmark is run
+ * a fixed number of times (after a few warmup runs) and its median and
+ * 99th percentile are reported, either as a table or as JSON lines
+ * ('-j') to be compared between two builds. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rlimit.h>
+
+#define FLOOD_BLOCKS   "256"		/* Blocks of 64 KiB written */
+#define FLOOD_BYTES    (256 * 65536.0)
+#define SYSCALL_COUNT  "5000"		/* One-byte copies of dd */
+#define SYSCALL_STOPS  (4 * 5000.0)	/* Entries and exits traced */
+
+static int runs = 100;		/* Measured runs of each benchmark */
+static int warmup = 5;		/* Runs discarded first */
+static bool json = false;	/* Machine-readable output */
+
+static double
+now_usec (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int
+compare (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* Sort the samples and print their median and 99th percentile */
+static void
+report (const char *name, const char *unit, double *samples, int n)
+{
+  double median, p99;
+
+  qsort (samples, n, sizeof (double), compare);
+  median = samples[(n - 1) / 2];
+  p99 = samples[(99 * n + 99) / 100 - 1];
+
+  if (json)
+    printf ("{\"benchmark\": \"%s\", \"runs\": %d, \"median\": %.3f, "
+	    "\"p99\": %.3f, \"unit\": \"%s\"}\n", name, n, median, p99, unit);
+  else
+    printf ("%-20s %6d %12.3f %12.3f  %s\n", name, n, median, p99, unit);
+
+  fflush (stdout);
+}
+
+/* Run a command line to its end, returning the time it took (in
+ * micro-seconds) and its subprocess in 'result' if not NULL */
+static double
+run (char **argv, int argc, bool profiled, subprocess_t ** result)
+{
+  subprocess_t *p = rlimit_subprocess_create (argc, argv, NULL);
+  double start = now_usec (), end;
+
+  if (profiled)
+    rlimit_set_syscall_profile (p, true);
+
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+  end = now_usec ();
+
+  if (result != NULL)
+    *result = p;
+  else
+    rlimit_subprocess_delete (p);
+
+  return end - start;
+}
+
+/* From rlimit_subprocess_run() to the main() of the program */
+static void
+bench_spawn (double *samples)
+{
+  char *argv[] = { "./bench_stamp" };
+  subprocess_t *p;
+
+  for (int i = -warmup; i < runs; i++)
+    {
+      struct timespec ts;
+      double start;
+
+      clock_gettime (CLOCK_MONOTONIC, &ts);
+      start = ts.tv_sec * 1e9 + ts.tv_nsec;
+      run (argv, 1, false, &p);
+
+      if (i >= 0)
+	samples[i] = (strtod (rlimit_read_stdout (p), NULL) - start) / 1e3;
+
+      rlimit_subprocess_delete (p);
+    }
+
+  report ("spawn_to_exec", "us", samples, runs);
+}
+
+/* Run and wait for /bin/true */
+static void
+bench_true (double *samples)
+{
+  char *argv[] = { "/bin/true" };
+
+  for (int i = -warmup; i < runs; i++)
+    {
+      double elapsed = run (argv, 1, false, NULL);
+
+      if (i >= 0)
+	samples[i] = elapsed;
+    }
+
+  report ("run_wait_true", "us", samples, runs);
+}
+
+/* Output read by the io monitor from a flood of stdout */
+static void
+bench_flood (double *samples)
+{
+  char *argv[] = { "/bin/dd", "if=/dev/zero", "bs=65536",
+    "count=" FLOOD_BLOCKS, "status=none"
+  };
+
+  for (int i = -warmup; i < runs; i++)
+    {
+      double elapsed = run (argv, 5, false, NULL);
+
+      if (i >= 0)
+	samples[i] = FLOOD_BYTES / elapsed;	/* bytes/us = MB/s */
+    }
+
+  report ("stdout_flood", "MB/s", samples, runs);
+}
+
+/* Cost of a syscall stop of the ptrace tracer (one-byte copies of dd
+ * traced, minus the median of the untraced run) */
+static void
+bench_syscall_filter (double *samples)
+{
+  char *argv[] = { "/bin/dd", "if=/dev/zero", "of=/dev/null", "bs=1",
+    "count=" SYSCALL_COUNT, "status=none"
+  };
+  double untraced;
+
+  for (int i = -warmup; i < runs; i++)
+    {
+      double elapsed = run (argv, 6, false, NULL);
+
+      if (i >= 0)
+	samples[i] = elapsed;
+    }
+
+  qsort (samples, runs, sizeof (double), compare);
+  untraced = samples[(runs - 1) / 2];
+
+  for (int i = -warmup; i < runs; i++)
+    {
+      double elapsed = run (argv, 6, true, NULL);
+
+      if (i >= 0)
+	samples[i] = (elapsed - untraced) * 1e3 / SYSCALL_STOPS;
+    }
+
+  report ("syscall_filter", "ns/stop", samples, runs);
+}
+
+/* A line written on the stdin of cat until expect finds it back */
+static void
+bench_expect (double *samples)
+{
+  char *argv[] = { "/bin/cat" };
+  subprocess_t *p = rlimit_subprocess_create (1, argv, NULL);
+
+  rlimit_subprocess_run (p);
+
+  for (int i = -warmup; i < runs; i++)
+    {
+      double start = now_usec ();
+
+      rlimit_write_stdin (p, "ping\n");
+      if (!rlimit_expect_stdout (p, "ping", 10))
+	{
+	  fprintf (stderr, "rlimit_bench: expect failed\n");
+	  exit (EXIT_FAILURE);
+	}
+
+      if (i >= 0)
+	samples[i] = now_usec () - start;
+    }
+
+  rlimit_subprocess_kill (p);
+  rlimit_subprocess_wait (p);
+  rlimit_subprocess_delete (p);
+
+  report ("expect", "us", samples, runs);
+}
+
+/* Output callback of the stdin round trip */
+struct echo
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  size_t received;		/* Bytes echoed so far */
+};
+
+static int
+echo_received (subprocess_t * p, const char *chunk, size_t length,
+	       void *data)
+{
+  struct echo *echo = data;
+
+  (void) p;
+  (void) chunk;
+
+  pthread_mutex_lock (&(echo->mutex));
+  echo->received += length;
+  pthread_cond_signal (&(echo->cond));
+  pthread_mutex_unlock (&(echo->mutex));
+
+  return RLIMIT_CONTINUE;
+}
+
+/* A line written on the stdin of cat until it is read back (through
+ * an output callback, without expect) */
+static void
+bench_stdin (double *samples)
+{
+  char *argv[] = { "/bin/cat" };
+  struct echo echo = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,.received = 0
+  };
+  subprocess_t *p = rlimit_subprocess_create (1, argv, NULL);
+
+  rlimit_set_stdout_callback (p, echo_received, &echo);
+  rlimit_subprocess_run (p);
+
+  for (int i = -warmup; i < runs; i++)
+    {
+      double start = now_usec ();
+
+      rlimit_write_stdin (p, "ping\n");
+
+      pthread_mutex_lock (&(echo.mutex));
+      while (echo.received < 5 * (size_t) (i + warmup + 1))
+	pthread_cond_wait (&(echo.cond), &(echo.mutex));
+      pthread_mutex_unlock (&(echo.mutex));
+
+      if (i >= 0)
+	samples[i] = now_usec () - start;
+    }
+
+  rlimit_subprocess_kill (p);
+  rlimit_subprocess_wait (p);
+  rlimit_subprocess_delete (p);
+
+  report ("write_stdin", "us", samples, runs);
+}
+
+static const struct
+{
+  const char *name;
+  void (*bench) (double *samples);
+} benchmarks[] = {
+  {"spawn_to_exec", bench_spawn},
+  {"run_wait_true", bench_true},
+  {"stdout_flood", bench_flood},
+  {"syscall_filter", bench_syscall_filter},
+  {"expect", bench_expect},
+  {"write_stdin", bench_stdin}
+};
+
+#define BENCHMARKS (int) (sizeof (benchmarks) / sizeof (benchmarks[0]))
+
+static void
+usage (void)
+{
+  fprintf (stderr, "usage: rlimit_bench [-j] [-n runs] [-w warmup] "
+	   "[benchmark...]\nbenchmarks:");
+  for (int i = 0; i < BENCHMARKS; i++)
+    fprintf (stderr, " %s", benchmarks[i].name);
+  fprintf (stderr, "\n");
+  exit (EXIT_FAILURE);
+}
+
+int
+main (int argc, char **argv)
+{
+  double *samples;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "jn:w:")) != -1)
+    switch (opt)
+      {
+      case 'j':
+	json = true;
+	break;
+      case 'n':
+	runs = atoi (optarg);
+	break;
+      case 'w':
+	warmup = atoi (optarg);
+	break;
+      default:
+	usage ();
+      }
+
+  if ((runs < 1) || (warmup < 0))
+    usage ();
+
+  if ((samples = malloc (runs * sizeof (double))) == NULL)
+    {
+      perror ("rlimit_bench");
+      return EXIT_FAILURE;
+    }
+
+  if (!json)
+    printf ("%-20s %6s %12s %12s  %s\n", "benchmark", "runs", "median",
+	    "p99", "unit");
+
+  for (int i = 0; i < BENCHMARKS; i++)
+    {
+      bool selected = (optind == argc);
+
+      for (int j = optind; j < argc; j++)
+	selected |= (strcmp (argv[j], benchmarks[i].name) == 0);
+
+      if (selected)
+	benchmarks[i].bench (samples);
+    }
+
+  free (samples);
+
+  return EXIT_SUCCESS;
+}
@@ -36,10 +36,10 @@ class SUBPROCESS(Structure):
                 ("stdin_buffer", c_char_p),
                 ("stdout_buffer", c_char_p),
                 ("stderr_buffer", c_char_p),
-                ("real_time_usec", c_int),
-                ("user_time_usec", c_int),
-                ("sys_time_usec", c_int),
-                ("memory_kbytes", c_int),
+                ("real_time_usec", c_long),
+                ("user_time_usec", c_long),
+                ("sys_time_usec", c_long),
+                ("memory_kbytes", c_size_t),
                 ("limits", c_void_p),
                 ("expect_stdout", c_int),
                 ("expect_stderr", c_int),
@@ -91,10 +91,12 @@ class Subprocess(object):
         The subprocess will be run in a separate thread. This function
         do not return anything but might throw an exception if a
         problem occurs at start time. The user might set a limit over
-        the maximum time and memory for the subprocess to run.
+        the maximum time (in seconds, possibly fractional) and memory
+        for the subprocess to run.
         '''
         if not (timeout == None):
-            rlimit.rlimit_set_time_limit(self.subprocess, timeout)
+            rlimit.rlimit_set_time_limit_ns(self.subprocess,
+                                            c_uint64(int(timeout * 1e9)))
 
         if not (memory == None):
             rlimit.rlimit_set_memory_limit(self.subprocess, memory)
@@ -196,6 +198,12 @@ class Subprocess(object):
             return "ProcExceed"
         elif (self.subprocess.contents.status == 12):
             return "DeniedSyscall"
+        elif (self.subprocess.contents.status == 13):
+            return "OutputExceed"
+        elif (self.subprocess.contents.status == 14):
+            return "CpuTimeout"
+        elif (self.subprocess.contents.status == 15):
+            return "InstrExceed"
 
     def stdout(self):
         return self.subprocess.contents.stdout_buffer
@@ -217,3 +225,7 @@ class Subprocess(object):
 
     def memory_profile(self):
         return self.subprocess.contents.memory_kbytes
+
+    def instructions_profile(self):
+        rlimit.rlimit_get_instructions_profile.restype = c_uint64
+        return rlimit.rlimit_get_instructions_profile(self.subprocess)
@@ -31,30 +31,93 @@
  *  * 03/26/2012 (Emmanuel Fleury): First public release
  */
 
-#define _BSD_SOURCE		/* needed by wait4() */
+#define _GNU_SOURCE		/* needed by wait4() and syscall() */
 #define _POSIX_C_SOURCE 200809L
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <sched.h>
 #include <pthread.h>
 #include <regex.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
 #include <sys/ptrace.h>
 #include <sys/reg.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 
+#if defined(SYS_pidfd_open) && defined(SYS_pidfd_send_signal)
+#define HAVE_PIDFD
+#endif /* SYS_pidfd_open && SYS_pidfd_send_signal */
+
+/* Syscalls are injected in the programs of the fork servers */
+#if defined(__x86_64__) && defined(SYS_clone) && defined(SYS_dup2)
+#define HAVE_FORKSERVER
+#endif /* __x86_64__ && SYS_clone && SYS_dup2 */
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H) && \
+  defined(HAVE_SYS_TIMERFD_H) && defined(HAVE_PIDFD)
+#define HAVE_SUPERVISOR
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif /* HAVE_SYS_EPOLL_H && ... */
+
+#if defined(HAVE_LINUX_PERF_EVENT_H) && defined(SYS_perf_event_open)
+#define HAVE_PERF
+#include <linux/perf_event.h>
+#endif /* HAVE_LINUX_PERF_EVENT_H && SYS_perf_event_open */
+
+#ifdef HAVE_SECCOMP
+#include <sys/prctl.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#endif /* HAVE_SECCOMP */
+
 #include "rlimit.h"
 
+/* Architecture identifier checked by the seccomp filter */
+#if defined(__x86_64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_X86_64
+#elif defined(__i386__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_I386
+#elif defined(__aarch64__)
+#define SECCOMP_AUDIT_ARCH AUDIT_ARCH_AARCH64
+#else
+#undef HAVE_SECCOMP		/* Unknown architecture, use ptrace only */
+#endif
+
+#if defined(HAVE_SECCOMP) && !defined(SECCOMP_RET_KILL_PROCESS)
+#define SECCOMP_RET_KILL_PROCESS SECCOMP_RET_KILL
+#endif
+
+#if defined(HAVE_SECCOMP) && !defined(SECCOMP_MODE_DEAD)
+#define SECCOMP_MODE_DEAD (SECCOMP_MODE_FILTER + 1)
+#endif
+
 #define RETURN_SUCCESS  0
 #define RETURN_FAILURE -1
 
@@ -63,6 +126,35 @@
 #define CHECK_WARNING(test, msg)\
   if (test) { rlimit_warning (msg); goto fail; }
 
+/* Chunk of input queued on stdin */
+struct io_chunk
+{
+  struct io_chunk *next;	/* Next chunk in the queue */
+  size_t length;		/* Length of the data */
+  size_t offset;		/* Bytes of the data already written */
+  char data[];			/* Data to write */
+};
+
+/* Syscall policy (immutable once compiled) */
+#define POLICY_WORD_BITS (8 * sizeof (unsigned long))
+
+struct rlimit_policy
+{
+  int refcount;			/* Number of references on the policy */
+  bool compiled;		/* Policy is frozen (and filter built) */
+  pthread_mutex_t mutex;	/* Mutex locking the compilation */
+
+  int *syscalls;		/* Forbiden syscalls (syscalls[0] is the
+				   number of forbiden syscalls and
+				   syscalls[i] (i>0) their ids') */
+  int capacity;			/* Allocated size of syscalls[] */
+
+  unsigned long *bitmap;	/* Bitmap indexed by syscall ids' */
+  int bitmap_words;		/* Size of bitmap[] (in words) */
+
+  struct sock_fprog *filter;	/* Precompiled seccomp filter (if any) */
+};
+
 static char *error = "librlimit: error";
 static char *warning = "librlimit: warning";
 
@@ -99,89 +191,150 @@ rlimit_warning (char *msg)
   perror (s);
 }
 
-subprocess_t *
-rlimit_subprocess_create (int argc, char **argv, char **envp)
+/* Process file descriptors (pidfd) give a per-child exit notification
+ * (the pidfd becomes readable when the child exits) and signals that
+ * cannot hit another process if the PID has been reused. They are
+ * used whenever the kernel provides them. */
+static bool pidfd_supported = false;
+static pthread_once_t pidfd_once = PTHREAD_ONCE_INIT;
+
+static int
+open_pidfd (pid_t pid)
 {
-  subprocess_t *p = malloc (sizeof (subprocess_t));
-  /* Handling 'out of memory' */
-  CHECK_ERROR ((p == NULL), "subprocess allocation failed");
+#ifdef HAVE_PIDFD
+  return syscall (SYS_pidfd_open, pid, 0);
+#else
+  (void) pid;
+  errno = ENOSYS;
+  return -1;
+#endif /* HAVE_PIDFD */
+}
 
-  /* Initializing the command line arguments */
-  p->argc = argc;
+static void
+pidfd_probe (void)
+{
+  int fd = open_pidfd (getpid ());
 
-  /* Copy argv */
-  p->argv = malloc ((argc + 1) * sizeof (char *));
-  /* Handling 'out of memory' */
-  if (p->argv == NULL)
+  if (fd != -1)
     {
-      free (p);
-      p = NULL;
-      CHECK_ERROR (true, "subprocess allocation failed");
+      pidfd_supported = true;
+      close (fd);
     }
+}
+
+/* Send a signal to the subprocess (through its pidfd if any) */
+static int
+subprocess_send_signal (subprocess_t * p, int signal)
+{
+#ifdef HAVE_PIDFD
+  if (p->pidfd != -1)
+    return syscall (SYS_pidfd_send_signal, p->pidfd, signal, NULL, 0);
+#endif /* HAVE_PIDFD */
+
+  return kill (p->pid, signal);
+}
+
+/* A subprocess is laid out in a single block of memory (its arena):
+ * the subprocess_t, its limits, its monitor, then argv and envp
+ * followed by the strings they point to. */
+struct subprocess_arena
+{
+  subprocess_t subprocess;	/* Subprocess (first) */
+  limits_t limits;		/* Limits (p->limits once set) */
+  pthread_t monitor;		/* Monitor thread */
+  char *vectors[];		/* argv and envp (NULL terminated) */
+};
+
+/* Size of the arena of a subprocess ('envc' is set to the number of
+ * environment variables, '-1' if 'envp' is NULL) */
+static size_t
+subprocess_arena_size (int argc, char **argv, char **envp, int *envc)
+{
+  size_t size = offsetof (struct subprocess_arena, vectors) +
+    (argc + 1) * sizeof (char *);
 
   for (int i = 0; i < argc; i++)
+    size += strlen (argv[i]) + 1;
+
+  *envc = -1;
+  if (envp != NULL)
     {
-      p->argv[i] = malloc ((strlen (argv[i]) + 1) * sizeof (char));
-      /* Handling 'out of memory' */
-      if (p->argv[i] == NULL)
-	{
-	  while (i >= 0)
-	    free (p->argv[i--]);
-	  free (p->argv);
-	  free (p);
-	  p = NULL;
-	  CHECK_ERROR (true, "subprocess allocation failed");
-	}
+      for (*envc = 0; envp[*envc] != NULL; (*envc)++)
+	size += strlen (envp[*envc]) + 1;
 
-      memcpy (p->argv[i], argv[i], strlen(argv[i]) + 1);
+      size += (*envc + 1) * sizeof (char *);
     }
-  p->argv[argc] = NULL;
 
-  /* Copy envp */
-  if (!envp)			/* Handling the case 'envp == NULL' */
+  return size;
+}
+
+/* Copy the 'n' strings of 'from' into 'to' (NULL terminated), the
+ * strings being stored at 'strings'. Returns the end of the strings. */
+static char *
+vector_copy (char **to, char **from, int n, char *strings)
+{
+  for (int i = 0; i < n; i++)
     {
-      p->envp = NULL;
+      size_t length = strlen (from[i]) + 1;
+
+      to[i] = memcpy (strings, from[i], length);
+      strings += length;
     }
-  else
-    {
-      int envp_size = 0;
-      while (envp[envp_size++]);
+  to[n] = NULL;
 
-      p->envp = malloc ((envp_size + 1) * sizeof (char *));
-      /* Handling 'out of memory' */
-      if (p->envp == NULL)
-	{
-	  for (int i = 0; p->argv[i] != NULL; i++)
-	    free (p->argv[i]);
-	  free (p->argv);
-	  free (p);
-	  p = NULL;
-	  CHECK_ERROR (true, "subprocess allocation failed");
-	}
+  return strings;
+}
 
-      for (int i = 0; i < envp_size; i++)
-	{
-	  p->envp[i] = malloc (strlen (envp[i] + 1) * sizeof (char));
-	  /* Handling 'out of memory' */
-	  if (p->envp[i] == NULL)
-	    {
-	      for (int i = 0; p->argv[i] != NULL; i++)
-		free (p->argv[i]);
-	      free (p->argv);
-	      while (i >= 0)
-		free (p->envp[i--]);
-	      free (p->envp);
-	      free (p);
-	      p = NULL;
-	      CHECK_ERROR (true, "subprocess allocation failed");
-	    }
+size_t
+rlimit_subprocess_size (int argc, char **argv, char **envp)
+{
+  int envc;
 
-	  memcpy (p->envp[i], envp[i], strlen(envp[i]) + 1);
-	}
-      p->envp[envp_size] = NULL;
-    }
+  return subprocess_arena_size (argc, argv, envp, &envc);
+}
+
+subprocess_t *
+rlimit_subprocess_create (int argc, char **argv, char **envp)
+{
+  subprocess_t *p = NULL;
+  void *memory = malloc (rlimit_subprocess_size (argc, argv, envp));
+  /* Handling 'out of memory' */
+  CHECK_ERROR ((memory == NULL), "subprocess allocation failed");
 
-  /* Initializing retval and status */
+  p = rlimit_subprocess_create_at (memory, argc, argv, envp);
+  p->arena_owned = true;
+
+fail:
+  return p;
+}
+
+subprocess_t *
+rlimit_subprocess_create_at (void *memory, int argc, char **argv,
+			     char **envp)
+{
+  struct subprocess_arena *arena = memory;
+  subprocess_t *p = &(arena->subprocess);
+  int envc = -1;
+  char *strings;
+
+  if (envp != NULL)
+    for (envc = 0; envp[envc] != NULL; envc++);
+
+  /* Initializing the command line arguments */
+  p->argc = argc;
+  p->argv = arena->vectors;
+  p->envp = (envc >= 0) ? arena->vectors + argc + 1 : NULL;
+
+  /* The strings follow argv and envp */
+  strings = (char *) (arena->vectors + argc + 1 + envc + 1);
+  strings = vector_copy (p->argv, argv, argc, strings);
+  if (p->envp != NULL)
+    vector_copy (p->envp, envp, envc, strings);
+
+  p->arena_owned = false;
+
+  /* Initializing pid, retval and status */
+  p->pid = -1;
   p->status = READY;
   p->retval = 0;
 
@@ -199,6 +352,7 @@ rlimit_subprocess_create (int argc, char **argv, char **envp)
   p->real_time_usec = 0;
   p->user_time_usec = 0;
   p->sys_time_usec = 0;
+  p->instructions = 0;
   p->memory_kbytes = 0;
 
   p->limits = NULL;
@@ -207,34 +361,95 @@ rlimit_subprocess_create (int argc, char **argv, char **envp)
   p->expect_stdout  = 0;
   p->expect_stderr = 0;
 
-  p->monitor = malloc (sizeof (pthread_t));
-  CHECK_ERROR ((p->monitor == NULL), "p->monitor allocation failed");
+  p->stdout_size = 0;
+  p->stdout_length = 0;
+  p->stderr_size = 0;
+  p->stderr_length = 0;
+  p->stdin_head = NULL;
+  p->stdin_tail = NULL;
+  p->stdin_closed = false;
+  p->stdin_lost = false;
+  p->stdin_file = -1;
+  p->stdin_path = NULL;
+  p->stdout_dropped = 0;
+  p->stderr_dropped = 0;
+  p->stdout_shift = 0;
+  p->stderr_shift = 0;
+  p->file_capture = false;
+
+  p->stdout_callback = NULL;
+  p->stdout_data = NULL;
+  p->stderr_callback = NULL;
+  p->stderr_data = NULL;
+  p->stdout_paused = false;
+  p->stderr_paused = false;
+  p->resumes = 0;
+  p->io_wake[0] = p->io_wake[1] = -1;
+
+  p->pidfd = -1;
+  p->forkserver = NULL;
+  p->cgroup = NULL;
+  p->cgroup_fd = -1;
+  p->timeline = NULL;
+  p->perf_counters = false;
+  p->syscall_stats = NULL;
+  memset (&(p->perf), 0, sizeof (rlimit_perf_t));
+  for (int i = 0; i < RLIMIT_PERF_COUNTERS; i++)
+    p->perf_fds[i] = -1;
+  p->cpus_held = false;
+  p->supervised = false;
+  p->supervision = NULL;
+  p->done = false;
+
+  p->monitor = &(arena->monitor);
 
   pthread_mutex_init (&(p->write_mutex), NULL);
+  pthread_cond_init (&(p->stdin_flushed), NULL);
+  pthread_mutex_init (&(p->mutex), NULL);
+  pthread_cond_init (&(p->terminated), NULL);
+
+  /* Expect waits on the output with deadlines of the monotonic clock */
+  pthread_condattr_t attr;
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&(p->output), &attr);
+  pthread_condattr_destroy (&attr);
 
-fail:
   return p;
 }
 
+/* Set the limits of a subprocess to their defaults (stored in its
+ * arena) */
 static limits_t *
-limits_new (void)
+limits_new (subprocess_t * p)
 {
-  limits_t *limits = malloc (sizeof (limits_t));
-  CHECK_ERROR ((limits == NULL), "limits allocation failed");
+  limits_t *limits = &(((struct subprocess_arena *) p)->limits);
 
   /* Default initialization of limits */
-  limits->timeout = 0;
+  limits->timeout_ns = 0;
   limits->memory = 0;
   limits->fsize = 0;
   limits->fd = 0;
   limits->proc = 0;
 
-  limits->syscalls = malloc (sizeof (int));
-  CHECK_ERROR ((limits->syscalls == NULL), "limits allocation failed");
+  limits->policy = NULL;
 
-  limits->syscalls[0] = 0;
+  limits->stdout_limit = 0;
+  limits->stdout_capture = CAPTURE_ALL;
+  limits->stderr_limit = 0;
+  limits->stderr_capture = CAPTURE_ALL;
+
+  limits->cpu_bandwidth = 0;
+  limits->cgroup_limits = 0;
+  limits->sample_interval_ns = 0;
+  limits->cpu_timeout_ns = 0;
+  limits->instructions = 0;
+
+  memset (limits->cpus, 0, sizeof (limits->cpus));
+  limits->mempolicy = MEMPOLICY_DEFAULT;
+  limits->mem_nodes = 0;
+  limits->exclusive_cpus = 0;
 
-fail:
   return limits;
 }
 
@@ -242,12 +457,16 @@ static void
 limits_delete (limits_t * limits)
 {
   if (limits)
-    {
-      free (limits->syscalls);
-      free (limits);
-    }
+    rlimit_policy_unref (limits->policy);
 }
 
+/* Defined with the cgroup backend */
+static void subprocess_cgroup_delete (subprocess_t * p);
+
+/* Defined with the CPU placement */
+static void placement_pin (void);
+static void placement_release (subprocess_t * p);
+
 void
 rlimit_subprocess_delete (subprocess_t * p)
 {
@@ -255,51 +474,72 @@ rlimit_subprocess_delete (subprocess_t * p)
   if (!p)
     return;
 
-  /* Handling still non-dead subprocesses */
-  /* FIXME: What to do if subprocess is still running ? */
-  if (p->status < TERMINATED)
+  /* Killing still running subprocesses, their monitor (or supervisor)
+   * must be done with them before freeing them */
+  if ((p->status > READY) && (p->status < TERMINATED))
     {
       rlimit_warning ("subprocess was still running");
       rlimit_subprocess_kill (p);
+      rlimit_subprocess_wait (p);
     }
 
-  /* Freeing argv and envp */
-  if (p->argv)
-    {
-      for (int i = 0; i < p->argc; i++)
-	free (p->argv[i]);
-
-      free (p->argv);
-    }
+  /* Closing the file descriptors */
+  if (p->stdin)
+    fclose (p->stdin);
+  if (p->stdout)
+    fclose (p->stdout);
+  if (p->stderr)
+    fclose (p->stderr);
 
-  if (p->envp)
-    {
-      for (int i = 0; p->envp[i] != NULL; i++)
-	free (p->envp[i]);
+  if (p->pidfd != -1)
+    close (p->pidfd);
 
-      free (p->envp);
-    }
+  subprocess_cgroup_delete (p);
+  placement_release (p);
 
-  /* Closing the file descriptors */
-  fclose (p->stdin);
-  fclose (p->stdout);
-  fclose (p->stderr);
+  for (int i = 0; i < RLIMIT_PERF_COUNTERS; i++)
+    if (p->perf_fds[i] != -1)
+      close (p->perf_fds[i]);
 
   /* Freeing buffers */
-  free (p->stdin_buffer);
-  free (p->stdout_buffer);
-  free (p->stderr_buffer);
+  free (p->stdin_path);
+  free (p->timeline);
+  free (p->syscall_stats);
+
+  while (p->stdin_head != NULL)
+    {
+      struct io_chunk *chunk = p->stdin_head;
+      p->stdin_head = chunk->next;
+      free (chunk);
+    }
+
+  if (p->file_capture)
+    {
+      if (p->stdout_buffer)
+	munmap (p->stdout_buffer, p->stdout_length + 1);
+      if (p->stderr_buffer)
+	munmap (p->stderr_buffer, p->stderr_length + 1);
+    }
+  else
+    {
+      free (p->stdout_buffer);
+      free (p->stderr_buffer);
+    }
 
-  /* Freeing the monitor and write mutex */
-  free (p->monitor);
+  /* Freeing the mutexes */
   pthread_mutex_destroy (&(p->write_mutex));
+  pthread_cond_destroy (&(p->stdin_flushed));
+  pthread_mutex_destroy (&(p->mutex));
+  pthread_cond_destroy (&(p->terminated));
+  pthread_cond_destroy (&(p->output));
 
-  /* Freeing the limits_t */
+  /* Releasing the policy of the limits */
   if (p->limits)
     limits_delete (p->limits);
 
-  /* Freeing the subprocess */
-  free (p);
+  /* Freeing the arena (argv, envp and limits included) */
+  if (p->arena_owned)
+    free (p);
 }
 
 /* Compute the difference between two timespecs */
@@ -322,742 +562,6005 @@ timespec_diff (struct timespec start, struct timespec end)
   return result;
 }
 
-/* IO monitor to watch the stdin, stdout and stderr file descriptors */
-static void *
-io_monitor (void *arg)
-{
-  subprocess_t *p = arg;
+/* Size of the chunks read from the pipes */
+#define IO_CHUNK 4096
 
-  int nfds;
-  fd_set rfds, wfds;
+/* Output buffer of a stream (STDOUT_FILENO or STDERR_FILENO) */
+struct io_stream
+{
+  char **buffer;		/* Captured output */
+  size_t *size;			/* Allocated size of the buffer */
+  size_t *length;		/* Length of the captured output */
+  size_t *dropped;		/* Bytes dropped by the capture limit */
+  int *expect;			/* Expect cursor in the buffer */
+  size_t *shift;		/* Bytes moved out of the buffer */
+  rlimit_output_cb callback;	/* Consumer of the output (if any) */
+  void *data;			/* Data given to the callback */
+  bool *paused;			/* Reading the stream is paused */
+  size_t head;			/* Bytes kept at the beginning */
+  size_t tail;			/* Bytes kept at the end */
+  int capture;			/* Capture policy (CAPTURE_*) */
+};
 
-  int stdout_fd = fileno (p->stdout);
-  int stderr_fd = fileno (p->stderr);
-  int stdin_fd = fileno (p->stdin);
+static void
+io_stream (subprocess_t * p, int stream, struct io_stream *io)
+{
+  size_t limit = 0;
 
-  size_t stdout_size = 0;
-  size_t stdout_current = 0;
-  size_t stderr_size = 0;
-  size_t stderr_current = 0;
+  io->capture = CAPTURE_ALL;
 
-  while (true)
+  if (stream == STDOUT_FILENO)
     {
-      FD_ZERO (&rfds);
-      FD_SET (stdout_fd, &rfds);
-      FD_SET (stderr_fd, &rfds);
-
-      FD_ZERO (&wfds);
-      FD_SET (stdin_fd, &wfds);
-
-      nfds = (stdout_fd > stderr_fd) ? stdout_fd : stderr_fd;
-      nfds = (stdin_fd > nfds) ? stdin_fd : nfds;
-
-      CHECK_ERROR ((select (nfds + 1, &rfds, &wfds, NULL, NULL) == -1),
-		   "select() failed");
+      io->buffer = &(p->stdout_buffer);
+      io->size = &(p->stdout_size);
+      io->length = &(p->stdout_length);
+      io->dropped = &(p->stdout_dropped);
+      io->expect = &(p->expect_stdout);
+      io->shift = &(p->stdout_shift);
+      io->callback = p->stdout_callback;
+      io->data = p->stdout_data;
+      io->paused = &(p->stdout_paused);
+
+      if (p->limits != NULL)
+	{
+	  limit = p->limits->stdout_limit;
+	  io->capture = p->limits->stdout_capture;
+	}
+    }
+  else
+    {
+      io->buffer = &(p->stderr_buffer);
+      io->size = &(p->stderr_size);
+      io->length = &(p->stderr_length);
+      io->dropped = &(p->stderr_dropped);
+      io->expect = &(p->expect_stderr);
+      io->shift = &(p->stderr_shift);
+      io->callback = p->stderr_callback;
+      io->data = p->stderr_data;
+      io->paused = &(p->stderr_paused);
+
+      if (p->limits != NULL)
+	{
+	  limit = p->limits->stderr_limit;
+	  io->capture = p->limits->stderr_capture;
+	}
+    }
 
-      size_t count;
-      char buffer_stdout[256], buffer_stderr[256];
+  /* Splitting the limit between the head and the tail of the output
+   * (the head is kept as is, the tail slides in a window of twice its
+   * size to move the buffer only once in a while) */
+  switch ((limit > 0) ? (io->capture & ~CAPTURE_KILL) : CAPTURE_ALL)
+    {
+    case CAPTURE_HEAD:
+      io->head = limit;
+      io->tail = 0;
+      break;
 
-      if (FD_ISSET (stdout_fd, &rfds))
-	{
-	  CHECK_ERROR (((int) (count = read (stdout_fd,
-					     buffer_stdout,
-					     sizeof (buffer_stdout))) == -1),
-		       "read(stdout) failed");
+    case CAPTURE_TAIL:
+      io->head = 0;
+      io->tail = limit;
+      break;
 
-	  /* Expand memory if not enough space left */
-	  if ((stdout_current + count + 1) > stdout_size)
-	    {
-	      stdout_size = (stdout_current + count + 1) * 2;
+    case CAPTURE_HEADTAIL:
+      io->head = limit / 2;
+      io->tail = limit - io->head;
+      break;
 
-	      p->stdout_buffer = realloc (p->stdout_buffer, stdout_size);
-	      CHECK_ERROR ((p->stdout_buffer == NULL), "stdout read failed");
-	    }
+    default:
+      io->capture = CAPTURE_ALL;
+      io->head = io->tail = 0;
+    }
+}
 
-	  memcpy(&(p->stdout_buffer[stdout_current]), buffer_stdout, count);
-	  stdout_current += count;
-	  p->stdout_buffer[stdout_current] = '\0';
-	}
+/* Append 'count' bytes of 'data' to the output buffer */
+static int
+io_append (struct io_stream *io, char *data, size_t count)
+{
+  /* Expand memory if not enough space left */
+  if ((*(io->length) + count + 1) > *(io->size))
+    {
+      size_t new_size = (*(io->length) + count + 1) * 2;
+      char *tmp;
 
-      if (FD_ISSET (stderr_fd, &rfds))
-	{
-	  CHECK_ERROR (((int) (count = read (stderr_fd,
-					     buffer_stderr,
-					     sizeof (buffer_stderr))) == -1),
-		       "read(stderr) failed");
+      if ((io->capture != CAPTURE_ALL) &&
+	  (new_size > io->head + 2 * io->tail + 1))
+	new_size = io->head + 2 * io->tail + 1;
 
-	  if ((stderr_current + count + 1) > stderr_size)
-	    {
-	      stderr_size +=
-		((stderr_current + count + 1 - stderr_size) / 1024 + 1) * 1024;
+      if ((tmp = realloc (*(io->buffer), new_size)) == NULL)
+	return RETURN_FAILURE;
 
-	      p->stderr_buffer = realloc (p->stderr_buffer, stderr_size);
-	      CHECK_ERROR ((p->stderr_buffer == NULL), "stderr read failed");
-	    }
+      *(io->buffer) = tmp;
+      *(io->size) = new_size;
+    }
 
-	  memcpy(&(p->stderr_buffer[stderr_current]), buffer_stderr, count);
-	  stderr_current += count;
-	  p->stderr_buffer[stderr_current] = '\0';
-	}
+  memcpy (&((*(io->buffer))[*(io->length)]), data, count);
+  *(io->length) += count;
+  (*(io->buffer))[*(io->length)] = '\0';
 
-      if ((FD_ISSET (stdin_fd, &wfds)) && (p->stdin_buffer != NULL))
-	{
-	  size_t size = strlen (p->stdin_buffer);
+  return RETURN_SUCCESS;
+}
 
-	  count = write (stdin_fd, p->stdin_buffer, size);
+/* Drop the 'count' oldest bytes of the tail of the output */
+static void
+io_slide (struct io_stream *io, size_t count)
+{
+  char *tail;
+  size_t window = *(io->length) - io->head;
 
-	  if (((int) count == -1) && (count != size))
-	    {
-	      rlimit_error ("write(stdin) failed");
-	      goto fail;
-	    }
+  if (count == 0)
+    return;
 
-	  free (p->stdin_buffer);
-	  p->stdin_buffer = NULL;
-	}
-    }
+  tail = &((*(io->buffer))[io->head]);
+  memmove (tail, &(tail[count]), window - count + 1);
+  *(io->length) -= count;
+  *(io->dropped) += count;
+  *(io->shift) += count;
 
-fail:
-  return NULL;
+  /* Keeping the expect cursor on the same output */
+  if ((size_t) *(io->expect) > io->head)
+    *(io->expect) = ((size_t) *(io->expect) - io->head > count) ?
+      *(io->expect) - (int) count : (int) io->head;
 }
 
-/* Watchdog to timeout the subprocess when needed */
-static void *
-watchdog (void *arg)
+/* Store 'n' bytes of output within the capture limit of the stream
+ * (p->mutex locked) */
+static int
+io_store (struct io_stream *io, char *data, size_t n)
 {
-  subprocess_t *p = arg;
-  sigset_t mask;
-  sigemptyset (&mask);
-  sigaddset (&mask, SIGCHLD);
+  if (io->capture == CAPTURE_ALL)
+    return io_append (io, data, n);
+
+  /* Filling the head first */
+  if (*(io->length) < io->head)
+    {
+      size_t part = (n < io->head - *(io->length)) ?
+	n : io->head - *(io->length);
 
-  struct timespec timeout;
-  timeout.tv_sec = p->limits->timeout;
-  timeout.tv_nsec = 0;
+      if (io_append (io, data, part) == RETURN_FAILURE)
+	return RETURN_FAILURE;
 
-  while (true)
+      data += part;
+      n -= part;
+    }
+
+  /* Then the tail (if any) */
+  if ((n > 0) && (io->tail == 0))
+    *(io->dropped) += n;
+  else if (n > 0)
     {
-      if (sigtimedwait (&mask, NULL, &timeout) == -1)
+      size_t window = *(io->length) - io->head;
+
+      if (window + n > 2 * io->tail)
 	{
-	  if (errno == EINTR)
-	    {
-	      /* Interrupted by a signal other than SIGCHLD. */
-	      continue;
-	    }
-	  else if (errno == EAGAIN)
+	  size_t excess = window + n - io->tail;
+
+	  if (excess > window)
 	    {
-	      if (p->status < TERMINATED)
-		{
-		  p->status = TIMEOUT;
-		  kill (p->pid, SIGKILL);
-		}
+	      /* The chunk overwrites the whole tail */
+	      io_slide (io, window);
+	      *(io->dropped) += excess - window;
+	      data += excess - window;
+	      n -= excess - window;
 	    }
 	  else
-	    {
-	      rlimit_error ("sigtimedwait failed");
-	    }
+	    io_slide (io, excess);
 	}
-      break;
+
+      if (io_append (io, data, n) == RETURN_FAILURE)
+	return RETURN_FAILURE;
     }
 
-  return NULL;
+  return RETURN_SUCCESS;
 }
 
-/* Monitor for the child process */
-static int
-child_monitor (subprocess_t * p,
-	       int stdin_pipe[2], int stdout_pipe[2], int stderr_pipe[2])
+/* Read a chunk of output from 'fd' and append it to the buffer of the
+ * stream (STDOUT_FILENO or STDERR_FILENO) within its capture limit.
+ * Returns the number of bytes read ('0' at end-of-file and '-1' on
+ * error) */
+static ssize_t
+io_read (subprocess_t * p, int stream, int fd)
 {
-  int ret = RETURN_SUCCESS;
-
-  /* Set the limits on the process */
-  if (p->limits != NULL)
-    {
-      /* Setting the rlimits */
-      struct rlimit limit;
+  char chunk[IO_CHUNK];
+  struct io_stream io;
+  bool exceeded;
+  ssize_t count;
+  int ret;
 
-      /* Setting a limit on the memory */
-      if (p->limits->memory > 0)
-	{
-	  CHECK_ERROR ((getrlimit (RLIMIT_AS, &limit) == -1),
-		       "getting memory limit failed");
+  if ((count = read (fd, chunk, sizeof (chunk))) <= 0)
+    return count;
 
-	  limit.rlim_cur = p->limits->memory;
+  io_stream (p, stream, &io);
 
-	  CHECK_ERROR ((setrlimit (RLIMIT_AS, &limit) == -1),
-		       "setting memory limit failed");
-	}
+  /* Streaming the chunk to the consumer */
+  if (io.callback != NULL)
+    {
+      unsigned int resumes = p->resumes;
 
-      /* Setting a limit on file size */
-      if (p->limits->fsize > 0)
+      if (io.callback (p, chunk, count, io.data) == RLIMIT_PAUSE)
 	{
-	  CHECK_ERROR ((getrlimit (RLIMIT_FSIZE, &limit) == -1),
-		       "getting file size limit failed");
-
-	  limit.rlim_cur = p->limits->fsize;
-
-	  CHECK_ERROR ((setrlimit (RLIMIT_FSIZE, &limit) == -1),
-		       "setting file size limit failed");
+	  /* Unless resumed in the meantime */
+	  pthread_mutex_lock (&(p->mutex));
+	  if (p->resumes == resumes)
+	    *(io.paused) = true;
+	  pthread_mutex_unlock (&(p->mutex));
 	}
 
-      /* Setting a limit on file descriptor number */
-      if (p->limits->fd > 0)
-	{
-	  CHECK_ERROR ((getrlimit (RLIMIT_NOFILE, &limit) == -1),
-		       "getting maximum fd number limit failed");
-
-	  limit.rlim_cur = p->limits->fd;
+      return count;
+    }
 
-	  CHECK_ERROR ((setrlimit (RLIMIT_NOFILE, &limit) == -1),
-		       "setting maximum fd number limit failed");
-	}
+  /* Storing the chunk and notifying the expect waiters */
+  pthread_mutex_lock (&(p->mutex));
+  ret = io_store (&io, chunk, count);
 
-      /* Setting a limit on process number */
-      if (p->limits->proc > 0)
-	{
-	  CHECK_ERROR ((getrlimit (RLIMIT_NPROC, &limit) == -1),
-		       "getting maximum process number limit failed");
+  /* Over the limit once the output seen so far (captured or dropped)
+   * does not fit in the head and the tail anymore */
+  exceeded = ((io.capture & CAPTURE_KILL) && (p->status < TERMINATED) &&
+	      (*(io.length) + *(io.dropped) > io.head + io.tail));
+  if (exceeded)
+    p->status = OUTPUTEXCEED;
 
-	  limit.rlim_cur = p->limits->proc;
+  pthread_cond_broadcast (&(p->output));
+  pthread_mutex_unlock (&(p->mutex));
 
-	  CHECK_ERROR ((setrlimit (RLIMIT_NPROC, &limit) == -1),
-		       "setting maximum process number limit failed");
-	}
+  if (ret == RETURN_FAILURE)
+    return -1;
 
-      /* Setting a syscall tracer on the process */
-      if (p->limits->syscalls[0] > 0)
-	{
-	  CHECK_ERROR ((ptrace (PTRACE_TRACEME, 0, NULL, NULL) == -1),
-		       "ptrace failed");
-	}
-    }
+  /* Killing the subprocess when the limit is hit (if requested) */
+  if (exceeded)
+    subprocess_send_signal (p, SIGKILL);
 
-  /* Setting i/o handlers */
-  CHECK_ERROR ((close (stdin_pipe[1]) == -1), "close(stdin[1]) failed");
-  CHECK_ERROR ((dup2 (stdin_pipe[0], STDIN_FILENO) == -1),
-	       "dup(stdin) failed");
-  CHECK_ERROR ((close (stdin_pipe[0]) == -1), "close(stdin[0]) failed");
+  return count;
+}
 
-  CHECK_ERROR ((close (stdout_pipe[0]) == -1), "close(stdout[0]) failed");
-  CHECK_ERROR ((dup2 (stdout_pipe[1], STDOUT_FILENO) == -1),
-	       "dup(stdout) failed");
-  CHECK_ERROR ((close (stdout_pipe[1]) == -1), "close(stdout[1]) failed");
+/* Read the output left in 'fd' (once the subprocess is over) and trim
+ * the tail to its limit */
+static void
+io_drain (subprocess_t * p, int stream, int fd)
+{
+  struct io_stream io;
+  int flags = fcntl (fd, F_GETFL);
 
-  CHECK_ERROR ((close (stderr_pipe[0]) == -1), "close(stderr[0]) failed");
-  CHECK_ERROR ((dup2 (stderr_pipe[1], STDERR_FILENO) == -1),
-	       "dup(stderr) failed");
-  CHECK_ERROR ((close (stderr_pipe[1]) == -1), "close(stderr[1]) failed");
+  /* Descendants may keep the pipe open, do not wait for them */
+  if ((flags != -1) && !(flags & O_NONBLOCK))
+    fcntl (fd, F_SETFL, flags | O_NONBLOCK);
 
-  /* Run the command line */
-  CHECK_ERROR((execve (p->argv[0], p->argv, p->envp) == -1),
-	      "execve failed");
+  while (io_read (p, stream, fd) > 0)
+    continue;
 
-  if (false)
-  fail:
-    ret = RETURN_FAILURE;
+  io_stream (p, stream, &io);
 
-  return ret;
+  pthread_mutex_lock (&(p->mutex));
+  if ((io.tail > 0) && (*(io.length) - io.head > io.tail))
+    io_slide (&io, *(io.length) - io.head - io.tail);
+  pthread_mutex_unlock (&(p->mutex));
 }
 
+/* Create the anonymous file capturing an output stream */
 static int
-syscall_filter (subprocess_t * p, int *status, struct rusage *usage)
+io_capture_file (void)
 {
-  int syscall_id;
-  bool syscall_enter = true;
-  int ret = RETURN_SUCCESS;
+#ifdef HAVE_MEMFD_CREATE
+  return memfd_create ("rlimit-output", MFD_CLOEXEC);
+#else
+  char path[] = "/tmp/rlimit-XXXXXX";
+  int fd = mkostemp (path, O_CLOEXEC);
 
-  while (true)
-    {
-      struct user_regs_struct regs;
+  if (fd != -1)
+    unlink (path);
 
-      CHECK_ERROR ((ptrace (PTRACE_SYSCALL, p->pid, NULL, NULL) == -1),
-		   "ptrace failed");
-      CHECK_ERROR ((wait4 (p->pid, status, 0, usage) == -1), "wait failed");
+  return fd;
+#endif /* HAVE_MEMFD_CREATE */
+}
 
-      if (WIFEXITED (*status) || WIFSIGNALED (*status) || WCOREDUMP (*status))
-	break;
+/* Map the output captured in the file 'fd' (once the subprocess is
+ * over) into the buffer of the stream */
+static void
+io_map (subprocess_t * p, int stream, int fd)
+{
+  struct io_stream io;
+  struct stat st;
+  char *data;
 
-      CHECK_ERROR ((ptrace (PTRACE_GETREGS, p->pid, NULL, &regs) == -1),
-		   "ptrace failed");
+  io_stream (p, stream, &io);
 
-      /* Getting syscall number is architecture dependant */
-#if __WORDSIZE == 64
-      syscall_id = regs.orig_rax;
-#elif __WORDSIZE == 32
-      syscall_id = regs.orig_eax;
-#endif
+  CHECK_ERROR ((fstat (fd, &st) == -1), "fstat(output) failed");
 
-      if (syscall_enter)
-	{
-	  for (int i = 1; i <= p->limits->syscalls[0]; i++)
-	    if (syscall_id == p->limits->syscalls[i])
-	      {
-		p->status = DENIEDSYSCALL;
-		rlimit_subprocess_kill (p);
-		goto fail;
-	      }
-	}
+  /* One more (zero) byte to keep the output a string */
+  CHECK_ERROR ((ftruncate (fd, st.st_size + 1) == -1),
+	       "ftruncate(output) failed");
 
-      syscall_enter ^= true;
-    }
+  data = mmap (NULL, st.st_size + 1, PROT_READ, MAP_SHARED, fd, 0);
+  CHECK_ERROR ((data == MAP_FAILED), "mmap(output) failed");
 
-  if (false)
-  fail:
-    ret = RETURN_FAILURE;
+  pthread_mutex_lock (&(p->mutex));
+  *(io.buffer) = data;
+  *(io.length) = st.st_size;
+  *(io.size) = 0;
+  pthread_mutex_unlock (&(p->mutex));
 
-  return ret;
+fail:
+  return;
 }
 
-/* Monitoring the subprocess end and get the return value */
-static void *
-monitor (void *arg)
+/* Collect the output left once the subprocess is over */
+static void
+io_finish (subprocess_t * p)
 {
-  subprocess_t *p = arg;
+  if (p->file_capture)
+    {
+      io_map (p, STDOUT_FILENO, fileno (p->stdout));
+      io_map (p, STDERR_FILENO, fileno (p->stderr));
+    }
+  else
+    {
+      io_drain (p, STDOUT_FILENO, fileno (p->stdout));
+      io_drain (p, STDERR_FILENO, fileno (p->stderr));
+    }
+}
+
+/* Drop the stdin queue and refuse the next chunks (p->write_mutex
+ * locked) */
+static void
+io_write_close (subprocess_t * p)
+{
+  while (p->stdin_head != NULL)
+    {
+      struct io_chunk *chunk = p->stdin_head;
+
+      p->stdin_head = chunk->next;
+      p->stdin_lost = true;
+      free (chunk);
+    }
+
+  p->stdin_tail = NULL;
+  p->stdin_closed = true;
+  pthread_cond_broadcast (&(p->stdin_flushed));
+}
+
+/* Write the stdin queue to the (non-blocking) 'fd' (p->write_mutex
+ * locked). Returns '1' when the queue is empty, '0' if some is left
+ * and '-1' on error (the queue is then dropped) */
+static int
+io_write (subprocess_t * p, int fd)
+{
+  struct iovec iov[16];
+  struct io_chunk *chunk = p->stdin_head;
+  int n = 0;
+  ssize_t count;
+
+  for (; (chunk != NULL) && (n < 16); chunk = chunk->next, n++)
+    {
+      iov[n].iov_base = &(chunk->data[chunk->offset]);
+      iov[n].iov_len = chunk->length - chunk->offset;
+    }
+
+  if ((n > 0) && ((count = writev (fd, iov, n)) == -1))
+    {
+      if ((errno == EAGAIN) || (errno == EINTR))
+	return 0;
+
+      io_write_close (p);
+      return -1;
+    }
+
+  /* Dropping the chunks written */
+  while ((n > 0) && (count > 0))
+    {
+      chunk = p->stdin_head;
+
+      if ((size_t) count < chunk->length - chunk->offset)
+	{
+	  chunk->offset += count;
+	  break;
+	}
+
+      count -= chunk->length - chunk->offset;
+      p->stdin_head = chunk->next;
+      free (chunk);
+    }
+
+  if (p->stdin_head != NULL)
+    return 0;
+
+  p->stdin_tail = NULL;
+  pthread_cond_broadcast (&(p->stdin_flushed));
+
+  return 1;
+}
+
+/* IO monitor to watch the stdin, stdout and stderr file descriptors */
+static void *
+io_monitor (void *arg)
+{
+  subprocess_t *p = arg;
+
+  int nfds;
+  fd_set rfds, wfds;
+
+  /* Files capturing the output are mapped at the end */
+  int stdout_fd = (p->file_capture) ? -1 : fileno (p->stdout);
+  int stderr_fd = (p->file_capture) ? -1 : fileno (p->stderr);
+  int stdin_fd = fileno (p->stdin);
+  int wake_fd = p->io_wake[0];
+  bool stdin_pending, stdout_paused, stderr_paused;
+  ssize_t count;
+  sigset_t mask;
+
+  placement_pin ();
+
+  /* Writing to a closed stdin must fail with EPIPE (not kill us) */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGPIPE);
+  pthread_sigmask (SIG_BLOCK, &mask, NULL);
+
+  while (true)
+    {
+      pthread_mutex_lock (&(p->write_mutex));
+      stdin_pending = (p->stdin_head != NULL);
+      pthread_mutex_unlock (&(p->write_mutex));
+
+      pthread_mutex_lock (&(p->mutex));
+      stdout_paused = p->stdout_paused;
+      stderr_paused = p->stderr_paused;
+      pthread_mutex_unlock (&(p->mutex));
+
+      FD_ZERO (&rfds);
+      FD_SET (wake_fd, &rfds);
+      if ((stdout_fd != -1) && !stdout_paused)
+	FD_SET (stdout_fd, &rfds);
+      if ((stderr_fd != -1) && !stderr_paused)
+	FD_SET (stderr_fd, &rfds);
+
+      /* Watching stdin only when there is something to write */
+      FD_ZERO (&wfds);
+      if ((stdin_fd != -1) && stdin_pending)
+	FD_SET (stdin_fd, &wfds);
+
+      nfds = (stdout_fd > stderr_fd) ? stdout_fd : stderr_fd;
+      nfds = (stdin_fd > nfds) ? stdin_fd : nfds;
+      nfds = (wake_fd > nfds) ? wake_fd : nfds;
+
+      CHECK_ERROR ((select (nfds + 1, &rfds, &wfds, NULL, NULL) == -1),
+		   "select() failed");
+
+      /* Being cancelled only while waiting (never losing a chunk) */
+      pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, NULL);
+
+      /* Woken up to watch the resumed streams (or stdin) again */
+      if (FD_ISSET (wake_fd, &rfds))
+	{
+	  char wake[16];
+	  while (read (wake_fd, wake, sizeof (wake)) > 0)
+	    continue;
+	}
+
+      /* Streams at end-of-file are not watched anymore */
+      if ((stdout_fd != -1) && FD_ISSET (stdout_fd, &rfds))
+	{
+	  CHECK_ERROR (((count = io_read (p, STDOUT_FILENO, stdout_fd)) ==
+			-1), "read(stdout) failed");
+	  if (count == 0)
+	    stdout_fd = -1;
+	}
+
+      if ((stderr_fd != -1) && FD_ISSET (stderr_fd, &rfds))
+	{
+	  CHECK_ERROR (((count = io_read (p, STDERR_FILENO, stderr_fd)) ==
+			-1), "read(stderr) failed");
+	  if (count == 0)
+	    stderr_fd = -1;
+	}
+
+      if ((stdin_fd != -1) && FD_ISSET (stdin_fd, &wfds))
+	{
+	  pthread_mutex_lock (&(p->write_mutex));
+	  if (io_write (p, stdin_fd) == -1)
+	    stdin_fd = -1;
+	  pthread_mutex_unlock (&(p->write_mutex));
+	}
+
+      pthread_setcancelstate (PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+fail:
+  return NULL;
+}
+
+/* Syscall filtering through seccomp-bpf: the forbidden syscalls are
+ * compiled into a BPF program that the child installs just before
+ * execve(). The kernel then kills the subprocess (SIGSYS) when it
+ * hits one of them and the allowed syscalls run at full speed. When
+ * seccomp is not available, we fall back on the (slow) ptrace
+ * tracer. */
+struct sock_fprog;
+
+#ifdef HAVE_SECCOMP
+static bool seccomp_supported = false;
+static pthread_once_t seccomp_once = PTHREAD_ONCE_INIT;
+
+static void
+seccomp_probe (void)
+{
+  /* A NULL program is rejected with EFAULT only if filters exist */
+  if ((prctl (PR_SET_SECCOMP, SECCOMP_MODE_FILTER, NULL, 0, 0) == -1) &&
+      (errno == EFAULT))
+    seccomp_supported = true;
+}
+
+/* Build a filter from the forbidden syscalls (NULL if not possible) */
+static struct sock_fprog *
+seccomp_filter_new (rlimit_policy_t * policy)
+{
+  int *syscalls = policy->syscalls;
+  struct sock_fprog *filter = NULL;
+  struct sock_filter *code;
+  int n = 0;
+
+  pthread_once (&seccomp_once, seccomp_probe);
+
+  if (!seccomp_supported)
+    return NULL;
+
+  /* The initial execve() must go through, leave it to ptrace */
+  if (rlimit_policy_is_denied (policy, SYS_execve))
+    return NULL;
+#ifdef SYS_execveat
+  if (rlimit_policy_is_denied (policy, SYS_execveat))
+    return NULL;
+#endif
+
+  filter = malloc (sizeof (struct sock_fprog));
+  code = malloc ((2 * syscalls[0] + 7) * sizeof (struct sock_filter));
+  if ((filter == NULL) || (code == NULL))
+    {
+      free (filter);
+      free (code);
+      rlimit_error ("seccomp filter allocation failed");
+      return NULL;
+    }
+
+  /* Reject syscalls coming from another ABI */
+  code[n++] = (struct sock_filter)
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, offsetof (struct seccomp_data, arch));
+  code[n++] = (struct sock_filter)
+    BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_AUDIT_ARCH, 1, 0);
+  code[n++] = (struct sock_filter)
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+
+  code[n++] = (struct sock_filter)
+    BPF_STMT (BPF_LD | BPF_W | BPF_ABS, offsetof (struct seccomp_data, nr));
+
+#ifdef __x86_64__
+  /* x32 syscalls share the x86_64 arch but have the X32 bit set */
+  code[n++] = (struct sock_filter)
+    BPF_JUMP (BPF_JMP | BPF_JGE | BPF_K, 0x40000000, 0, 1);
+  code[n++] = (struct sock_filter)
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+#endif
+
+  for (int i = 1; i <= syscalls[0]; i++)
+    {
+      code[n++] = (struct sock_filter)
+	BPF_JUMP (BPF_JMP | BPF_JEQ | BPF_K, syscalls[i], 0, 1);
+      code[n++] = (struct sock_filter)
+	BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_KILL_PROCESS);
+    }
+
+  code[n++] = (struct sock_filter)
+    BPF_STMT (BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+
+  filter->len = n;
+  filter->filter = code;
+
+  return filter;
+}
+
+static void
+seccomp_filter_delete (struct sock_fprog *filter)
+{
+  if (filter)
+    {
+      free (filter->filter);
+      free (filter);
+    }
+}
+#endif /* HAVE_SECCOMP */
+
+/***** Syscall policies *****/
+
+rlimit_policy_t *
+rlimit_policy_new (void)
+{
+  rlimit_policy_t *policy = malloc (sizeof (rlimit_policy_t));
+  CHECK_ERROR ((policy == NULL), "policy allocation failed");
+
+  policy->refcount = 1;
+  policy->compiled = false;
+  policy->capacity = 8;
+  policy->bitmap = NULL;
+  policy->bitmap_words = 0;
+  policy->filter = NULL;
+
+  policy->syscalls = malloc (policy->capacity * sizeof (int));
+  if (policy->syscalls == NULL)
+    {
+      free (policy);
+      policy = NULL;
+      CHECK_ERROR (true, "policy allocation failed");
+    }
+  policy->syscalls[0] = 0;
+
+  pthread_mutex_init (&(policy->mutex), NULL);
+
+fail:
+  return policy;
+}
+
+rlimit_policy_t *
+rlimit_policy_ref (rlimit_policy_t * policy)
+{
+  if (policy)
+    __sync_add_and_fetch (&(policy->refcount), 1);
+
+  return policy;
+}
+
+void
+rlimit_policy_unref (rlimit_policy_t * policy)
+{
+  if ((policy == NULL) || (__sync_sub_and_fetch (&(policy->refcount), 1) > 0))
+    return;
+
+#ifdef HAVE_SECCOMP
+  seccomp_filter_delete (policy->filter);
+#endif /* HAVE_SECCOMP */
+
+  pthread_mutex_destroy (&(policy->mutex));
+  free (policy->syscalls);
+  free (policy->bitmap);
+  free (policy);
+}
+
+int
+rlimit_policy_deny_syscall (rlimit_policy_t * policy, int syscall)
+{
+  int ret = RETURN_SUCCESS;
+
+  CHECK_ERROR ((policy == NULL) || (syscall < 0), "invalid syscall");
+  CHECK_ERROR (policy->compiled, "policy is already compiled");
+
+  if (rlimit_policy_is_denied (policy, syscall))
+    return ret;
+
+  /* Growing the bitmap to reach the syscall id */
+  if (syscall / (int) POLICY_WORD_BITS >= policy->bitmap_words)
+    {
+      int words = syscall / POLICY_WORD_BITS + 1;
+      unsigned long *bitmap =
+	realloc (policy->bitmap, words * sizeof (unsigned long));
+      CHECK_ERROR ((bitmap == NULL), "policy allocation failed");
+
+      memset (&(bitmap[policy->bitmap_words]), 0,
+	      (words - policy->bitmap_words) * sizeof (unsigned long));
+      policy->bitmap = bitmap;
+      policy->bitmap_words = words;
+    }
+
+  /* Growing the list of syscalls (amortized) */
+  if (policy->syscalls[0] + 1 >= policy->capacity)
+    {
+      int *syscalls = realloc (policy->syscalls,
+			       2 * policy->capacity * sizeof (int));
+      CHECK_ERROR ((syscalls == NULL), "policy allocation failed");
+
+      policy->syscalls = syscalls;
+      policy->capacity *= 2;
+    }
+
+  policy->syscalls[++(policy->syscalls[0])] = syscall;
+  policy->bitmap[syscall / POLICY_WORD_BITS] |=
+    1UL << (syscall % POLICY_WORD_BITS);
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+int
+rlimit_policy_compile (rlimit_policy_t * policy)
+{
+  int ret = RETURN_SUCCESS;
+
+  CHECK_ERROR ((policy == NULL), "invalid policy");
+
+  pthread_mutex_lock (&(policy->mutex));
+
+  if (!policy->compiled)
+    {
+#ifdef HAVE_SECCOMP
+      if (policy->syscalls[0] > 0)
+	policy->filter = seccomp_filter_new (policy);
+#endif /* HAVE_SECCOMP */
+
+      policy->compiled = true;
+    }
+
+  pthread_mutex_unlock (&(policy->mutex));
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+bool
+rlimit_policy_is_denied (rlimit_policy_t * policy, int syscall)
+{
+  if ((policy == NULL) || (syscall < 0) ||
+      (syscall / (int) POLICY_WORD_BITS >= policy->bitmap_words))
+    return false;
+
+  return (policy->bitmap[syscall / POLICY_WORD_BITS] >>
+	  (syscall % POLICY_WORD_BITS)) & 1UL;
+}
+
+/* Copy a policy to modify it (the copy is not compiled) */
+static rlimit_policy_t *
+policy_copy (rlimit_policy_t * policy)
+{
+  rlimit_policy_t *copy = rlimit_policy_new ();
+
+  if (copy == NULL)
+    return NULL;
+
+  for (int i = 1; i <= policy->syscalls[0]; i++)
+    if (rlimit_policy_deny_syscall (copy, policy->syscalls[i]) ==
+	RETURN_FAILURE)
+      {
+	rlimit_policy_unref (copy);
+	return NULL;
+      }
+
+  return copy;
+}
+
+/* Check if some syscalls have to be filtered */
+static bool
+policy_is_empty (rlimit_policy_t * policy)
+{
+  return ((policy == NULL) || (policy->syscalls[0] == 0));
+}
+
+/***** Timers *****/
+
+/* Timeouts are handled by hierarchical timing wheels (one for the
+ * threaded engine and one per supervisor thread), each driven by a
+ * single timerfd. A wheel has WHEEL_LEVELS levels of WHEEL_SIZE slots,
+ * the slots of level 'l' covering WHEEL_SIZE^l ticks of WHEEL_TICK_NS
+ * nanoseconds. Arming and cancelling a timer is O(1), timers of the
+ * upper levels are cascaded down to the lower ones as time goes. */
+#define WHEEL_BITS     8
+#define WHEEL_SIZE     (1 << WHEEL_BITS)
+#define WHEEL_MASK     (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS   4
+#define WHEEL_RANGE    (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_TICK_NS  1000000ULL	/* 1 ms */
+
+struct wheel_timer
+{
+  uint64_t expires;		/* Expiration date (in ticks) */
+  void (*callback) (void *data);	/* Called (wheel locked) on expiration */
+  void *data;			/* Data given to the callback */
+  struct wheel_timer *next;	/* Next timer in the same slot */
+  struct wheel_timer **pprev;	/* Link to this timer (NULL if not armed) */
+};
+
+typedef struct wheel
+{
+  pthread_mutex_t mutex;	/* Mutex locking the wheel */
+  int fd;			/* timerfd firing at the next expiration */
+  uint64_t now;			/* Current date (in ticks) */
+  uint64_t armed;		/* Date the timerfd is armed at ('0' if not) */
+  int count;			/* Number of armed timers */
+  struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+} wheel_t;
+
+static uint64_t
+timespec_to_ns (struct timespec ts)
+{
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Current date of the monotonic clock (in ticks) */
+static uint64_t
+wheel_clock (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+
+  return timespec_to_ns (now) / WHEEL_TICK_NS;
+}
+
+static int
+wheel_init (wheel_t * w)
+{
+  memset (w->slots, 0, sizeof (w->slots));
+  w->now = wheel_clock ();
+  w->armed = 0;
+  w->count = 0;
+
+  if ((w->fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1)
+    return RETURN_FAILURE;
+
+  pthread_mutex_init (&(w->mutex), NULL);
+
+  return RETURN_SUCCESS;
+}
+
+static void
+wheel_destroy (wheel_t * w)
+{
+  close (w->fd);
+  pthread_mutex_destroy (&(w->mutex));
+}
+
+/* Link the timer at the head of a slot */
+static void
+wheel_link (struct wheel_timer **slot, struct wheel_timer *t)
+{
+  t->next = *slot;
+  if (t->next != NULL)
+    t->next->pprev = &(t->next);
+  t->pprev = slot;
+  *slot = t;
+}
+
+/* Link the timer in the slot matching its expiration date */
+static void
+wheel_insert (wheel_t * w, struct wheel_timer *t)
+{
+  uint64_t expires = t->expires;
+  int level = 0;
+
+  if (expires <= w->now)
+    expires = t->expires = w->now + 1;
+  else if (expires - w->now >= WHEEL_RANGE)
+    expires = w->now + WHEEL_RANGE - 1;	/* Cascaded again later */
+
+  while ((level < WHEEL_LEVELS - 1) &&
+	 (expires - w->now >= (1ULL << (WHEEL_BITS * (level + 1)))))
+    level++;
+
+  wheel_link (&(w->slots[level][(expires >> (WHEEL_BITS * level)) &
+				 WHEEL_MASK]), t);
+}
+
+static void
+wheel_unlink (struct wheel_timer *t)
+{
+  *(t->pprev) = t->next;
+  if (t->next != NULL)
+    t->next->pprev = t->pprev;
+  t->pprev = NULL;
+}
+
+/* Date of the next expiration ('0' if no timer is armed) */
+static uint64_t
+wheel_next (wheel_t * w)
+{
+  uint64_t next = 0;
+
+  for (int level = 0; level < WHEEL_LEVELS; level++)
+    for (int k = 1; k <= WHEEL_SIZE; k++)
+      {
+	struct wheel_timer *t =
+	  w->slots[level][((w->now >> (WHEEL_BITS * level)) + k) & WHEEL_MASK];
+
+	if (t == NULL)
+	  continue;
+
+	/* Later slots of this level expire after this one */
+	for (; t != NULL; t = t->next)
+	  if ((next == 0) || (t->expires < next))
+	    next = t->expires;
+	break;
+      }
+
+  return next;
+}
+
+/* Arm the timerfd at the next expiration date */
+static void
+wheel_arm (wheel_t * w)
+{
+  uint64_t next = wheel_next (w);
+  struct itimerspec date = {.it_interval = {0, 0},.it_value = {0, 0} };
+
+  if (next == w->armed)
+    return;
+
+  date.it_value.tv_sec = (next * WHEEL_TICK_NS) / 1000000000ULL;
+  date.it_value.tv_nsec = (next * WHEEL_TICK_NS) % 1000000000ULL;
+
+  if (timerfd_settime (w->fd, TFD_TIMER_ABSTIME, &date, NULL) == -1)
+    rlimit_error ("timerfd_settime failed");
+
+  w->armed = next;
+}
+
+/* Arm a timer expiring at 'date' (in nanoseconds, monotonic clock) */
+static void
+wheel_add (wheel_t * w, struct wheel_timer *t, uint64_t date)
+{
+  pthread_mutex_lock (&(w->mutex));
+
+  /* Rounded up to never expire early */
+  t->expires = (date + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+  wheel_insert (w, t);
+  w->count++;
+
+  if ((w->armed == 0) || (t->expires < w->armed))
+    wheel_arm (w);
+
+  pthread_mutex_unlock (&(w->mutex));
+}
+
+/* Arm again a timer from its callback (wheel locked), 'interval' (in
+ * nanoseconds) from now (late ticks are not caught up) */
+static void
+wheel_rearm (wheel_t * w, struct wheel_timer *t, uint64_t interval)
+{
+  t->expires = wheel_clock () + (interval + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+  wheel_insert (w, t);
+  w->count++;
+}
+
+/* Disarm a timer (its callback is not running once this returns) */
+static void
+wheel_cancel (wheel_t * w, struct wheel_timer *t)
+{
+  pthread_mutex_lock (&(w->mutex));
+
+  if (t->pprev != NULL)
+    {
+      wheel_unlink (t);
+      w->count--;
+    }
+
+  pthread_mutex_unlock (&(w->mutex));
+}
+
+/* Next date after w->now (in ticks) at which a slot has timers to
+ * fire (level 0) or to cascade (upper levels), 'limit' if none comes
+ * before. The empty slots in between are skipped at once. */
+static uint64_t
+wheel_step (wheel_t * w, uint64_t limit)
+{
+  uint64_t next = limit;
+
+  for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+      uint64_t base = w->now >> (WHEEL_BITS * level);
+
+      for (int k = 1; k <= WHEEL_SIZE; k++)
+	{
+	  uint64_t date = (base + k) << (WHEEL_BITS * level);
+
+	  if (date >= next)
+	    break;
+
+	  if (w->slots[level][(base + k) & WHEEL_MASK] != NULL)
+	    {
+	      next = date;
+	      break;
+	    }
+	}
+    }
+
+  return next;
+}
+
+/* Fire the expired timers (called when the timerfd is readable) */
+static void
+wheel_expire (wheel_t * w)
+{
+  uint64_t expirations, date = wheel_clock ();
+
+  if (read (w->fd, &expirations, sizeof (expirations)) == -1)
+    {
+      if (errno != EAGAIN)
+	rlimit_error ("read(timerfd) failed");
+    }
+
+  pthread_mutex_lock (&(w->mutex));
+
+  while (w->now < date)
+    {
+      if (w->count == 0)
+	{
+	  w->now = date;
+	  break;
+	}
+
+      w->now = wheel_step (w, date);
+
+      /* Cascading the upper levels when the lower ones wrap around */
+      for (int level = 1; level < WHEEL_LEVELS; level++)
+	{
+	  if ((w->now & ((1ULL << (WHEEL_BITS * level)) - 1)) != 0)
+	    break;
+
+	  struct wheel_timer **slot =
+	    &(w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+	  struct wheel_timer *t = *slot;
+
+	  *slot = NULL;
+	  while (t != NULL)
+	    {
+	      struct wheel_timer *next = t->next;
+
+	      /* Expiring now, fired below with the current slot */
+	      if (t->expires <= w->now)
+		wheel_link (&(w->slots[0][w->now & WHEEL_MASK]), t);
+	      else
+		wheel_insert (w, t);
+	      t = next;
+	    }
+	}
+
+      /* Firing the timers of the current slot */
+      struct wheel_timer **slot = &(w->slots[0][w->now & WHEEL_MASK]);
+
+      while (*slot != NULL)
+	{
+	  struct wheel_timer *t = *slot;
+
+	  wheel_unlink (t);
+	  w->count--;
+	  t->callback (t->data);
+	}
+    }
+
+  w->armed = 0;
+  wheel_arm (w);
+
+  pthread_mutex_unlock (&(w->mutex));
+}
+
+/* Timers of the subprocesses run by monitor threads */
+static wheel_t monitor_timers;
+static bool monitor_timers_started = false;
+static pthread_once_t monitor_timers_once = PTHREAD_ONCE_INIT;
+
+static void *
+timer_loop (void *arg)
+{
+  wheel_t *w = arg;
+  struct pollfd pfd = {.fd = w->fd,.events = POLLIN };
+
+  placement_pin ();
+
+  while (true)
+    {
+      if (poll (&pfd, 1, -1) == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  rlimit_error ("poll(timerfd) failed");
+	  break;
+	}
+
+      wheel_expire (w);
+    }
+
+  return NULL;
+}
+
+static void
+monitor_timers_start (void)
+{
+  pthread_t thread;
+
+  if (wheel_init (&monitor_timers) == RETURN_FAILURE)
+    {
+      rlimit_error ("timer wheel creation failed");
+      return;
+    }
+
+  if (pthread_create (&thread, NULL, timer_loop, &monitor_timers) != 0)
+    {
+      rlimit_error ("timer thread creation failed");
+      wheel_destroy (&monitor_timers);
+      return;
+    }
+
+  pthread_detach (thread);
+  monitor_timers_started = true;
+}
+
+/* Timeout of a subprocess */
+static void
+timeout_expired (void *data)
+{
+  subprocess_t *p = data;
+
+  if (p->status < TERMINATED)
+    {
+      p->status = TIMEOUT;
+      subprocess_send_signal (p, SIGKILL);
+    }
+}
+
+/* Arm the timeout of a subprocess started at 'start_time' (if any) */
+static bool
+timeout_arm (wheel_t * w, struct wheel_timer *t, subprocess_t * p,
+	     struct timespec *start_time)
+{
+  if ((p->limits == NULL) || (p->limits->timeout_ns == 0))
+    return false;
+
+  t->callback = timeout_expired;
+  t->data = p;
+  wheel_add (w, t, timespec_to_ns (*start_time) + p->limits->timeout_ns);
+
+  return true;
+}
+
+/* Resource timeline of a subprocess, sampled from procfs by the timer
+ * wheel of its monitor. When the buffer gets full, pairs of samples
+ * are merged and the interval doubled, so a timeline of any length
+ * fits in RLIMIT_SAMPLES samples. */
+struct timeline
+{
+  struct wheel_timer timer;	/* Timer of the next sample */
+  wheel_t *wheel;		/* Wheel the timer is armed on */
+  subprocess_t *p;		/* Subprocess sampled */
+  uint64_t start_ns;		/* Start date of the subprocess */
+  uint64_t interval_ns;		/* Current interval between samples */
+  size_t count;			/* Number of samples taken */
+  rlimit_sample_t samples[RLIMIT_SAMPLES];
+};
+
+/* Read the file 'path' of procfs in 'buffer' (as a string) */
+static bool
+proc_read (const char *path, char *buffer, size_t size)
+{
+  ssize_t n;
+  int fd;
+
+  if ((fd = open (path, O_RDONLY | O_CLOEXEC)) == -1)
+    return false;
+
+  n = read (fd, buffer, size - 1);
+  close (fd);
+
+  if (n <= 0)
+    return false;
+
+  buffer[n] = '\0';
+
+  return true;
+}
+
+/* Sample the resources used by the process 'pid' */
+static void
+timeline_sample (pid_t pid, rlimit_sample_t * sample)
+{
+  static long page_kbytes = 0, clock_ticks = 0;
+  unsigned long utime = 0, stime = 0;
+  long pages = 0, threads = 0;
+  char path[64], buffer[1024], *s;
+  struct dirent *entry;
+  DIR *dir;
+
+  if (page_kbytes == 0)
+    {
+      page_kbytes = sysconf (_SC_PAGESIZE) / 1024;
+      clock_ticks = sysconf (_SC_CLK_TCK);
+    }
+
+  /* Resident memory (in pages) */
+  snprintf (path, sizeof (path), "/proc/%d/statm", pid);
+  if (proc_read (path, buffer, sizeof (buffer)))
+    sscanf (buffer, "%*d %ld", &pages);
+
+  /* CPU time and threads (the command name may hold spaces) */
+  snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+  if (proc_read (path, buffer, sizeof (buffer)) &&
+      ((s = strrchr (buffer, ')')) != NULL))
+    sscanf (s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+	    "%*d %*d %*d %*d %ld", &utime, &stime, &threads);
+
+  sample->rss_kbytes = pages * page_kbytes;
+  sample->cpu_usec = (time_t) ((utime + stime) * 1000000 / clock_ticks);
+  sample->threads = threads;
+  sample->fds = 0;
+
+  /* Open file descriptors */
+  snprintf (path, sizeof (path), "/proc/%d/fd", pid);
+  if ((dir = opendir (path)) != NULL)
+    {
+      while ((entry = readdir (dir)) != NULL)
+	if (entry->d_name[0] != '.')
+	  sample->fds++;
+
+      closedir (dir);
+    }
+}
+
+/* Merge the samples by pairs (the latest date, the highest usage) */
+static void
+timeline_shrink (struct timeline *tl)
+{
+  for (size_t i = 0; i < tl->count / 2; i++)
+    {
+      rlimit_sample_t *a = &(tl->samples[2 * i]);
+      rlimit_sample_t *b = &(tl->samples[2 * i + 1]);
+      rlimit_sample_t *merged = &(tl->samples[i]);
+
+      merged->rss_kbytes =
+	(a->rss_kbytes > b->rss_kbytes) ? a->rss_kbytes : b->rss_kbytes;
+      merged->threads = (a->threads > b->threads) ? a->threads : b->threads;
+      merged->fds = (a->fds > b->fds) ? a->fds : b->fds;
+      merged->time_usec = b->time_usec;
+      merged->cpu_usec = b->cpu_usec;
+    }
+
+  tl->count /= 2;
+  tl->interval_ns *= 2;
+}
+
+/* Sampling timer of a subprocess (wheel locked) */
+static void
+timeline_expired (void *data)
+{
+  struct timeline *tl = data;
+  rlimit_sample_t *sample;
+  struct timespec now;
+
+  if (tl->p->status >= TERMINATED)
+    return;
+
+  if (tl->count == RLIMIT_SAMPLES)
+    timeline_shrink (tl);
+
+  sample = &(tl->samples[tl->count++]);
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  sample->time_usec = (time_t) ((timespec_to_ns (now) - tl->start_ns) / 1000);
+  timeline_sample (tl->p->pid, sample);
+
+  wheel_rearm (tl->wheel, &(tl->timer), tl->interval_ns);
+}
+
+/* Arm the sampling of a subprocess started at 'start_time' (if any) */
+static bool
+timeline_arm (wheel_t * w, subprocess_t * p, struct timespec *start_time)
+{
+  struct timeline *tl;
+
+  if ((p->limits == NULL) || (p->limits->sample_interval_ns == 0))
+    return false;
+
+  if ((tl = malloc (sizeof (struct timeline))) == NULL)
+    {
+      rlimit_warning ("timeline allocation failed");
+      return false;
+    }
+
+  tl->wheel = w;
+  tl->p = p;
+  tl->start_ns = timespec_to_ns (*start_time);
+  tl->interval_ns = p->limits->sample_interval_ns;
+  tl->count = 0;
+
+  tl->timer.callback = timeline_expired;
+  tl->timer.data = tl;
+
+  free (p->timeline);
+  p->timeline = tl;
+
+  wheel_add (w, &(tl->timer), tl->start_ns + tl->interval_ns);
+
+  return true;
+}
+
+/* Stop the sampling of a subprocess (before its pid can be reused) */
+static void
+timeline_cancel (subprocess_t * p)
+{
+  if (p->timeline != NULL)
+    wheel_cancel (p->timeline->wheel, &(p->timeline->timer));
+}
+
+/***** Cgroup backend *****/
+
+/* When started, each subprocess runs in a cgroup (v2) of its own,
+ * created under the parent cgroup given. The limits the controllers
+ * can enforce are set on the cgroup rather than as rlimits (they then
+ * cover the whole process tree), and the profile is read back from
+ * the cgroup. The subprocess is forked straight into its cgroup
+ * (clone3 with CLONE_INTO_CGROUP) when the kernel allows it, otherwise
+ * it joins the cgroup before execve(). */
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+/* Limits enforced by the cgroup (limits_t.cgroup_limits) */
+#define CGROUP_MEMORY 1
+#define CGROUP_PIDS   2
+
+/* Arguments of clone3() (as of Linux 5.7) */
+struct cgroup_clone_args
+{
+  uint64_t flags;
+  uint64_t pidfd;
+  uint64_t child_tid;
+  uint64_t parent_tid;
+  uint64_t exit_signal;
+  uint64_t stack;
+  uint64_t stack_size;
+  uint64_t tls;
+  uint64_t set_tid;
+  uint64_t set_tid_size;
+  uint64_t cgroup;
+};
+
+static pthread_mutex_t cgroup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *cgroup_parent = NULL;	/* Parent cgroup (NULL if stopped) */
+static bool cgroup_memory = false;	/* Memory controller enabled */
+static bool cgroup_pids = false;	/* Pids controller enabled */
+static bool cgroup_cpu = false;	/* Cpu controller enabled */
+static unsigned int cgroup_next = 0;	/* Index of the next cgroup */
+static bool clone3_supported = true;	/* Cleared on ENOSYS */
+
+/* Write 'value' in the file 'name' of the cgroup directory 'dir' */
+static int
+cgroup_write (int dir, const char *name, const char *value)
+{
+  int ret = RETURN_SUCCESS;
+  size_t length = strlen (value);
+  int fd;
+
+  if ((fd = openat (dir, name, O_WRONLY | O_CLOEXEC)) == -1)
+    return RETURN_FAILURE;
+
+  if (write (fd, value, length) != (ssize_t) length)
+    ret = RETURN_FAILURE;
+
+  close (fd);
+
+  return ret;
+}
+
+/* Read the file 'name' of the cgroup directory 'dir' in 'buffer' (as
+ * a string, truncated to 'size') */
+static int
+cgroup_read (int dir, const char *name, char *buffer, size_t size)
+{
+  ssize_t n;
+  int fd;
+
+  if ((fd = openat (dir, name, O_RDONLY | O_CLOEXEC)) == -1)
+    return RETURN_FAILURE;
+
+  n = read (fd, buffer, size - 1);
+  close (fd);
+
+  if (n == -1)
+    return RETURN_FAILURE;
+
+  buffer[n] = '\0';
+
+  return RETURN_SUCCESS;
+}
+
+/* Find the value of 'key' in the flat keyed file read in 'buffer' */
+static bool
+cgroup_value (const char *buffer, const char *key, long long *value)
+{
+  size_t length = strlen (key);
+
+  for (const char *line = buffer; line != NULL;
+       line = ((line = strchr (line, '\n')) != NULL) ? line + 1 : NULL)
+    if ((strncmp (line, key, length) == 0) && (line[length] == ' '))
+      {
+	*value = strtoll (line + length + 1, NULL, 10);
+	return true;
+      }
+
+  return false;
+}
+
+/* Tell if 'name' is in the space separated 'list' of controllers */
+static bool
+cgroup_has (const char *list, const char *name)
+{
+  size_t length = strlen (name);
+
+  for (const char *s = list; (s = strstr (s, name)) != NULL; s += length)
+    if (((s == list) || (s[-1] == ' ')) &&
+	((s[length] == ' ') || (s[length] == '\n') || (s[length] == '\0')))
+      return true;
+
+  return false;
+}
+
+/* Move the process 'pid' ('0' for the calling process) in the cgroup
+ * directory 'dir' (only async-signal-safe calls, run in the child) */
+static int
+cgroup_attach (int dir, pid_t pid)
+{
+  char value[16];
+  int i = sizeof (value) - 1;
+
+  /* No snprintf() after fork() in a threaded caller */
+  value[i] = '\0';
+  do
+    {
+      value[--i] = '0' + (pid % 10);
+      pid /= 10;
+    }
+  while (pid > 0);
+
+  return cgroup_write (dir, "cgroup.procs", value + i);
+}
+
+/* Create the cgroup of the subprocess and set its limits on it (if the
+ * backend is started) */
+static int
+subprocess_cgroup_new (subprocess_t * p)
+{
+  int ret = RETURN_SUCCESS;
+  limits_t *limits = p->limits;
+  bool started, memory, pids, cpu;
+  char value[32];
+
+  if (limits != NULL)
+    limits->cgroup_limits = 0;
+
+  pthread_mutex_lock (&cgroup_mutex);
+
+  if ((started = (cgroup_parent != NULL)))
+    {
+      size_t size = strlen (cgroup_parent) + 48;
+
+      if ((p->cgroup = malloc (size)) != NULL)
+	snprintf (p->cgroup, size, "%s/rlimit-%d-%u", cgroup_parent,
+		  getpid (), cgroup_next++);
+    }
+
+  memory = cgroup_memory;
+  pids = cgroup_pids;
+  cpu = cgroup_cpu;
+
+  pthread_mutex_unlock (&cgroup_mutex);
+
+  /* Backend not started */
+  if (!started)
+    return RETURN_SUCCESS;
+
+  CHECK_ERROR ((p->cgroup == NULL), "cgroup allocation failed");
+  CHECK_ERROR ((mkdir (p->cgroup, 0755) == -1), "mkdir(cgroup) failed");
+  CHECK_ERROR (((p->cgroup_fd =
+		 open (p->cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1),
+	       "open(cgroup) failed");
+
+  if (limits == NULL)
+    return RETURN_SUCCESS;
+
+  if ((limits->memory > 0) && memory)
+    {
+      snprintf (value, sizeof (value), "%d", limits->memory);
+      CHECK_ERROR ((cgroup_write (p->cgroup_fd, "memory.max", value) ==
+		    RETURN_FAILURE), "setting memory.max failed");
+
+      /* Hitting the limit rather than swapping (no swap controller is
+       * fine) */
+      cgroup_write (p->cgroup_fd, "memory.swap.max", "0");
+
+      /* The OOM killer takes the whole tree, not only a descendant
+       * the subprocess could outlive */
+      cgroup_write (p->cgroup_fd, "memory.oom.group", "1");
+      limits->cgroup_limits |= CGROUP_MEMORY;
+    }
+
+  if ((limits->proc > 0) && pids)
+    {
+      snprintf (value, sizeof (value), "%d", limits->proc);
+      CHECK_ERROR ((cgroup_write (p->cgroup_fd, "pids.max", value) ==
+		    RETURN_FAILURE), "setting pids.max failed");
+      limits->cgroup_limits |= CGROUP_PIDS;
+    }
+
+  if (limits->cpu_bandwidth > 0)
+    {
+      /* Quota over a period of 100ms */
+      snprintf (value, sizeof (value), "%d 100000",
+		limits->cpu_bandwidth * 1000);
+      CHECK_ERROR ((!cpu || (cgroup_write (p->cgroup_fd, "cpu.max", value)
+			     == RETURN_FAILURE)), "setting cpu.max failed");
+    }
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+/* Read the profile of the whole process tree from the cgroup and kill
+ * what is left of the tree */
+static void
+subprocess_cgroup_profile (subprocess_t * p)
+{
+  char buffer[1024];
+  long long value;
+
+  if (p->cgroup_fd == -1)
+    return;
+
+  if (cgroup_read (p->cgroup_fd, "cpu.stat", buffer, sizeof (buffer)) ==
+      RETURN_SUCCESS)
+    {
+      if (cgroup_value (buffer, "user_usec", &value))
+	p->user_time_usec = value;
+      if (cgroup_value (buffer, "system_usec", &value))
+	p->sys_time_usec = value;
+    }
+
+  if (cgroup_read (p->cgroup_fd, "memory.peak", buffer, sizeof (buffer)) ==
+      RETURN_SUCCESS)
+    p->memory_kbytes = strtoll (buffer, NULL, 10) / 1024;
+
+  /* Killed by the OOM killer of the cgroup (possibly a descendant
+   * only, on kernels without memory.oom.group) */
+  if ((p->status >= TERMINATED) && (p->status < TIMEOUT) &&
+      (cgroup_read (p->cgroup_fd, "memory.events", buffer, sizeof (buffer))
+       == RETURN_SUCCESS) && cgroup_value (buffer, "oom_kill", &value) &&
+      (value > 0))
+    p->status = MEMORYOUT;
+
+  cgroup_write (p->cgroup_fd, "cgroup.kill", "1");
+}
+
+/* Remove the cgroup of the subprocess */
+static void
+subprocess_cgroup_delete (subprocess_t * p)
+{
+  struct timespec delay = {.tv_sec = 0,.tv_nsec = 1000000 };
+
+  if (p->cgroup_fd != -1)
+    {
+      cgroup_write (p->cgroup_fd, "cgroup.kill", "1");
+      close (p->cgroup_fd);
+      p->cgroup_fd = -1;
+    }
+
+  if (p->cgroup == NULL)
+    return;
+
+  /* The processes killed may take a while to be gone */
+  for (int i = 0; (rmdir (p->cgroup) == -1) && (errno != ENOENT); i++)
+    if ((errno != EBUSY) || (i == 1000))
+      {
+	rlimit_warning ("rmdir(cgroup) failed");
+	break;
+      }
+    else
+      nanosleep (&delay, NULL);
+
+  free (p->cgroup);
+  p->cgroup = NULL;
+}
+
+/* Fork the caller, straight into the cgroup directory 'dir' (if not
+ * '-1') when the kernel allows it. 'joined' tells whether the child
+ * still has to join its cgroup. */
+static pid_t
+cgroup_fork (int dir, bool *joined)
+{
+  *joined = (dir == -1);
+
+#ifdef SYS_clone3
+  if ((dir != -1) && clone3_supported)
+    {
+      struct cgroup_clone_args args = {.flags = CLONE_INTO_CGROUP,
+	.exit_signal = SIGCHLD,.cgroup = dir
+      };
+      pid_t pid = syscall (SYS_clone3, &args, sizeof (args));
+
+      if ((pid != -1) || ((errno != ENOSYS) && (errno != E2BIG)))
+	{
+	  *joined = true;
+	  return pid;
+	}
+
+      clone3_supported = false;
+    }
+#endif /* SYS_clone3 */
+
+  return fork ();
+}
+
+int
+rlimit_cgroup_start (const char *parent)
+{
+  int ret = RETURN_SUCCESS;
+  char controllers[256];
+  int dir = -1;
+
+  pthread_mutex_lock (&cgroup_mutex);
+
+  CHECK_ERROR ((cgroup_parent != NULL), "cgroup backend already started");
+  CHECK_ERROR (((dir = open (parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC))
+		== -1), "open(cgroup) failed");
+  CHECK_ERROR ((faccessat (dir, "cgroup.procs", W_OK, 0) == -1),
+	       "not a writable cgroup");
+
+  /* Enabling the controllers one at a time (some may be missing) */
+  cgroup_write (dir, "cgroup.subtree_control", "+memory");
+  cgroup_write (dir, "cgroup.subtree_control", "+pids");
+  cgroup_write (dir, "cgroup.subtree_control", "+cpu");
+
+  CHECK_ERROR ((cgroup_read (dir, "cgroup.subtree_control", controllers,
+			     sizeof (controllers)) == RETURN_FAILURE),
+	       "reading cgroup controllers failed");
+
+  CHECK_ERROR (((cgroup_parent = strdup (parent)) == NULL),
+	       "cgroup allocation failed");
+
+  cgroup_memory = cgroup_has (controllers, "memory");
+  cgroup_pids = cgroup_has (controllers, "pids");
+  cgroup_cpu = cgroup_has (controllers, "cpu");
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  if (dir != -1)
+    close (dir);
+
+  pthread_mutex_unlock (&cgroup_mutex);
+
+  return ret;
+}
+
+void
+rlimit_cgroup_stop (void)
+{
+  pthread_mutex_lock (&cgroup_mutex);
+
+  free (cgroup_parent);
+  cgroup_parent = NULL;
+  cgroup_memory = cgroup_pids = cgroup_cpu = false;
+
+  pthread_mutex_unlock (&cgroup_mutex);
+}
+
+/* CPU timeout of a subprocess: the timer is checked against the CPU
+ * time used (its CPU clock, or the cpu.stat of its cgroup which covers
+ * the whole tree) and armed again for the time left divided by the
+ * CPUs it may run on, which cannot run out before (the threads burn
+ * CPU time faster than the real time goes). RLIMIT_CPU remains as a
+ * backstop. */
+struct cpu_timeout
+{
+  struct wheel_timer timer;	/* Timer of the next check */
+  wheel_t *wheel;		/* Wheel the timer is armed on */
+  subprocess_t *p;		/* Subprocess limited */
+  clockid_t clock;		/* CPU clock of the subprocess */
+};
+
+/* CPU time used by the subprocess (in nano-seconds, '-1' if unknown) */
+static int64_t
+cpu_timeout_used (struct cpu_timeout *ct)
+{
+  subprocess_t *p = ct->p;
+  struct timespec ts;
+  char buffer[1024];
+  long long usec;
+
+  if ((p->cgroup_fd != -1) &&
+      (cgroup_read (p->cgroup_fd, "cpu.stat", buffer, sizeof (buffer)) ==
+       RETURN_SUCCESS) && cgroup_value (buffer, "usage_usec", &usec))
+    return usec * 1000;
+
+  if (clock_gettime (ct->clock, &ts) == -1)
+    return -1;
+
+  return timespec_to_ns (ts);
+}
+
+/* Real time (in nano-seconds) for the subprocess to use 'left' of CPU
+ * time at best, running on all the CPUs it is allowed to */
+static uint64_t
+cpu_timeout_delay (subprocess_t * p, uint64_t left)
+{
+  cpu_set_t set;
+  long cpus = 0;
+
+  if (sched_getaffinity (p->pid, sizeof (set), &set) == 0)
+    cpus = CPU_COUNT (&set);
+  if (cpus < 1)
+    cpus = sysconf (_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    cpus = 1;
+
+  return (left + cpus - 1) / cpus;
+}
+
+static void
+cpu_timeout_expired (void *data)
+{
+  struct cpu_timeout *ct = data;
+  subprocess_t *p = ct->p;
+  int64_t used;
+
+  if (p->status >= TERMINATED)
+    return;
+
+  /* Process gone (not reaped yet) */
+  if ((used = cpu_timeout_used (ct)) == -1)
+    return;
+
+  if ((uint64_t) used >= p->limits->cpu_timeout_ns)
+    {
+      p->status = CPUTIMEOUT;
+      subprocess_send_signal (p, SIGKILL);
+    }
+  else
+    wheel_rearm (ct->wheel, &(ct->timer),
+		 cpu_timeout_delay (p, p->limits->cpu_timeout_ns - used));
+}
+
+/* Arm the CPU timeout of a subprocess started at 'start_time' (if
+ * any) */
+static bool
+cpu_timeout_arm (wheel_t * w, struct cpu_timeout *ct, subprocess_t * p,
+		 struct timespec *start_time)
+{
+  if ((p->limits == NULL) || (p->limits->cpu_timeout_ns == 0))
+    return false;
+
+  if (clock_getcpuclockid (p->pid, &(ct->clock)) != 0)
+    {
+      rlimit_warning ("CPU clock unavailable, only RLIMIT_CPU is set");
+      return false;
+    }
+
+  ct->wheel = w;
+  ct->p = p;
+  ct->timer.callback = cpu_timeout_expired;
+  ct->timer.data = ct;
+
+  wheel_add (w, &(ct->timer), timespec_to_ns (*start_time) +
+	     cpu_timeout_delay (p, p->limits->cpu_timeout_ns));
+
+  return true;
+}
+
+/***** CPU placement *****/
+
+/* The CPUs the caller may run on are split into the reserved ones
+ * (threads of the library) and the pool handed out to subprocesses.
+ * The pool is grouped by NUMA node (from sysfs, a single node holding
+ * every CPU otherwise) and the CPUs taken exclusively are marked busy
+ * until their subprocess is over. */
+
+#define MASK_SET(mask, i) ((mask)[(i) / 64] |= 1ULL << ((i) % 64))
+#define MASK_HAS(mask, i) (((mask)[(i) / 64] >> ((i) % 64)) & 1)
+
+static pthread_mutex_t placement_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t placement_freed = PTHREAD_COND_INITIALIZER;
+static bool placement_started = false;
+static uint64_t placement_reserved[RLIMIT_CPU_WORDS];	/* Library threads */
+static uint64_t placement_pool[RLIMIT_CPU_WORDS];	/* Subprocesses */
+static uint64_t placement_busy[RLIMIT_CPU_WORDS];	/* Taken exclusively */
+static uint64_t placement_node_cpus[RLIMIT_NODES][RLIMIT_CPU_WORDS];
+static uint64_t placement_nodes = 0;	/* NUMA nodes found */
+
+/* Number of bits set in a mask of 'words' words */
+static int
+mask_count (const uint64_t * mask, int words)
+{
+  int count = 0;
+
+  for (int w = 0; w < words; w++)
+    count += __builtin_popcountll (mask[w]);
+
+  return count;
+}
+
+/* Parse a CPU (or node) list such as "0-3,8" into 'mask' ('bits' bits
+ * long), NULL being the empty list */
+static int
+cpu_list_parse (const char *list, uint64_t * mask, int bits)
+{
+  int ret = RETURN_SUCCESS;
+  const char *s = list;
+
+  memset (mask, 0, bits / 8);
+
+  while ((s != NULL) && (*s != '\0') && (*s != '\n'))
+    {
+      char *end;
+      long first = strtol (s, &end, 10), last = first;
+
+      CHECK_ERROR ((end == s), "invalid cpu list");
+
+      if (*end == '-')
+	{
+	  s = end + 1;
+	  last = strtol (s, &end, 10);
+	  CHECK_ERROR ((end == s), "invalid cpu list");
+	}
+
+      CHECK_ERROR (((first < 0) || (first > last) || (last >= bits)),
+		   "cpu list out of range");
+      CHECK_ERROR (((*end != ',') && (*end != '\0') && (*end != '\n')),
+		   "invalid cpu list");
+
+      for (long i = first; i <= last; i++)
+	MASK_SET (mask, i);
+
+      s = (*end == ',') ? end + 1 : end;
+    }
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+/* Write the list of the bits set in 'mask' into 'buffer' (truncated to
+ * 'size' bytes) */
+static void
+cpu_list_format (const uint64_t * mask, int bits, char *buffer, size_t size)
+{
+  size_t length = 0;
+
+  if (size == 0)
+    return;
+
+  buffer[0] = '\0';
+
+  for (int i = 0; i < bits; i++)
+    {
+      int last = i, n;
+
+      if (!MASK_HAS (mask, i))
+	continue;
+
+      while ((last + 1 < bits) && MASK_HAS (mask, last + 1))
+	last++;
+
+      if (last == i)
+	n = snprintf (buffer + length, size - length, "%s%d",
+		      (length > 0) ? "," : "", i);
+      else
+	n = snprintf (buffer + length, size - length, "%s%d-%d",
+		      (length > 0) ? "," : "", i, last);
+
+      if ((n < 0) || (length + n >= size))
+	break;
+
+      length += n;
+      i = last;
+    }
+}
+
+static void
+mask_to_set (const uint64_t * mask, cpu_set_t * set)
+{
+  CPU_ZERO (set);
+
+  for (int i = 0; i < RLIMIT_CPUS; i++)
+    if (MASK_HAS (mask, i))
+      CPU_SET (i, set);
+}
+
+/* Keep the calling thread of the library on the reserved CPUs */
+static void
+placement_pin (void)
+{
+  cpu_set_t set;
+  bool pinned;
+
+  pthread_mutex_lock (&placement_mutex);
+  pinned = placement_started &&
+    (mask_count (placement_reserved, RLIMIT_CPU_WORDS) > 0);
+  if (pinned)
+    mask_to_set (placement_reserved, &set);
+  pthread_mutex_unlock (&placement_mutex);
+
+  if (pinned && (pthread_setaffinity_np (pthread_self (), sizeof (set),
+					 &set) != 0))
+    rlimit_warning ("pinning the thread on the reserved cpus failed");
+}
+
+/* Read the CPUs of the NUMA nodes (one node of 'cpus' if none found) */
+static void
+placement_topology (const uint64_t * cpus)
+{
+  DIR *dir = opendir ("/sys/devices/system/node");
+  struct dirent *entry;
+  char path[64], list[4096];
+  int node;
+
+  placement_nodes = 0;
+  memset (placement_node_cpus, 0, sizeof (placement_node_cpus));
+
+  while ((dir != NULL) && ((entry = readdir (dir)) != NULL))
+    {
+      if ((sscanf (entry->d_name, "node%d", &node) != 1) ||
+	  (node < 0) || (node >= RLIMIT_NODES))
+	continue;
+
+      snprintf (path, sizeof (path),
+		"/sys/devices/system/node/node%d/cpulist", node);
+
+      if (proc_read (path, list, sizeof (list)) &&
+	  (cpu_list_parse (list, placement_node_cpus[node], RLIMIT_CPUS) ==
+	   RETURN_SUCCESS))
+	placement_nodes |= 1ULL << node;
+    }
+
+  if (dir != NULL)
+    closedir (dir);
+
+  if (placement_nodes == 0)
+    {
+      memcpy (placement_node_cpus[0], cpus, sizeof (placement_node_cpus[0]));
+      placement_nodes = 1;
+    }
+}
+
+/* Pick 'wanted' free CPUs of the pool into 'cpus', on the node having
+ * the fewest free CPUs that fits them (best fit) if any. Returns the
+ * node, '-1' if spread over several nodes, '-2' if not enough CPUs are
+ * free. */
+static int
+placement_pick (int wanted, uint64_t * cpus)
+{
+  uint64_t available[RLIMIT_CPU_WORDS];
+  int node = -1, best = 0;
+
+  for (int w = 0; w < RLIMIT_CPU_WORDS; w++)
+    available[w] = placement_pool[w] & ~placement_busy[w];
+
+  if (mask_count (available, RLIMIT_CPU_WORDS) < wanted)
+    return -2;
+
+  for (int n = 0; n < RLIMIT_NODES; n++)
+    {
+      int count = 0;
+
+      if (!(placement_nodes & (1ULL << n)))
+	continue;
+
+      for (int w = 0; w < RLIMIT_CPU_WORDS; w++)
+	count += __builtin_popcountll (available[w] &
+				       placement_node_cpus[n][w]);
+
+      if ((count >= wanted) && ((node == -1) || (count < best)))
+	{
+	  node = n;
+	  best = count;
+	}
+    }
+
+  memset (cpus, 0, RLIMIT_CPUS / 8);
+
+  for (int i = 0; (i < RLIMIT_CPUS) && (wanted > 0); i++)
+    if (MASK_HAS (available, i) &&
+	((node == -1) || MASK_HAS (placement_node_cpus[node], i)))
+      {
+	MASK_SET (cpus, i);
+	wanted--;
+      }
+
+  return node;
+}
+
+/* Place 'p' before it is forked: take its exclusive CPUs (waiting for
+ * them to be free) or let it run on the whole pool */
+static int
+placement_acquire (subprocess_t * p)
+{
+  int ret = RETURN_SUCCESS;
+  int node;
+
+  pthread_mutex_lock (&placement_mutex);
+
+  if (!placement_started)
+    goto end;
+
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+  CHECK_ERROR ((p->limits == NULL), "limits allocation failed");
+
+  if (p->limits->exclusive_cpus <= 0)
+    {
+      if (mask_count (p->limits->cpus, RLIMIT_CPU_WORDS) == 0)
+	memcpy (p->limits->cpus, placement_pool, sizeof (placement_pool));
+      goto end;
+    }
+
+  CHECK_ERROR ((p->limits->exclusive_cpus >
+		mask_count (placement_pool, RLIMIT_CPU_WORDS)),
+	       "not enough cpus in the pool");
+
+  while ((node = placement_pick (p->limits->exclusive_cpus,
+				 p->limits->cpus)) == -2)
+    {
+      pthread_cond_wait (&placement_freed, &placement_mutex);
+      CHECK_ERROR ((!placement_started), "cpu placement stopped");
+    }
+
+  for (int w = 0; w < RLIMIT_CPU_WORDS; w++)
+    placement_busy[w] |= p->limits->cpus[w];
+  p->cpus_held = true;
+
+  /* Keeping the memory on the node of the CPUs (needs exec) */
+  if ((node >= 0) && (mask_count (&placement_nodes, 1) > 1) &&
+      (p->limits->mempolicy == MEMPOLICY_DEFAULT) && (p->forkserver == NULL))
+    {
+      p->limits->mempolicy = MEMPOLICY_BIND;
+      p->limits->mem_nodes = 1ULL << node;
+    }
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+end:
+  pthread_mutex_unlock (&placement_mutex);
+
+  return ret;
+}
+
+/* Give the exclusive CPUs of 'p' back to the pool */
+static void
+placement_release (subprocess_t * p)
+{
+  if (!p->cpus_held)
+    return;
+
+  pthread_mutex_lock (&placement_mutex);
+
+  for (int w = 0; w < RLIMIT_CPU_WORDS; w++)
+    placement_busy[w] &= ~p->limits->cpus[w];
+  p->cpus_held = false;
+
+  pthread_cond_broadcast (&placement_freed);
+  pthread_mutex_unlock (&placement_mutex);
+}
+
+int
+rlimit_placement_start (const char *reserved)
+{
+  int ret = RETURN_SUCCESS;
+  uint64_t cpus[RLIMIT_CPU_WORDS] = { 0 };
+  cpu_set_t set;
+
+  pthread_mutex_lock (&placement_mutex);
+
+  CHECK_ERROR ((placement_started), "cpu placement already started");
+  CHECK_ERROR ((cpu_list_parse (reserved, placement_reserved, RLIMIT_CPUS)
+		== RETURN_FAILURE), "invalid reserved cpus");
+  CHECK_ERROR ((sched_getaffinity (0, sizeof (set), &set) == -1),
+	       "getting cpu affinity failed");
+
+  for (int i = 0; i < RLIMIT_CPUS; i++)
+    if (CPU_ISSET (i, &set))
+      MASK_SET (cpus, i);
+
+  for (int w = 0; w < RLIMIT_CPU_WORDS; w++)
+    {
+      placement_pool[w] = cpus[w] & ~placement_reserved[w];
+      placement_busy[w] = 0;
+    }
+
+  CHECK_ERROR ((mask_count (placement_pool, RLIMIT_CPU_WORDS) == 0),
+	       "no cpu left to the subprocesses");
+
+  placement_topology (cpus);
+  placement_started = true;
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  pthread_mutex_unlock (&placement_mutex);
+
+  return ret;
+}
+
+void
+rlimit_placement_stop (void)
+{
+  pthread_mutex_lock (&placement_mutex);
+  placement_started = false;
+  pthread_cond_broadcast (&placement_freed);
+  pthread_mutex_unlock (&placement_mutex);
+}
+
+/***** Perf counters *****/
+
+/* The counters are opened by the caller on the child (inherited by
+ * the processes it forks) and read once it has been reaped, the
+ * counts of its descendants being added to them as they exit. Missing
+ * counters (e.g. no hardware PMU in a virtual machine) are left out,
+ * so the software ones still get counted. */
+
+#ifdef HAVE_PERF
+static const struct
+{
+  uint32_t type;
+  uint64_t config;
+} perf_events[RLIMIT_PERF_COUNTERS] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}
+};
+
+#ifndef PERF_FLAG_FD_CLOEXEC
+#define PERF_FLAG_FD_CLOEXEC 0
+#endif
+#endif /* HAVE_PERF */
+
+/* Tell if the subprocess is counted (asked for or instruction limit) */
+static bool
+perf_needed (subprocess_t * p)
+{
+  return p->perf_counters ||
+    ((p->limits != NULL) && (p->limits->instructions > 0));
+}
+
+/* Attach the counters to the process 'pid', counting from its next
+ * execve() if 'on_exec' or at once otherwise. The instructions counter
+ * kills the process (overflow signal) once the limit is reached. */
+static void
+perf_open (subprocess_t * p, pid_t pid, bool on_exec)
+{
+#ifdef HAVE_PERF
+  uint64_t limit = (p->limits != NULL) ? p->limits->instructions : 0;
+  struct perf_event_attr attr;
+
+  for (int i = 0; i < RLIMIT_PERF_COUNTERS; i++)
+    {
+      memset (&attr, 0, sizeof (attr));
+      attr.size = sizeof (attr);
+      attr.type = perf_events[i].type;
+      attr.config = perf_events[i].config;
+      attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	PERF_FORMAT_TOTAL_TIME_RUNNING;
+      attr.inherit = 1;
+      attr.disabled = on_exec;
+      attr.enable_on_exec = on_exec;
+
+      /* Only what the program does itself on the CPU */
+      attr.exclude_kernel = (perf_events[i].type == PERF_TYPE_HARDWARE);
+      attr.exclude_hv = 1;
+
+      /* Overflowing at the limit (per process of the tree) */
+      if ((i == RLIMIT_PERF_INSTRUCTIONS) && (limit > 0))
+	{
+	  attr.sample_period = limit;
+	  attr.wakeup_events = 1;
+	}
+
+      p->perf_fds[i] = syscall (SYS_perf_event_open, &attr, pid, -1, -1,
+				PERF_FLAG_FD_CLOEXEC);
+    }
+
+  /* The notifications of the whole tree go to the process */
+  if ((limit > 0) && (p->perf_fds[RLIMIT_PERF_INSTRUCTIONS] != -1))
+    {
+      int fd = p->perf_fds[RLIMIT_PERF_INSTRUCTIONS];
+
+      if ((fcntl (fd, F_SETOWN, pid) == -1) ||
+	  (fcntl (fd, F_SETSIG, SIGKILL) == -1) ||
+	  (fcntl (fd, F_SETFL, O_ASYNC) == -1))
+	rlimit_warning ("instruction limit only checked at exit");
+    }
+  else if (limit > 0)
+    rlimit_warning ("instruction counter unavailable, limit not enforced");
+#else
+  if ((p->limits != NULL) && (p->limits->instructions > 0))
+    rlimit_warning ("instruction counter unavailable, limit not enforced");
+  (void) p;
+  (void) pid;
+  (void) on_exec;
+#endif /* HAVE_PERF */
+}
+
+/* Read the counters of a reaped subprocess in its profile */
+static void
+perf_read (subprocess_t * p)
+{
+  uint64_t value[3];		/* Count, time enabled, time running */
+
+  for (int i = 0; i < RLIMIT_PERF_COUNTERS; i++)
+    {
+      if (p->perf_fds[i] == -1)
+	continue;
+
+      if (read (p->perf_fds[i], value, sizeof (value)) == sizeof (value))
+	{
+	  /* Scaled when the counters had to share the PMU */
+	  if ((value[2] > 0) && (value[2] < value[1]))
+	    value[0] = (uint64_t) ((double) value[0] * value[1] / value[2]);
+
+	  p->perf.counters[i] = value[0];
+	  p->perf.available |= 1U << i;
+	}
+
+      close (p->perf_fds[i]);
+      p->perf_fds[i] = -1;
+    }
+}
+
+/* Set the rlimits of the process 'pid' ('0' for the calling process) */
+static int
+limits_set (pid_t pid, limits_t * limits)
+{
+  int ret = RETURN_SUCCESS;
+  struct rlimit limit;
+
+  /* Setting a limit on the memory (unless the cgroup does) */
+  if ((limits->memory > 0) && !(limits->cgroup_limits & CGROUP_MEMORY))
+    {
+      CHECK_ERROR ((prlimit (pid, RLIMIT_AS, NULL, &limit) == -1),
+		   "getting memory limit failed");
+
+      limit.rlim_cur = limits->memory;
+
+      CHECK_ERROR ((prlimit (pid, RLIMIT_AS, &limit, NULL) == -1),
+		   "setting memory limit failed");
+    }
+
+  /* Setting a limit on CPU time, rounded up to the second and past the
+   * CPU timeout (which is more accurate) */
+  if (limits->cpu_timeout_ns > 0)
+    {
+      rlim_t seconds = limits->cpu_timeout_ns / 1000000000ULL + 1;
+
+      CHECK_ERROR ((prlimit (pid, RLIMIT_CPU, NULL, &limit) == -1),
+		   "getting CPU time limit failed");
+
+      if ((limit.rlim_max == RLIM_INFINITY) || (seconds < limit.rlim_max))
+	limit.rlim_cur = seconds;
+      if ((limit.rlim_max == RLIM_INFINITY) || (seconds + 1 < limit.rlim_max))
+	limit.rlim_max = seconds + 1;
+
+      CHECK_ERROR ((prlimit (pid, RLIMIT_CPU, &limit, NULL) == -1),
+		   "setting CPU time limit failed");
+    }
+
+  /* Setting a limit on file size */
+  if (limits->fsize > 0)
+    {
+      CHECK_ERROR ((prlimit (pid, RLIMIT_FSIZE, NULL, &limit) == -1),
+		   "getting file size limit failed");
+
+      limit.rlim_cur = limits->fsize;
+
+      CHECK_ERROR ((prlimit (pid, RLIMIT_FSIZE, &limit, NULL) == -1),
+		   "setting file size limit failed");
+    }
+
+  /* Setting a limit on file descriptor number */
+  if (limits->fd > 0)
+    {
+      CHECK_ERROR ((prlimit (pid, RLIMIT_NOFILE, NULL, &limit) == -1),
+		   "getting maximum fd number limit failed");
+
+      limit.rlim_cur = limits->fd;
+
+      CHECK_ERROR ((prlimit (pid, RLIMIT_NOFILE, &limit, NULL) == -1),
+		   "setting maximum fd number limit failed");
+    }
+
+  /* Setting the CPUs the process may run on */
+  if (mask_count (limits->cpus, RLIMIT_CPU_WORDS) > 0)
+    {
+      cpu_set_t set;
+
+      mask_to_set (limits->cpus, &set);
+      CHECK_ERROR ((sched_setaffinity (pid, sizeof (set), &set) == -1),
+		   "setting cpu affinity failed");
+    }
+
+  /* Setting the memory policy (only by the process itself) */
+  if ((limits->mempolicy != MEMPOLICY_DEFAULT) && (pid == 0))
+    CHECK_ERROR ((syscall (SYS_set_mempolicy, limits->mempolicy,
+			   &(limits->mem_nodes), RLIMIT_NODES + 1) == -1),
+		 "setting memory policy failed");
+
+  /* Setting a limit on process number (unless the cgroup does) */
+  if ((limits->proc > 0) && !(limits->cgroup_limits & CGROUP_PIDS))
+    {
+      CHECK_ERROR ((prlimit (pid, RLIMIT_NPROC, NULL, &limit) == -1),
+		   "getting maximum process number limit failed");
+
+      limit.rlim_cur = limits->proc;
+
+      CHECK_ERROR ((prlimit (pid, RLIMIT_NPROC, &limit, NULL) == -1),
+		   "setting maximum process number limit failed");
+    }
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+/* Set the limits of the child process, plug 'fds' (child ends of
+ * stdin, stdout and stderr) on its standard streams, join the cgroup
+ * directory fds[3] (if not '-1') and run the command line. The parent
+ * is waited for on 'sync_fd' first (if not '-1'). Only returns on
+ * failure. */
+static int
+child_exec (char **argv, char **envp, limits_t * limits,
+	    struct sock_fprog *filter, bool traced, int fds[4], int sync_fd)
+{
+  int ret = RETURN_SUCCESS;
+  char byte;
+
+  /* Waiting for the parent to attach the perf counters */
+  if (sync_fd != -1)
+    {
+      while ((read (sync_fd, &byte, 1) == -1) && (errno == EINTR));
+      close (sync_fd);
+    }
+
+  /* Joining the cgroup first (limits set on it apply at once) */
+  if (fds[3] != -1)
+    CHECK_ERROR (((cgroup_attach (fds[3], 0) == RETURN_FAILURE) ||
+		  (close (fds[3]) == -1)), "joining the cgroup failed");
+
+  /* Set the limits on the process */
+  if (limits != NULL)
+    CHECK_ERROR ((limits_set (0, limits) == RETURN_FAILURE),
+		 "setting limits failed");
+
+  /* Setting a syscall tracer on the process (if no seccomp) */
+  if (traced)
+    {
+      CHECK_ERROR ((ptrace (PTRACE_TRACEME, 0, NULL, NULL) == -1),
+		   "ptrace failed");
+    }
+
+  /* Setting i/o handlers */
+  CHECK_ERROR ((dup2 (fds[0], STDIN_FILENO) == -1), "dup(stdin) failed");
+  CHECK_ERROR ((dup2 (fds[1], STDOUT_FILENO) == -1), "dup(stdout) failed");
+  CHECK_ERROR ((dup2 (fds[2], STDERR_FILENO) == -1), "dup(stderr) failed");
+
+  for (int i = 0; i < 3; i++)
+    if (fds[i] > STDERR_FILENO)
+      CHECK_ERROR ((close (fds[i]) == -1), "close(fds) failed");
+
+#ifdef HAVE_SECCOMP
+  /* Installing the syscall filter (must be the last step before exec) */
+  if (filter != NULL)
+    {
+      CHECK_ERROR ((prctl (PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1),
+		   "prctl(no_new_privs) failed");
+      CHECK_ERROR ((prctl (PR_SET_SECCOMP, SECCOMP_MODE_FILTER, filter) == -1),
+		   "seccomp filter installation failed");
+    }
+#else
+  (void) filter;
+#endif /* HAVE_SECCOMP */
+
+  /* Run the command line */
+  CHECK_ERROR((execve (argv[0], argv, envp) == -1), "execve failed");
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+/* Tell if the subprocess runs under the ptrace tracer: its syscall
+ * policy cannot be filtered by seccomp ('filter' is its compiled
+ * filter, if any) or its syscalls are profiled */
+static bool
+subprocess_traced (subprocess_t * p, struct sock_fprog *filter)
+{
+  return ((p->limits != NULL) && !policy_is_empty (p->limits->policy) &&
+	  (filter == NULL)) || (p->syscall_stats != NULL);
+}
+
+/* Wait for the next (ptrace) stop of 'pid' if 'traced', or for its
+ * exit. A stop is consumed ('status' and 'usage' set) and '0' is
+ * returned. An exit is left to subprocess_reap() and '1' is returned:
+ * until then the pid cannot be reused, so the timers can still signal
+ * it. Returns '-1' on failure. */
+static int
+wait_event (pid_t pid, bool traced, int *status, struct rusage *usage)
+{
+  siginfo_t info;
+
+  while (waitid (P_PID, pid, &info,
+		 WEXITED | WNOWAIT | ((traced) ? WSTOPPED : 0)) == -1)
+    if (errno != EINTR)
+      return -1;
+
+  if ((info.si_code == CLD_EXITED) || (info.si_code == CLD_KILLED) ||
+      (info.si_code == CLD_DUMPED))
+    return 1;
+
+  return (wait4 (pid, status, 0, usage) == -1) ? -1 : 0;
+}
+
+/* Tell if the exited (not reaped) subprocess was killed by its seccomp
+ * filter, and not by a SIGSYS raised by the program or sent to it:
+ * the seccomp mode of the thread killed by the filter is "dead". Only
+ * the main thread can be checked once the subprocess is over (a
+ * denied syscall of another thread is reported as KILLED). */
+static bool
+seccomp_killed (subprocess_t * p)
+{
+#ifdef HAVE_SECCOMP
+  char path[64], buffer[4096], *mode;
+  siginfo_t info;
+
+  if ((p->limits == NULL) || (p->limits->policy == NULL) ||
+      (p->limits->policy->filter == NULL))
+    return false;
+
+  if ((waitid (P_PID, p->pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1) ||
+      (info.si_pid == 0) || (info.si_code == CLD_EXITED) ||
+      (info.si_status != SIGSYS))
+    return false;
+
+  snprintf (path, sizeof (path), "/proc/%d/status", p->pid);
+
+  /* No procfs, trusting the signal */
+  if (!proc_read (path, buffer, sizeof (buffer)))
+    return true;
+
+  return ((mode = strstr (buffer, "\nSeccomp:")) != NULL) &&
+    (atoi (mode + strlen ("\nSeccomp:")) == SECCOMP_MODE_DEAD);
+#else
+  (void) p;
+
+  return false;
+#endif /* HAVE_SECCOMP */
+}
+
+/* Reap the exited subprocess */
+static int
+subprocess_reap (subprocess_t * p, int *status, struct rusage *usage)
+{
+  if (seccomp_killed (p))
+    p->status = DENIEDSYSCALL;
+
+  while (wait4 (p->pid, status, 0, usage) == -1)
+    if (errno != EINTR)
+      return RETURN_FAILURE;
+
+  return RETURN_SUCCESS;
+}
+
+/* Trace the syscalls of the subprocess (stopped at exec) until it
+ * exits or uses a denied syscall (it is killed then) */
+static int
+syscall_filter (subprocess_t * p, int *status, struct rusage *usage)
+{
+  int syscall_id;
+  bool syscall_enter = true;
+  int ret = RETURN_SUCCESS;
+  rlimit_policy_t *policy = (p->limits != NULL) ? p->limits->policy : NULL;
+  rlimit_syscall_stat_t *stats = p->syscall_stats;
+  int pending = -1;		/* Syscall entered (profile) */
+  uint64_t entered = 0;		/* Date of the entry (profile) */
+  struct timespec now;
+  int exited;
+
+  while (true)
+    {
+      struct user_regs_struct regs;
+
+      CHECK_ERROR ((ptrace (PTRACE_SYSCALL, p->pid, NULL, NULL) == -1),
+		   "ptrace failed");
+      CHECK_ERROR (((exited = wait_event (p->pid, true, status, usage)) ==
+		    -1), "wait failed");
+
+      if (exited)
+	break;
+
+      CHECK_ERROR ((ptrace (PTRACE_GETREGS, p->pid, NULL, &regs) == -1),
+		   "ptrace failed");
+
+      /* Getting syscall number is architecture dependant */
+#if __WORDSIZE == 64
+      syscall_id = regs.orig_rax;
+#elif __WORDSIZE == 32
+      syscall_id = regs.orig_eax;
+#endif
+
+      if (syscall_enter)
+	{
+	  if (rlimit_policy_is_denied (policy, syscall_id))
+	    {
+	      p->status = DENIEDSYSCALL;
+	      rlimit_subprocess_kill (p);
+	      break;
+	    }
+	}
+
+      /* Profiling the time between the entry and the exit */
+      if ((stats != NULL) && (syscall_id >= 0) &&
+	  (syscall_id < RLIMIT_SYSCALLS))
+	{
+	  clock_gettime (CLOCK_MONOTONIC, &now);
+
+	  if (syscall_enter)
+	    {
+	      stats[syscall_id].count++;
+	      pending = syscall_id;
+	      entered = timespec_to_ns (now);
+	    }
+	  else if (pending == syscall_id)
+	    {
+	      uint64_t elapsed = timespec_to_ns (now) - entered;
+
+	      stats[syscall_id].total_ns += elapsed;
+	      if (elapsed > stats[syscall_id].max_ns)
+		stats[syscall_id].max_ns = elapsed;
+	      pending = -1;
+	    }
+	}
+
+      syscall_enter ^= true;
+    }
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+/***** Spawn helper *****/
+
+/* The spawn helper is a small process forked when it is started (while
+ * the caller is still small). It then forks the subprocesses on
+ * request instead of the caller, so a fork never has to copy the page
+ * tables of a large caller. The subprocesses are created with
+ * CLONE_PARENT and remain children of the caller (waited, profiled and
+ * signaled as usual). Requests go through a socket, the child ends of
+ * the standard streams being passed along (SCM_RIGHTS). */
+
+/* Request sent to the spawn helper (followed by the seccomp filter and
+ * by the strings of argv and envp) */
+struct spawn_request
+{
+  int argc;			/* Number of arguments */
+  int envc;			/* Number of environment variables
+				   ('-1' if no envp) */
+  bool limited;			/* Limits are set */
+  limits_t limits;		/* Limits (the policy is not used) */
+  int filter_length;		/* Instructions of the seccomp filter */
+  size_t strings_length;	/* Length of the strings (with the '\0') */
+};
+
+/* Answer of the spawn helper */
+struct spawn_reply
+{
+  pid_t pid;			/* Subprocess ID ('-1' on failure) */
+  int error;			/* errno of the failure */
+};
+
+static pthread_mutex_t spawn_helper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pid_t spawn_helper_pid = -1;	/* Helper process ('-1' if none) */
+static int spawn_helper_fd = -1;	/* Socket connected to the helper */
+
+/* Read exactly 'length' bytes (false on end of file or failure) */
+static bool
+read_full (int fd, void *buffer, size_t length)
+{
+  while (length > 0)
+    {
+      ssize_t n = read (fd, buffer, length);
+
+      if ((n == -1) && (errno == EINTR))
+	continue;
+      if (n <= 0)
+	return false;
+
+      buffer = (char *) buffer + n;
+      length -= n;
+    }
+
+  return true;
+}
+
+/* Send exactly 'length' bytes on a socket (false on failure) */
+static bool
+send_full (int fd, const void *buffer, size_t length)
+{
+  while (length > 0)
+    {
+      ssize_t n = send (fd, buffer, length, MSG_NOSIGNAL);
+
+      if ((n == -1) && (errno == EINTR))
+	continue;
+      if (n == -1)
+	return false;
+
+      buffer = (const char *) buffer + n;
+      length -= n;
+    }
+
+  return true;
+}
+
+/* Serve a spawn request of the helper socket 'sock' (false when the
+ * socket has been closed or the request could not be read) */
+static bool
+spawn_helper_serve (int sock)
+{
+  struct spawn_request req;
+  struct spawn_reply reply = {.pid = -1,.error = 0 };
+  char control[CMSG_SPACE (4 * sizeof (int))];
+  struct iovec iov = {.iov_base = &req,.iov_len = sizeof (req) };
+  struct msghdr msg = {.msg_iov = &iov,.msg_iovlen = 1,
+    .msg_control = control,.msg_controllen = sizeof (control)
+  };
+  struct cmsghdr *cmsg;
+  struct sock_fprog *filter = NULL;
+  int fds[4] = { -1, -1, -1, -1 };
+  char *payload = NULL, *strings;
+  char **argv = NULL, **envp = NULL;
+  size_t filter_size = 0;
+  bool served = false;
+  ssize_t n;
+
+  while (((n = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC)) == -1) &&
+	 (errno == EINTR));
+
+  if (n <= 0)
+    return false;
+
+  /* The standard streams, then the cgroup directory (if any) */
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) &&
+      (cmsg->cmsg_type == SCM_RIGHTS) &&
+      ((cmsg->cmsg_len == CMSG_LEN (3 * sizeof (int))) ||
+       (cmsg->cmsg_len == CMSG_LEN (4 * sizeof (int)))))
+    memcpy (fds, CMSG_DATA (cmsg), cmsg->cmsg_len - CMSG_LEN (0));
+
+  if (!read_full (sock, (char *) &req + n, sizeof (req) - n))
+    goto end;
+
+#ifdef HAVE_SECCOMP
+  filter_size = req.filter_length * sizeof (struct sock_filter);
+#endif /* HAVE_SECCOMP */
+
+  if (((payload = malloc (filter_size + req.strings_length)) == NULL) ||
+      !read_full (sock, payload, filter_size + req.strings_length))
+    goto end;
+
+  argv = malloc ((req.argc + 1) * sizeof (char *));
+  if (req.envc >= 0)
+    envp = malloc ((req.envc + 1) * sizeof (char *));
+
+  if ((fds[2] == -1) || (argv == NULL) || ((req.envc >= 0) && (envp == NULL)))
+    reply.error = (fds[2] == -1) ? EBADF : ENOMEM;
+  else
+    {
+      /* Rebuilding argv and envp from the strings */
+      strings = payload + filter_size;
+
+      for (int i = 0; i < req.argc; i++)
+	{
+	  argv[i] = strings;
+	  strings += strlen (strings) + 1;
+	}
+      argv[req.argc] = NULL;
+
+      for (int i = 0; i < req.envc; i++)
+	{
+	  envp[i] = strings;
+	  strings += strlen (strings) + 1;
+	}
+      if (envp != NULL)
+	envp[req.envc] = NULL;
+
+#ifdef HAVE_SECCOMP
+      struct sock_fprog prog = {.len = req.filter_length,
+	.filter = (struct sock_filter *) payload
+      };
+
+      if (req.filter_length > 0)
+	filter = &prog;
+#endif /* HAVE_SECCOMP */
+
+      req.limits.policy = NULL;
+
+      /* Forking as a sibling (a child of the caller) */
+      reply.pid = syscall (SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+
+      if (reply.pid == 0)
+	{
+	  if (child_exec (argv, envp, (req.limited) ? &(req.limits) : NULL,
+			  filter, false, fds, -1) == RETURN_FAILURE)
+	    rlimit_error ("child monitor failed");
+
+	  _exit (EXIT_FAILURE);
+	}
+
+      if (reply.pid == -1)
+	reply.error = errno;
+    }
+
+  served = send_full (sock, &reply, sizeof (reply));
+
+end:
+  for (int i = 0; i < 4; i++)
+    if (fds[i] != -1)
+      close (fds[i]);
+
+  free (argv);
+  free (envp);
+  free (payload);
+
+  return served;
+}
+
+/* Ask the spawn helper to fork the subprocess. Returns the subprocess
+ * ID, '0' if the helper is not running and '-1' on failure. */
+static pid_t
+spawn_helper_request (subprocess_t * p, struct sock_fprog *filter,
+		      int fds[4])
+{
+  int nfds = (fds[3] == -1) ? 3 : 4;
+  struct spawn_request req;
+  struct spawn_reply reply = {.pid = -1,.error = EPIPE };
+  char control[CMSG_SPACE (4 * sizeof (int))];
+  struct iovec iov = {.iov_base = &req,.iov_len = sizeof (req) };
+  struct msghdr msg = {.msg_iov = &iov,.msg_iovlen = 1,
+    .msg_control = control,.msg_controllen = sizeof (control)
+  };
+  struct cmsghdr *cmsg;
+  size_t filter_size = 0, offset;
+  char *payload = NULL;
+  ssize_t n;
+
+  /* Building the request */
+  memset (&req, 0, sizeof (req));
+  memset (control, 0, sizeof (control));
+
+  req.argc = p->argc;
+  for (int i = 0; i < p->argc; i++)
+    req.strings_length += strlen (p->argv[i]) + 1;
+
+  req.envc = -1;
+  if (p->envp != NULL)
+    for (req.envc = 0; p->envp[req.envc] != NULL; req.envc++)
+      req.strings_length += strlen (p->envp[req.envc]) + 1;
+
+  if (p->limits != NULL)
+    {
+      req.limited = true;
+      req.limits = *(p->limits);
+      req.limits.policy = NULL;
+    }
+
+#ifdef HAVE_SECCOMP
+  if (filter != NULL)
+    {
+      req.filter_length = filter->len;
+      filter_size = filter->len * sizeof (struct sock_filter);
+    }
+#else
+  (void) filter;
+#endif /* HAVE_SECCOMP */
+
+  payload = malloc (filter_size + req.strings_length);
+  CHECK_ERROR ((payload == NULL), "spawn request allocation failed");
+
+#ifdef HAVE_SECCOMP
+  if (filter != NULL)
+    memcpy (payload, filter->filter, filter_size);
+#endif /* HAVE_SECCOMP */
+
+  offset = filter_size;
+  for (int i = 0; i < req.argc; i++)
+    {
+      memcpy (payload + offset, p->argv[i], strlen (p->argv[i]) + 1);
+      offset += strlen (p->argv[i]) + 1;
+    }
+  for (int i = 0; i < req.envc; i++)
+    {
+      memcpy (payload + offset, p->envp[i], strlen (p->envp[i]) + 1);
+      offset += strlen (p->envp[i]) + 1;
+    }
+
+  /* Passing the child ends of the standard streams (and the cgroup
+   * directory) along */
+  msg.msg_controllen = CMSG_SPACE (nfds * sizeof (int));
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (nfds * sizeof (int));
+  memcpy (CMSG_DATA (cmsg), fds, nfds * sizeof (int));
+
+  /* One request at a time on the socket */
+  pthread_mutex_lock (&spawn_helper_mutex);
+
+  if (spawn_helper_fd == -1)
+    reply.pid = 0;
+  else
+    {
+      while (((n = sendmsg (spawn_helper_fd, &msg, MSG_NOSIGNAL)) == -1) &&
+	     (errno == EINTR));
+
+      if ((n == -1) ||
+	  !send_full (spawn_helper_fd, (char *) &req + n, sizeof (req) - n) ||
+	  !send_full (spawn_helper_fd, payload, offset) ||
+	  !read_full (spawn_helper_fd, &reply, sizeof (reply)))
+	{
+	  reply.pid = -1;
+	  reply.error = EPIPE;
+	}
+    }
+
+  pthread_mutex_unlock (&spawn_helper_mutex);
+
+  free (payload);
+
+  if (reply.pid == -1)
+    errno = reply.error;
+
+  return reply.pid;
+
+fail:
+  return -1;
+}
+
+int
+rlimit_spawn_helper_start (void)
+{
+  int ret = RETURN_SUCCESS;
+  int sockets[2] = { -1, -1 };
+  pid_t pid;
+
+  pthread_mutex_lock (&spawn_helper_mutex);
+
+  CHECK_ERROR ((spawn_helper_pid != -1), "spawn helper already started");
+
+  CHECK_ERROR ((socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+			    sockets) == -1), "socketpair failed");
+
+  CHECK_ERROR (((pid = fork ()) == -1), "fork failed");
+
+  if (pid == 0)			/***** Spawn helper *****/
+    {
+      close (sockets[0]);
+
+      /* Serving until the socket is closed by the caller */
+      while (spawn_helper_serve (sockets[1]));
+
+      _exit (EXIT_SUCCESS);
+    }
+
+  close (sockets[1]);
+
+  spawn_helper_pid = pid;
+  spawn_helper_fd = sockets[0];
+
+  if (false)
+  fail:
+    {
+      ret = RETURN_FAILURE;
+
+      if (sockets[0] != -1)
+	{
+	  close (sockets[0]);
+	  close (sockets[1]);
+	}
+    }
+
+  pthread_mutex_unlock (&spawn_helper_mutex);
+
+  return ret;
+}
+
+void
+rlimit_spawn_helper_stop (void)
+{
+  pthread_mutex_lock (&spawn_helper_mutex);
+
+  if (spawn_helper_pid != -1)
+    {
+      /* The helper exits once the socket is closed */
+      close (spawn_helper_fd);
+
+      while ((waitpid (spawn_helper_pid, NULL, 0) == -1) && (errno == EINTR));
+
+      spawn_helper_pid = -1;
+      spawn_helper_fd = -1;
+    }
+
+  pthread_mutex_unlock (&spawn_helper_mutex);
+}
+
+/***** Fork server *****/
+
+/* A fork server starts a program once and stops it at a snapshot
+ * point (its first read on stdin or a SIGSTOP raised by itself). The
+ * subprocesses are then copies of the stopped program instead of new
+ * runs of it. As programs are not modified, the server traces the
+ * program (ptrace) and makes it run the syscalls needed: a copy is
+ * forked with CLONE_PARENT (so it is a child of the caller), gets its
+ * standard streams through /proc, its limits through prlimit() and
+ * its seccomp filter, and is resumed at the snapshot point. Only a
+ * single thread can be the tracer, so each server has its own. */
+#ifdef HAVE_FORKSERVER
+
+#define SYSCALL_INSN      0x050f	/* 'syscall' instruction (x86-64) */
+#define SYSCALL_INSN_SIZE 2		/* Size of the instruction */
+#define SYSCALL_STOP      (SIGTRAP | 0x80)	/* Syscall stop of a tracee */
+#define FORKSERVER_SCRATCH 65536	/* Scratch memory of the program */
+
+/* Copy to fork from the snapshot */
+struct forkserver_request
+{
+  subprocess_t *p;		/* Subprocess of the copy */
+  int *fds;			/* Child ends of the streams, cgroup */
+  pid_t pid;			/* Copy forked ('-1' on failure) */
+  bool done;			/* Request has been served */
+  struct forkserver_request *next;	/* Next request queued */
+};
+
+struct rlimit_forkserver
+{
+  subprocess_t *model;		/* Command line and limits of the copies */
+  int snapshot;			/* Snapshot point (SNAPSHOT_*) */
+  pthread_t thread;		/* Tracer thread */
+  pid_t pid;			/* Program stopped at the snapshot */
+  int stdin_fd;			/* Write end of the program stdin */
+  struct user_regs_struct regs;	/* Registers of the snapshot */
+  unsigned long syscall_ip;	/* Syscall instruction of the snapshot */
+  unsigned long scratch;	/* Scratch memory mapped in the program */
+
+  pthread_mutex_t mutex;	/* Mutex locking the fields below */
+  pthread_cond_t request;	/* Signaled when a request is queued */
+  pthread_cond_t reply;		/* Signaled when a request is served */
+  struct forkserver_request *head;	/* Requests queued (oldest first) */
+  struct forkserver_request *tail;	/* Last request queued */
+  bool ready;			/* Snapshot taken (or failed) */
+  bool failed;			/* Snapshot could not be taken */
+  bool stopping;		/* Server has to stop */
+};
+
+/* Wait for the traced process 'pid' to stop ('-1' if it ended) */
+static int
+forkserver_wait (pid_t pid, int *status)
+{
+  while (waitpid (pid, status, __WALL) == -1)
+    if (errno != EINTR)
+      return -1;
+
+  return (WIFSTOPPED (*status)) ? 0 : -1;
+}
+
+/* Make the stopped process 'pid' (the program or a copy) run a syscall
+ * at the syscall instruction of the snapshot. Returns the result of
+ * the syscall in 'result' ('-1' if it failed, with errno set). */
+static int
+forkserver_inject (rlimit_forkserver_t * fs, pid_t pid, long *result,
+		   long nr, long a0, long a1, long a2, long a3, long a4,
+		   long a5)
+{
+  int ret = RETURN_SUCCESS;
+  struct user_regs_struct regs = fs->regs;
+  int status, stops = 0;
+
+  regs.rip = fs->syscall_ip;
+  regs.rax = nr;
+  regs.orig_rax = -1;
+  regs.rdi = a0;
+  regs.rsi = a1;
+  regs.rdx = a2;
+  regs.r10 = a3;
+  regs.r8 = a4;
+  regs.r9 = a5;
+
+  CHECK_ERROR ((ptrace (PTRACE_SETREGS, pid, NULL, &regs) == -1),
+	       "ptrace failed");
+
+  /* Going through the entry and the exit of the syscall (the other
+   * stops, such as fork events, are skipped) */
+  while (stops < 2)
+    {
+      CHECK_ERROR ((ptrace (PTRACE_SYSCALL, pid, NULL, NULL) == -1),
+		   "ptrace failed");
+      CHECK_ERROR ((forkserver_wait (pid, &status) == -1),
+		   "program ended unexpectedly");
+
+      if (WSTOPSIG (status) == SYSCALL_STOP)
+	stops++;
+    }
+
+  CHECK_ERROR ((ptrace (PTRACE_GETREGS, pid, NULL, &regs) == -1),
+	       "ptrace failed");
+
+  *result = regs.rax;
+  if ((unsigned long) regs.rax > -4096UL)
+    {
+      errno = -regs.rax;
+      *result = -1;
+    }
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+/* Copy 'length' bytes into the scratch memory of 'pid' */
+static int
+forkserver_poke (rlimit_forkserver_t * fs, pid_t pid, size_t offset,
+		 const void *data, size_t length)
+{
+  struct iovec local = {.iov_base = (void *) data,.iov_len = length };
+  struct iovec remote = {.iov_base = (void *) (fs->scratch + offset),
+    .iov_len = length
+  };
+
+  if ((offset + length > FORKSERVER_SCRATCH) ||
+      (process_vm_writev (pid, &local, 1, &remote, 1, 0) != (ssize_t) length))
+    return RETURN_FAILURE;
+
+  return RETURN_SUCCESS;
+}
+
+/* Run the program until its snapshot point and prepare it for forking */
+static int
+forkserver_snapshot (rlimit_forkserver_t * fs)
+{
+  int ret = RETURN_SUCCESS;
+  int stdin_pipe[2] = { -1, -1 }, null_fds[2] = { -1, -1 }, fds[4];
+  int request = (fs->snapshot == SNAPSHOT_STDIN) ? PTRACE_SYSCALL :
+    PTRACE_CONT;
+  struct user_regs_struct regs;
+  bool syscall_enter = true;
+  int status, sig = 0;
+  long word;
+
+  CHECK_ERROR ((pipe2 (stdin_pipe, O_CLOEXEC) == -1),
+	       "pipe initialization failed");
+  CHECK_ERROR ((((null_fds[0] = open ("/dev/null", O_WRONLY | O_CLOEXEC))
+		 == -1) ||
+		((null_fds[1] = open ("/dev/null", O_WRONLY | O_CLOEXEC))
+		 == -1)), "open(/dev/null) failed");
+
+  /* Starting the program (traced, without limits) */
+  CHECK_ERROR (((fs->pid = fork ()) == -1), "fork failed");
+
+  if (fs->pid == 0)
+    {
+      fds[0] = stdin_pipe[0];
+      fds[1] = null_fds[0];
+      fds[2] = null_fds[1];
+      fds[3] = -1;
+
+      if (child_exec (fs->model->argv, fs->model->envp, NULL, NULL, true,
+		      fds, -1) == RETURN_FAILURE)
+	rlimit_error ("child monitor failed");
+
+      _exit (EXIT_FAILURE);
+    }
+
+  /* Stopped after execve() */
+  CHECK_ERROR ((forkserver_wait (fs->pid, &status) == -1),
+	       "program failed to start");
+  CHECK_ERROR ((ptrace (PTRACE_SETOPTIONS, fs->pid, NULL,
+			PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) == -1),
+	       "ptrace failed");
+
+  /* Running the program until its snapshot point */
+  while (true)
+    {
+      CHECK_ERROR ((ptrace (request, fs->pid, NULL, sig) == -1),
+		   "ptrace failed");
+      CHECK_ERROR ((forkserver_wait (fs->pid, &status) == -1),
+		   "program ended before its snapshot");
+      sig = 0;
+
+      if (WSTOPSIG (status) == SYSCALL_STOP)
+	{
+	  CHECK_ERROR ((ptrace (PTRACE_GETREGS, fs->pid, NULL, &regs) == -1),
+		       "ptrace failed");
+
+	  if (syscall_enter && (regs.rdi == STDIN_FILENO) &&
+	      ((regs.orig_rax == SYS_read) || (regs.orig_rax == SYS_readv)))
+	    break;
+
+	  syscall_enter ^= true;
+	}
+      else if ((fs->snapshot == SNAPSHOT_SIGSTOP) &&
+	       (WSTOPSIG (status) == SIGSTOP))
+	{
+	  CHECK_ERROR ((ptrace (PTRACE_GETREGS, fs->pid, NULL, &regs) == -1),
+		       "ptrace failed");
+	  break;
+	}
+      else
+	sig = WSTOPSIG (status);	/* Delivering the other signals */
+    }
+
+  fs->syscall_ip = regs.rip - SYSCALL_INSN_SIZE;
+  fs->regs = regs;
+
+  if (fs->snapshot == SNAPSHOT_STDIN)
+    {
+      /* The copies run the read again, the program skips it */
+      fs->regs.rip = fs->syscall_ip;
+      fs->regs.rax = regs.orig_rax;
+
+      regs.orig_rax = -1;
+      CHECK_ERROR (((ptrace (PTRACE_SETREGS, fs->pid, NULL, &regs) == -1) ||
+		    (ptrace (PTRACE_SYSCALL, fs->pid, NULL, NULL) == -1)),
+		   "ptrace failed");
+      CHECK_ERROR ((forkserver_wait (fs->pid, &status) == -1),
+		   "program ended unexpectedly");
+    }
+  else
+    {
+      /* The signal has been raised by a syscall (kill, tgkill, ...) */
+      errno = 0;
+      word = ptrace (PTRACE_PEEKTEXT, fs->pid, fs->syscall_ip, NULL);
+      CHECK_ERROR (((errno != 0) || ((word & 0xffff) != SYSCALL_INSN)),
+		   "SIGSTOP was not raised by the program");
+    }
+
+  CHECK_ERROR ((ptrace (PTRACE_SETOPTIONS, fs->pid, NULL,
+			PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL |
+			PTRACE_O_TRACEFORK) == -1), "ptrace failed");
+
+  /* Mapping the scratch memory (inherited by the copies) */
+  CHECK_ERROR (((forkserver_inject (fs, fs->pid, &word, SYS_mmap, 0,
+				    FORKSERVER_SCRATCH,
+				    PROT_READ | PROT_WRITE,
+				    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) ==
+		 RETURN_FAILURE) || (word == -1)), "mmap(scratch) failed");
+  fs->scratch = word;
+
+  fs->stdin_fd = stdin_pipe[1];
+  stdin_pipe[1] = -1;
+
+  if (false)
+  fail:
+    {
+      ret = RETURN_FAILURE;
+
+      if (fs->pid > 0)
+	{
+	  kill (fs->pid, SIGKILL);
+	  waitpid (fs->pid, NULL, __WALL);
+	}
+      fs->pid = -1;
+    }
+
+  for (int i = 0; i < 2; i++)
+    {
+      if (stdin_pipe[i] != -1)
+	close (stdin_pipe[i]);
+      if (null_fds[i] != -1)
+	close (null_fds[i]);
+    }
+
+  return ret;
+}
+
+/* Fork a copy of the program for the subprocess 'p' */
+static pid_t
+forkserver_fork (rlimit_forkserver_t * fs, subprocess_t * p, int fds[4])
+{
+  struct sock_fprog *filter =
+    (p->limits != NULL) && (p->limits->policy != NULL) ?
+    p->limits->policy->filter : NULL;
+  pid_t pid = -1;
+  char path[64];
+  long fd, result;
+  int status;
+
+  CHECK_ERROR (((p->limits != NULL) && !policy_is_empty (p->limits->policy)
+		&& (filter == NULL)), "syscall policy needs seccomp");
+  CHECK_ERROR ((p->syscall_stats != NULL), "syscall profile needs ptrace");
+  CHECK_ERROR (((p->limits != NULL) &&
+		(p->limits->mempolicy != MEMPOLICY_DEFAULT)),
+	       "memory policy needs exec");
+
+  CHECK_ERROR (((forkserver_inject (fs, fs->pid, &result, SYS_clone,
+				    CLONE_PARENT | SIGCHLD, 0, 0, 0, 0, 0) ==
+		 RETURN_FAILURE) || (result == -1)), "clone failed");
+  pid = result;
+
+  /* Stopped at once (auto-attached) */
+  CHECK_ERROR ((forkserver_wait (pid, &status) == -1), "copy failed");
+
+  /* Replacing the standard streams */
+  for (int i = 0; i < 3; i++)
+    {
+      snprintf (path, sizeof (path), "/proc/%d/fd/%d", getpid (), fds[i]);
+
+      CHECK_ERROR (((forkserver_poke (fs, pid, 0, path, strlen (path) + 1)
+		     == RETURN_FAILURE) ||
+		    (forkserver_inject (fs, pid, &fd, SYS_open, fs->scratch,
+					(i == 0) ? O_RDONLY : O_WRONLY, 0, 0,
+					0, 0) == RETURN_FAILURE) ||
+		    (fd == -1)), "open(stream) failed");
+
+      if (fd != i)
+	CHECK_ERROR (((forkserver_inject (fs, pid, &result, SYS_dup2, fd, i,
+					  0, 0, 0, 0) == RETURN_FAILURE) ||
+		      (result == -1) ||
+		      (forkserver_inject (fs, pid, &result, SYS_close, fd, 0,
+					  0, 0, 0, 0) == RETURN_FAILURE)),
+		     "dup(stream) failed");
+    }
+
+  if (p->limits != NULL)
+    CHECK_ERROR ((limits_set (pid, p->limits) == RETURN_FAILURE),
+		 "setting limits failed");
+
+  if (fds[3] != -1)
+    CHECK_ERROR ((cgroup_attach (fds[3], pid) == RETURN_FAILURE),
+		 "joining the cgroup failed");
+
+  /* Counting from the snapshot on (no execve() to wait for) */
+  if (perf_needed (p))
+    perf_open (p, pid, false);
+
+#ifdef HAVE_SECCOMP
+  /* Installing the syscall filter (last syscall run for the copy) */
+  if (filter != NULL)
+    {
+      struct sock_fprog prog = {.len = filter->len,.filter =
+	  (struct sock_filter *) (fs->scratch + sizeof (struct sock_fprog))
+      };
+
+      CHECK_ERROR (((forkserver_poke (fs, pid, 0, &prog, sizeof (prog)) ==
+		     RETURN_FAILURE) ||
+		    (forkserver_poke (fs, pid, sizeof (prog), filter->filter,
+				      filter->len *
+				      sizeof (struct sock_filter)) ==
+		     RETURN_FAILURE) ||
+		    (forkserver_inject (fs, pid, &result, SYS_prctl,
+					PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0, 0)
+		     == RETURN_FAILURE) || (result == -1) ||
+		    (forkserver_inject (fs, pid, &result, SYS_prctl,
+					PR_SET_SECCOMP, SECCOMP_MODE_FILTER,
+					fs->scratch, 0, 0, 0) ==
+		     RETURN_FAILURE) || (result == -1)),
+		   "seccomp filter installation failed");
+    }
+#endif /* HAVE_SECCOMP */
+
+  /* Resuming the copy at the snapshot point */
+  CHECK_ERROR (((ptrace (PTRACE_SETREGS, pid, NULL, &(fs->regs)) == -1) ||
+		(ptrace (PTRACE_DETACH, pid, NULL, NULL) == -1)),
+	       "ptrace failed");
+
+  return pid;
+
+fail:
+  if (pid > 0)
+    {
+      kill (pid, SIGKILL);
+      waitpid (pid, NULL, __WALL);
+    }
+
+  return -1;
+}
+
+/* Thread of the fork server (the tracer of the program) */
+static void *
+forkserver_loop (void *arg)
+{
+  rlimit_forkserver_t *fs = arg;
+  bool failed = (forkserver_snapshot (fs) == RETURN_FAILURE);
+
+  pthread_mutex_lock (&(fs->mutex));
+
+  fs->ready = true;
+  fs->failed = failed;
+  pthread_cond_broadcast (&(fs->reply));
+
+  while (!failed)
+    {
+      struct forkserver_request *r;
+
+      while ((fs->head == NULL) && !fs->stopping)
+	pthread_cond_wait (&(fs->request), &(fs->mutex));
+
+      if ((r = fs->head) == NULL)
+	break;
+
+      if ((fs->head = r->next) == NULL)
+	fs->tail = NULL;
+
+      pthread_mutex_unlock (&(fs->mutex));
+      r->pid = forkserver_fork (fs, r->p, r->fds);
+      pthread_mutex_lock (&(fs->mutex));
+
+      r->done = true;
+      pthread_cond_broadcast (&(fs->reply));
+    }
+
+  pthread_mutex_unlock (&(fs->mutex));
+
+  /* The program is never resumed */
+  if (fs->pid > 0)
+    {
+      kill (fs->pid, SIGKILL);
+      waitpid (fs->pid, NULL, __WALL);
+      close (fs->stdin_fd);
+    }
+
+  return NULL;
+}
+
+/* Ask the fork server for a copy ('-1' on failure) */
+static pid_t
+forkserver_spawn (rlimit_forkserver_t * fs, subprocess_t * p, int fds[4])
+{
+  struct forkserver_request r = {.p = p,.fds = fds,.pid = -1,
+    .done = false,.next = NULL
+  };
+
+  pthread_mutex_lock (&(fs->mutex));
+
+  if (!fs->stopping)
+    {
+      if (fs->tail == NULL)
+	fs->head = &r;
+      else
+	fs->tail->next = &r;
+      fs->tail = &r;
+      pthread_cond_signal (&(fs->request));
+
+      while (!r.done)
+	pthread_cond_wait (&(fs->reply), &(fs->mutex));
+    }
+
+  pthread_mutex_unlock (&(fs->mutex));
+
+  return r.pid;
+}
+#endif /* HAVE_FORKSERVER */
+
+/* Copy the limits of 'from' to 'to' (the policy is shared) */
+static int
+limits_copy (subprocess_t * to, subprocess_t * from)
+{
+  if (from->limits == NULL)
+    return RETURN_SUCCESS;
+
+  to->limits = limits_new (to);
+  *(to->limits) = *(from->limits);
+  rlimit_policy_ref (to->limits->policy);
+
+  return RETURN_SUCCESS;
+}
+
+rlimit_forkserver_t *
+rlimit_forkserver_new (subprocess_t * p, int snapshot)
+{
+#ifdef HAVE_FORKSERVER
+  bool failed;
+  rlimit_forkserver_t *fs = calloc (1, sizeof (rlimit_forkserver_t));
+  CHECK_ERROR ((fs == NULL), "fork server allocation failed");
+
+  CHECK_ERROR (((snapshot != SNAPSHOT_STDIN) &&
+		(snapshot != SNAPSHOT_SIGSTOP)), "invalid snapshot point");
+
+  fs->snapshot = snapshot;
+  fs->pid = -1;
+  fs->stdin_fd = -1;
+
+  fs->model = rlimit_subprocess_create (p->argc, p->argv, p->envp);
+  CHECK_ERROR (((fs->model == NULL) ||
+		(limits_copy (fs->model, p) == RETURN_FAILURE)),
+	       "fork server allocation failed");
+
+  /* Compiling the syscall policy of the copies once */
+  if ((p->limits != NULL) && !policy_is_empty (p->limits->policy))
+    CHECK_ERROR ((rlimit_policy_compile (p->limits->policy) ==
+		  RETURN_FAILURE), "syscall policy compilation failed");
+
+  pthread_mutex_init (&(fs->mutex), NULL);
+  pthread_cond_init (&(fs->request), NULL);
+  pthread_cond_init (&(fs->reply), NULL);
+
+  if (pthread_create (&(fs->thread), NULL, forkserver_loop, fs) != 0)
+    {
+      rlimit_error ("fork server creation failed");
+      failed = true;
+    }
+  else
+    {
+      /* Waiting for the snapshot */
+      pthread_mutex_lock (&(fs->mutex));
+      while (!fs->ready)
+	pthread_cond_wait (&(fs->reply), &(fs->mutex));
+      failed = fs->failed;
+      pthread_mutex_unlock (&(fs->mutex));
+
+      if (failed)
+	pthread_join (fs->thread, NULL);
+    }
+
+  if (failed)
+    {
+      pthread_mutex_destroy (&(fs->mutex));
+      pthread_cond_destroy (&(fs->request));
+      pthread_cond_destroy (&(fs->reply));
+      goto fail;
+    }
+
+  return fs;
+
+fail:
+  if (fs != NULL)
+    {
+      rlimit_subprocess_delete (fs->model);
+      free (fs);
+    }
+#else
+  (void) p;
+  (void) snapshot;
+  rlimit_error ("fork server is not supported");
+#endif /* HAVE_FORKSERVER */
+
+  return NULL;
+}
+
+subprocess_t *
+rlimit_forkserver_create (rlimit_forkserver_t * fs)
+{
+#ifdef HAVE_FORKSERVER
+  subprocess_t *model = fs->model;
+  subprocess_t *p = rlimit_subprocess_create (model->argc, model->argv,
+					      model->envp);
+  CHECK_ERROR ((p == NULL), "subprocess allocation failed");
+
+  if (limits_copy (p, model) == RETURN_FAILURE)
+    {
+      rlimit_subprocess_delete (p);
+      p = NULL;
+      CHECK_ERROR (true, "limits allocation failed");
+    }
+
+  p->forkserver = fs;
+
+fail:
+  return p;
+#else
+  (void) fs;
+  rlimit_error ("fork server is not supported");
+
+  return NULL;
+#endif /* HAVE_FORKSERVER */
+}
+
+void
+rlimit_forkserver_delete (rlimit_forkserver_t * fs)
+{
+#ifdef HAVE_FORKSERVER
+  if (fs == NULL)
+    return;
+
+  pthread_mutex_lock (&(fs->mutex));
+  fs->stopping = true;
+  pthread_cond_signal (&(fs->request));
+  pthread_mutex_unlock (&(fs->mutex));
+
+  pthread_join (fs->thread, NULL);
+
+  pthread_mutex_destroy (&(fs->mutex));
+  pthread_cond_destroy (&(fs->request));
+  pthread_cond_destroy (&(fs->reply));
+  rlimit_subprocess_delete (fs->model);
+  free (fs);
+#else
+  (void) fs;
+#endif /* HAVE_FORKSERVER */
+}
+
+/* Create the pipes and fork the child process running the subprocess
+ * (from its fork server if any, else through the spawn helper if it is
+ * running and no tracer is needed).
+ * The parent ends of the pipes are stored in p->stdin, p->stdout and
+ * p->stderr. */
+static int
+subprocess_spawn (subprocess_t * p, struct timespec *start_time)
+{
+  int ret = RETURN_SUCCESS;
+  struct sock_fprog *filter =
+    (p->limits != NULL) && (p->limits->policy != NULL) ?
+    p->limits->policy->filter : NULL;
+  bool traced = subprocess_traced (p, filter);
+
+  /* Initializing the pipes () */
+  int stdin_pipe[2];		/* '0' = child_read,  '1' = parent_write */
+  int stdout_pipe[2];		/* '0' = parent_read, '1' = child_write */
+  int stderr_pipe[2];		/* '0' = parent_read, '1' = child_write */
+  int child_fds[4];		/* Child ends of stdin, stdout and stderr,
+				   directory of the cgroup */
+  bool joined;			/* Forked into the cgroup */
+  int sync_pipe[2] = { -1, -1 };	/* Child waiting for perf counters */
+
+  CHECK_ERROR ((pipe (stdin_pipe) == -1), "pipe initialization failed");
+
+  if (p->file_capture)
+    {
+      /* Both ends share the file (the parent never reads it before
+       * the subprocess is over) */
+      CHECK_ERROR ((((stdout_pipe[0] = io_capture_file ()) == -1) ||
+		    ((stderr_pipe[0] = io_capture_file ()) == -1)),
+		   "output file creation failed");
+      CHECK_ERROR ((((stdout_pipe[1] =
+		      fcntl (stdout_pipe[0], F_DUPFD_CLOEXEC, 0)) == -1) ||
+		    ((stderr_pipe[1] =
+		      fcntl (stderr_pipe[0], F_DUPFD_CLOEXEC, 0)) == -1)),
+		   "output file duplication failed");
+    }
+  else
+    CHECK_ERROR (((pipe (stdout_pipe) == -1) ||
+		  (pipe (stderr_pipe) == -1)), "pipe initialization failed");
+
+  child_fds[0] = stdin_pipe[0];
+  child_fds[1] = stdout_pipe[1];
+  child_fds[2] = stderr_pipe[1];
+
+  /* Opening the file read as stdin anew to get an offset of our own */
+  if (p->stdin_path != NULL)
+    child_fds[0] = open (p->stdin_path, O_RDONLY | O_CLOEXEC);
+  else if (p->stdin_file != -1)
+    {
+      char path[32];
+
+      snprintf (path, sizeof (path), "/proc/self/fd/%d", p->stdin_file);
+
+      /* No procfs, sharing the offset */
+      if ((child_fds[0] = open (path, O_RDONLY | O_CLOEXEC)) == -1)
+	child_fds[0] = fcntl (p->stdin_file, F_DUPFD_CLOEXEC, 0);
+    }
+
+  CHECK_ERROR ((child_fds[0] == -1), "open(stdin) failed");
+
+  /* Creating the cgroup of the subprocess (if the backend is started) */
+  CHECK_ERROR ((subprocess_cgroup_new (p) == RETURN_FAILURE),
+	       "cgroup creation failed");
+  child_fds[3] = p->cgroup_fd;
+
+  /* Getting the CPUs of the subprocess (waiting for exclusive ones) */
+  CHECK_ERROR ((placement_acquire (p) == RETURN_FAILURE),
+	       "cpu placement failed");
+
+  /* Getting start time of the subprocess (profiling information) */
+  CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, start_time) == -1),
+	       "getting start time failed");
+
+  /* Forking the process (from the fork server of the subprocess or
+   * by the spawn helper if possible) */
+  p->pid = 0;
+
+#ifdef HAVE_FORKSERVER
+  if (p->forkserver != NULL)
+    CHECK_ERROR (((p->pid = forkserver_spawn (p->forkserver, p, child_fds))
+		  == -1), "fork server failed");
+#endif /* HAVE_FORKSERVER */
+
+  if ((p->pid == 0) && !traced && !perf_needed (p))
+    CHECK_ERROR (((p->pid = spawn_helper_request (p, filter, child_fds))
+		  == -1), "spawn helper failed");
+
+  if ((p->pid == 0) && perf_needed (p))
+    CHECK_ERROR ((pipe2 (sync_pipe, O_CLOEXEC) == -1),
+		 "pipe initialization failed");
+
+  if (p->pid == 0)
+    {
+      CHECK_ERROR (((p->pid = cgroup_fork (p->cgroup_fd, &joined)) == -1),
+		   "fork failed");
+
+      if ((p->pid == 0) && joined)
+	child_fds[3] = -1;
+    }
+
+  if (p->pid == 0)	/***** Child process *****/
+    {
+      /* Closing the parent ends */
+      close (stdin_pipe[1]);
+      close (stdout_pipe[0]);
+      close (stderr_pipe[0]);
+      if (child_fds[0] != stdin_pipe[0])
+	close (stdin_pipe[0]);
+      if (sync_pipe[1] != -1)
+	close (sync_pipe[1]);
+
+      /* TODO: What if the child fails miserably ? It should be
+       * signaled in the parent stderr and not in the child stderr. */
+      if (child_exec (p->argv, p->envp, p->limits, filter, traced,
+		      child_fds, sync_pipe[0]) == RETURN_FAILURE)
+	rlimit_error ("child monitor failed");
+
+      /* Never go back to the caller's code in the child */
+      _exit (EXIT_FAILURE);
+    }
+
+  /***** Parent process *****/
+  if (sync_pipe[1] != -1)
+    {
+      /* Counting from execve() on, then letting the child go */
+      perf_open (p, p->pid, true);
+      close (sync_pipe[0]);
+      close (sync_pipe[1]);
+      sync_pipe[0] = sync_pipe[1] = -1;
+    }
+
+  pthread_once (&pidfd_once, pidfd_probe);
+
+  if (pidfd_supported && ((p->pidfd = open_pidfd (p->pid)) == -1))
+    {
+      /* Not reaped yet, so the PID cannot have been reused */
+      kill (p->pid, SIGKILL);
+      while ((waitpid (p->pid, NULL, 0) == -1) && (errno == EINTR));
+      p->pid = -1;
+      CHECK_ERROR (true, "pidfd_open failed");
+    }
+
+  if (child_fds[0] != stdin_pipe[0])
+    CHECK_ERROR ((close (child_fds[0]) == -1), "close(stdin) failed");
+
+  CHECK_ERROR ((close (stdin_pipe[0]) == -1), "close(stdin[0]) failed");
+  CHECK_ERROR (((p->stdin = fdopen (stdin_pipe[1], "w")) == NULL),
+	       "fdopen(stdin[1]) failed");
+
+  /* Nothing is read from the pipe when stdin is a file */
+  if ((p->stdin_file != -1) || (p->stdin_path != NULL))
+    {
+      pthread_mutex_lock (&(p->write_mutex));
+      io_write_close (p);
+      pthread_mutex_unlock (&(p->write_mutex));
+    }
+
+  CHECK_ERROR ((close (stdout_pipe[1]) == -1), "close(stdout[1]) failed");
+  CHECK_ERROR (((p->stdout = fdopen (stdout_pipe[0], "r")) == NULL),
+	       "fdopen(stdout[0]) failed");
+
+  CHECK_ERROR ((close (stderr_pipe[1]) == -1), "close(stderr[1]) failed");
+  CHECK_ERROR (((p->stderr = fdopen (stderr_pipe[0], "r")) == NULL),
+	       "fdopen(stderr[0]) failed");
+
+  if (false)
+  fail:
+    {
+      ret = RETURN_FAILURE;
+      placement_release (p);
+
+      if (sync_pipe[0] != -1)
+	{
+	  close (sync_pipe[0]);
+	  close (sync_pipe[1]);
+	}
+    }
+
+  return ret;
+}
+
+/* Setting the status, retval and real time of a finished subprocess */
+static void
+subprocess_exited (subprocess_t * p, int status, struct timespec *start_time)
+{
+  struct timespec tmp_time, end_time;
+
+  /* The exclusive CPUs are free again */
+  placement_release (p);
+
+  /* Getting end time of the subprocess (profiling information) */
+  CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &end_time) == -1),
+	       "getting end time failed");
+  tmp_time = timespec_diff (*start_time, end_time);
+
+  p->real_time_usec =
+    (time_t) (tmp_time.tv_sec * 1000000 + tmp_time.tv_nsec / 1000);
+
+fail:
+  /* Finding out what the status and retval are really */
+  if (WIFEXITED (status))
+    {				/* Exited normally */
+      /* Unless a limit was hit before the kill landed */
+      pthread_mutex_lock (&(p->mutex));
+      if (p->status < TERMINATED)
+	p->status = TERMINATED;
+      pthread_mutex_unlock (&(p->mutex));
+
+      p->retval = WEXITSTATUS (status);	/* Return value */
+    }
+  else if (WIFSIGNALED (status))
+    {
+      /* Killed for a denied syscall (see: seccomp_killed()), the
+       * retval is left untouched as with the ptrace tracer */
+      if (p->status != DENIEDSYSCALL)
+	p->retval = WTERMSIG (status);	/* Kill signal */
+
+      if (p->status < TERMINATED)
+	{
+	  /* Trying to guess why by looking at errno value */
+	  switch (WTERMSIG (status))
+	    {
+	    case SIGSEGV:
+	      p->status = MEMORYOUT;
+	      break;
+
+	    case SIGXCPU:
+	      /* Raised by RLIMIT_CPU, unless the program set its own */
+	      p->status = ((p->limits != NULL) &&
+			   (p->limits->cpu_timeout_ns > 0)) ?
+		CPUTIMEOUT : KILLED;
+	      break;
+
+	    default:
+	      p->status = KILLED;
+	    }
+	}
+      /* FIXME: It may be interesting to store the termination signal
+       * into another variable and to 'p->retval = errno' */
+    }
+  else if (WIFSTOPPED (status))
+    {
+      p->status = STOPPED;
+      p->retval = WSTOPSIG (status);	/* Stop signal */
+    }
+  else if (WIFCONTINUED (status))
+    {
+      p->status = RUNNING;
+      p->retval = 0;		/* Process is still running */
+    }
+}
+
+/* Setting the profile information of a finished subprocess */
+static void
+subprocess_profile (subprocess_t * p, struct rusage *usage)
+{
+  /* User time in us */
+  p->user_time_usec =
+    usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec;
+
+  /* System time in us */
+  p->sys_time_usec =
+    usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec;
+
+  /* Memory usage */
+  p->memory_kbytes = usage->ru_maxrss;
+
+  /* The cgroup covers the whole process tree */
+  subprocess_cgroup_profile (p);
+
+  perf_read (p);
+
+  /* Counted when an instruction limit or the perf counters are set */
+  if (p->perf.available & (1U << RLIMIT_PERF_INSTRUCTIONS))
+    p->instructions = p->perf.counters[RLIMIT_PERF_INSTRUCTIONS];
+
+  /* Over the instruction limit (the whole tree counted at exit) */
+  if (((p->status == TERMINATED) || (p->status == KILLED)) &&
+      (p->limits != NULL) && (p->limits->instructions > 0) &&
+      (p->perf.available & (1U << RLIMIT_PERF_INSTRUCTIONS)) &&
+      (p->perf.counters[RLIMIT_PERF_INSTRUCTIONS] >= p->limits->instructions))
+    p->status = INSTREXCEED;
+
+  /* Killed by the hard limit of RLIMIT_CPU */
+  if ((p->status == KILLED) && (p->limits != NULL) &&
+      (p->limits->cpu_timeout_ns > 0) &&
+      ((uint64_t) (p->user_time_usec + p->sys_time_usec) * 1000 >=
+       p->limits->cpu_timeout_ns))
+    p->status = CPUTIMEOUT;
+}
+
+/* Signal the waiters that the supervision of the subprocess is over */
+static void
+subprocess_done (subprocess_t * p)
+{
+  /* Releasing the writers still waiting on stdin */
+  pthread_mutex_lock (&(p->write_mutex));
+  io_write_close (p);
+  pthread_mutex_unlock (&(p->write_mutex));
+
+  pthread_mutex_lock (&(p->mutex));
+  p->done = true;
+  pthread_cond_broadcast (&(p->terminated));
+  pthread_cond_broadcast (&(p->output));
+  pthread_mutex_unlock (&(p->mutex));
+}
+
+/* Monitoring the subprocess end and get the return value */
+static void *
+monitor (void *arg)
+{
+  subprocess_t *p = arg;
   struct timespec start_time;
+  struct sock_fprog *filter = NULL;
+
+  int status, exited;
+  bool traced;
+  pthread_t io_pthread;
+  bool timeout_running = false, cpu_timeout_running = false;
+  bool io_running = false;
+  struct wheel_timer timeout;
+  struct cpu_timeout cpu_timeout;
+  struct rusage usage;
+
+  memset (&usage, 0, sizeof (struct rusage));
+  placement_pin ();
+
+  /* Compiling the syscall policy before forking (no-op if shared) */
+  if ((p->limits != NULL) && !policy_is_empty (p->limits->policy))
+    {
+      CHECK_ERROR ((rlimit_policy_compile (p->limits->policy) ==
+		    RETURN_FAILURE), "syscall policy compilation failed");
+      filter = p->limits->policy->filter;
+    }
+
+  /* We create a child process running the subprocess and we wait for
+   * it to finish. If a timeout elapsed the child is killed by the
+   * timer thread (shared by all the monitors). */
+  pthread_once (&monitor_timers_once, monitor_timers_start);
+  CHECK_ERROR (!monitor_timers_started, "timers are not available");
+
+  CHECK_ERROR ((subprocess_spawn (p, &start_time) == RETURN_FAILURE),
+	       "spawning subprocess failed");
+
+  p->status = RUNNING;
+
+  /* Arming the timeout and the sampling of the subprocess */
+  timeout_running = timeout_arm (&monitor_timers, &timeout, p, &start_time);
+  cpu_timeout_running =
+    cpu_timeout_arm (&monitor_timers, &cpu_timeout, p, &start_time);
+  timeline_arm (&monitor_timers, p, &start_time);
+
+  /* Running the io monitor to watch stdout and stderr */
+  CHECK_ERROR ((fcntl (fileno (p->stdin), F_SETFL, O_NONBLOCK) == -1),
+	       "fcntl(O_NONBLOCK) failed");
+  CHECK_ERROR ((pipe2 (p->io_wake, O_CLOEXEC | O_NONBLOCK) == -1),
+	       "pipe initialization failed");
+  CHECK_ERROR ((pthread_create (&io_pthread, NULL, io_monitor, p) != 0),
+	       "io_monitor creation failed");
+  io_running = true;
+
+  /* Waiting for the subprocess to stop at exec (traced) or to exit */
+  traced = subprocess_traced (p, filter);
+  CHECK_ERROR (((exited = wait_event (p->pid, traced, &status, &usage)) ==
+		-1), "wait failed");
+
+  /* Filtering syscalls with ptrace (when seccomp is unavailable) or
+   * profiling them */
+  if (traced && !exited)
+    {
+      if (syscall_filter (p, &status, &usage) == RETURN_FAILURE)
+	goto fail;
+    }
+
+  /* Waiting for the exit (a denied syscall only kills the subprocess) */
+  while (!exited)
+    CHECK_ERROR (((exited = wait_event (p->pid, traced, &status, &usage))
+		  == -1), "wait failed");
+
+  /* Disarming the timers while the pid is still ours (not reaped) */
+  if (timeout_running)
+    {
+      wheel_cancel (&monitor_timers, &timeout);
+      timeout_running = false;
+    }
+  if (cpu_timeout_running)
+    {
+      wheel_cancel (&monitor_timers, &(cpu_timeout.timer));
+      cpu_timeout_running = false;
+    }
+  timeline_cancel (p);
+
+  /***** The subprocess is finished now *****/
+  CHECK_ERROR ((subprocess_reap (p, &status, &usage) == RETURN_FAILURE),
+	       "wait failed");
+  subprocess_exited (p, status, &start_time);
+
+fail:
+  /* Cleaning the io_monitor and getting the output left in the pipes */
+  if (io_running)
+    {
+      pthread_cancel (io_pthread);
+      pthread_join (io_pthread, NULL);
+
+      io_finish (p);
+    }
+
+  /* Closing the wake-up pipe of the io_monitor */
+  if (p->io_wake[0] != -1)
+    {
+      pthread_mutex_lock (&(p->mutex));
+      close (p->io_wake[0]);
+      close (p->io_wake[1]);
+      p->io_wake[0] = p->io_wake[1] = -1;
+      pthread_mutex_unlock (&(p->mutex));
+    }
+
+  /* Disarming the timers if not already expired */
+  if (timeout_running)
+    wheel_cancel (&monitor_timers, &timeout);
+  if (cpu_timeout_running)
+    wheel_cancel (&monitor_timers, &(cpu_timeout.timer));
+  timeline_cancel (p);
+
+  /* Cleaning and setting the profile information */
+  subprocess_profile (p, &usage);
+
+  subprocess_done (p);
+
+  return NULL;
+}
+
+#ifdef HAVE_SUPERVISOR
+/***** Supervisor engine *****/
+
+/* The supervisor engine replaces the threads (monitor and io_monitor)
+ * of each subprocess by a small pool of threads. Each of them
+ * multiplexes the pipes and the exit notifications (pidfd) of its
+ * subprocesses with epoll, the timeouts being kept in a timer wheel
+ * of its own. */
+
+/* File descriptors watched for a subprocess */
+#define WATCH_STDIN  0
+#define WATCH_STDOUT 1
+#define WATCH_STDERR 2
+#define WATCH_PIDFD  3
+#define WATCH_MAX    4
+#define WATCH_TIMERS 4		/* Timer wheel of the supervisor */
+
+#define SUPERVISOR_EVENTS 64	/* Events handled per epoll_wait() */
+
+struct supervision;
+
+struct watch
+{
+  struct supervision *s;	/* Supervision the fd belongs to */
+  int kind;			/* Kind of fd (WATCH_*) */
+  int fd;			/* File descriptor ('-1' if closed) */
+};
+
+typedef struct supervisor
+{
+  pthread_t thread;		/* Supervisor thread */
+  int epoll_fd;			/* epoll instance of the thread */
+  int event_fd;			/* Wake-up the thread (stop request) */
+  int active;			/* Number of subprocesses supervised */
+  wheel_t timers;		/* Timeouts of the subprocesses */
+  struct watch timers_watch;	/* Watch of the timer wheel */
+} supervisor_t;
+
+struct supervision
+{
+  subprocess_t *p;		/* Supervised subprocess */
+  supervisor_t *supervisor;	/* Supervisor in charge */
+  struct watch watches[WATCH_MAX];	/* Watched file descriptors */
+  struct timespec start_time;	/* Start time (profiling information) */
+  struct wheel_timer timeout;	/* Timeout of the subprocess */
+  bool timed;			/* Timeout is armed */
+  struct cpu_timeout cpu_timeout;	/* CPU timeout of the subprocess */
+  bool cpu_timed;		/* CPU timeout is armed */
+  bool finished;		/* Subprocess has been reaped */
+  struct supervision *next;	/* Next finished supervision */
+};
+
+static pthread_mutex_t engine_mutex = PTHREAD_MUTEX_INITIALIZER;
+static supervisor_t *engine = NULL;	/* Supervisor threads */
+static int engine_size = 0;	/* Number of supervisor threads */
+static unsigned int engine_next = 0;	/* Round-robin dispatching */
+static bool engine_stopping = false;	/* Stop has been requested */
+
+/* Stop watching a file descriptor (the pidfd is kept by the
+ * subprocess to signal it safely) */
+static void
+supervision_unwatch (struct supervision *s, int kind)
+{
+  if (s->watches[kind].fd == -1)
+    return;
+
+  epoll_ctl (s->supervisor->epoll_fd, EPOLL_CTL_DEL, s->watches[kind].fd,
+	     NULL);
+  s->watches[kind].fd = -1;
+}
+
+/* Read the output available on stdout or stderr */
+static void
+supervision_read (struct supervision *s, int kind)
+{
+  subprocess_t *p = s->p;
+  ssize_t count;
+
+  /* WATCH_STDOUT and WATCH_STDERR match the stream numbers */
+  count = io_read (p, kind, s->watches[kind].fd);
+
+  if ((count == 0) || ((count == -1) && (errno != EAGAIN)))
+    {
+      supervision_unwatch (s, kind);
+      return;
+    }
+
+  /* Paused by the consumer (rlimit_resume_output() watches it again) */
+  pthread_mutex_lock (&(p->mutex));
+  if ((kind == WATCH_STDOUT) ? p->stdout_paused : p->stderr_paused)
+    {
+      struct epoll_event event = {.events = 0,.data.ptr =
+	  &(s->watches[kind])
+      };
+
+      epoll_ctl (s->supervisor->epoll_fd, EPOLL_CTL_MOD,
+		 s->watches[kind].fd, &event);
+    }
+  pthread_mutex_unlock (&(p->mutex));
+}
+
+/* Write the pending stdin buffer */
+static void
+supervision_write (struct supervision *s, uint32_t events)
+{
+  subprocess_t *p = s->p;
+  int written = -1;
+  struct epoll_event event = {.events = 0,.data.ptr =
+      &(s->watches[WATCH_STDIN])
+  };
+
+  /* Writers arm stdin with the queue locked, so it cannot be lost */
+  pthread_mutex_lock (&(p->write_mutex));
+
+  if (!(events & EPOLLERR))
+    written = io_write (p, s->watches[WATCH_STDIN].fd);
+  else
+    io_write_close (p);
+
+  if (written == 1)
+    epoll_ctl (s->supervisor->epoll_fd, EPOLL_CTL_MOD,
+	       s->watches[WATCH_STDIN].fd, &event);
+  else if (written == -1)
+    supervision_unwatch (s, WATCH_STDIN);
+
+  pthread_mutex_unlock (&(p->write_mutex));
+}
+
+/* Reap the subprocess and end its supervision */
+static void
+supervision_finish (struct supervision *s)
+{
+  subprocess_t *p = s->p;
+  struct rusage usage;
+  siginfo_t info;
+  int status;
+
+  /* Left unreaped until the timers are disarmed (the pid is ours) */
+  info.si_pid = 0;
+  if ((waitid (P_PID, p->pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1) ||
+      (info.si_pid == 0))
+    return;
+
+  /* Getting the output left in the pipes */
+  io_finish (p);
+
+  for (int kind = 0; kind < WATCH_MAX; kind++)
+    supervision_unwatch (s, kind);
+
+  if (s->timed)
+    wheel_cancel (&(s->supervisor->timers), &(s->timeout));
+  if (s->cpu_timed)
+    wheel_cancel (&(s->supervisor->timers), &(s->cpu_timeout.timer));
+  timeline_cancel (p);
+
+  if (subprocess_reap (p, &status, &usage) == RETURN_FAILURE)
+    {
+      rlimit_error ("wait failed");
+      status = 0;
+      memset (&usage, 0, sizeof (struct rusage));
+    }
+
+  subprocess_exited (p, status, &(s->start_time));
+  subprocess_profile (p, &usage);
+
+  pthread_mutex_lock (&(p->mutex));
+  p->supervision = NULL;
+  pthread_mutex_unlock (&(p->mutex));
+
+  s->finished = true;
+  __sync_sub_and_fetch (&(s->supervisor->active), 1);
+
+  subprocess_done (p);
+}
+
+static void *
+supervisor_loop (void *arg)
+{
+  supervisor_t *sv = arg;
+  struct epoll_event events[SUPERVISOR_EVENTS];
+  sigset_t mask;
+
+  placement_pin ();
+
+  /* Writing to a closed stdin must fail with EPIPE (not kill us) */
+  sigemptyset (&mask);
+  sigaddset (&mask, SIGPIPE);
+  pthread_sigmask (SIG_BLOCK, &mask, NULL);
+
+  while (!engine_stopping || (sv->active > 0))
+    {
+      struct supervision *finished = NULL;
+      int n = epoll_wait (sv->epoll_fd, events, SUPERVISOR_EVENTS, -1);
+
+      if (n == -1)
+	{
+	  if (errno == EINTR)
+	    continue;
+
+	  rlimit_error ("epoll_wait() failed");
+	  break;
+	}
+
+      for (int i = 0; i < n; i++)
+	{
+	  struct watch *w = events[i].data.ptr;
+	  struct supervision *s;
+	  uint64_t value;
+
+	  /* Stop request */
+	  if (w == NULL)
+	    {
+	      if (read (sv->event_fd, &value, sizeof (value)) == -1)
+		rlimit_warning ("read(event_fd) failed");
+	      continue;
+	    }
+
+	  /* Expired timeouts */
+	  if (w->kind == WATCH_TIMERS)
+	    {
+	      wheel_expire (&(sv->timers));
+	      continue;
+	    }
+
+	  /* Finished earlier in this round */
+	  if (((s = w->s)->finished) || (w->fd == -1))
+	    continue;
+
+	  switch (w->kind)
+	    {
+	    case WATCH_STDOUT:
+	    case WATCH_STDERR:
+	      supervision_read (s, w->kind);
+	      break;
+
+	    case WATCH_STDIN:
+	      supervision_write (s, events[i].events);
+	      break;
+
+	    case WATCH_PIDFD:
+	      supervision_finish (s);
+	      if (s->finished)
+		{
+		  s->next = finished;
+		  finished = s;
+		}
+	      break;
+	    }
+	}
+
+      /* No more events can refer to the finished supervisions */
+      while (finished != NULL)
+	{
+	  struct supervision *next = finished->next;
+	  free (finished);
+	  finished = next;
+	}
+    }
+
+  return NULL;
+}
+
+/* Watch a file descriptor of the subprocess */
+static int
+supervision_watch (struct supervision *s, int kind, int fd, uint32_t events)
+{
+  struct epoll_event event = {.events = events,.data.ptr =
+      &(s->watches[kind])
+  };
+
+  s->watches[kind].s = s;
+  s->watches[kind].kind = kind;
+  s->watches[kind].fd = fd;
+
+  return epoll_ctl (s->supervisor->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/* Pick a supervisor for the subprocess (NULL if the engine is not
+ * running or if the subprocess needs to be traced with ptrace) */
+static supervisor_t *
+supervisor_pick (subprocess_t * p)
+{
+  supervisor_t *sv = NULL;
+
+  if (((p->limits != NULL) && !policy_is_empty (p->limits->policy) &&
+       ((rlimit_policy_compile (p->limits->policy) == RETURN_FAILURE) ||
+	(p->limits->policy->filter == NULL))) ||
+      (p->syscall_stats != NULL))
+    return NULL;
+
+  pthread_mutex_lock (&engine_mutex);
+
+  if ((engine != NULL) && !engine_stopping)
+    {
+      sv = &(engine[engine_next++ % engine_size]);
+      __sync_add_and_fetch (&(sv->active), 1);
+    }
+
+  pthread_mutex_unlock (&engine_mutex);
+
+  return sv;
+}
+
+/* Run the subprocess under the supervision of 'sv' */
+static int
+supervisor_run (supervisor_t * sv, subprocess_t * p)
+{
+  int ret = RETURN_SUCCESS;
+  int error;
+  struct supervision *s = malloc (sizeof (struct supervision));
+
+  CHECK_ERROR ((s == NULL), "supervision allocation failed");
+
+  s->p = p;
+  s->supervisor = sv;
+  s->timed = false;
+  s->cpu_timed = false;
+  s->finished = false;
+  s->next = NULL;
+  for (int kind = 0; kind < WATCH_MAX; kind++)
+    s->watches[kind].fd = -1;
+
+  CHECK_ERROR ((subprocess_spawn (p, &(s->start_time)) == RETURN_FAILURE),
+	       "spawning subprocess failed");
+
+  CHECK_ERROR ((p->pidfd == -1), "pidfd_open failed");
+
+  /* Reading the output without blocking the supervisor */
+  CHECK_ERROR (((fcntl (fileno (p->stdout), F_SETFL, O_NONBLOCK) == -1) ||
+		(fcntl (fileno (p->stderr), F_SETFL, O_NONBLOCK) == -1) ||
+		(fcntl (fileno (p->stdin), F_SETFL, O_NONBLOCK) == -1)),
+	       "fcntl(O_NONBLOCK) failed");
+
+  p->supervised = true;
+  p->supervision = s;
+  p->status = RUNNING;
+
+  /* Arming the timeout and the sampling */
+  s->timed = timeout_arm (&(sv->timers), &(s->timeout), p, &(s->start_time));
+  s->cpu_timed = cpu_timeout_arm (&(sv->timers), &(s->cpu_timeout), p,
+				  &(s->start_time));
+  timeline_arm (&(sv->timers), p, &(s->start_time));
+
+  /* Watching stdin with the queue locked (see: supervision_arm_stdin) */
+  pthread_mutex_lock (&(p->write_mutex));
+  error = supervision_watch (s, WATCH_STDIN, fileno (p->stdin),
+			     (p->stdin_head) ? EPOLLOUT : 0);
+  pthread_mutex_unlock (&(p->write_mutex));
+
+  /* The pidfd is watched last as it may end the supervision at once */
+  CHECK_ERROR (((error == -1) ||
+		((!p->file_capture) &&
+		 ((supervision_watch (s, WATCH_STDOUT, fileno (p->stdout),
+				      EPOLLIN) == -1) ||
+		  (supervision_watch (s, WATCH_STDERR, fileno (p->stderr),
+				      EPOLLIN) == -1))) ||
+		(supervision_watch (s, WATCH_PIDFD, p->pidfd, EPOLLIN) == -1)),
+	       "epoll_ctl failed");
+
+  if (false)
+  fail:
+    {
+      ret = RETURN_FAILURE;
+
+      /* Not leaving the child running (nor a zombie) unsupervised */
+      if (p->pid > 0)
+	{
+	  kill (p->pid, SIGKILL);
+	  while ((waitpid (p->pid, NULL, 0) == -1) && (errno == EINTR));
+	  p->pid = -1;
+	}
+      placement_release (p);
+
+      if (s != NULL)
+	{
+	  for (int kind = 0; kind < WATCH_MAX; kind++)
+	    supervision_unwatch (s, kind);
+
+	  if (s->timed)
+	    wheel_cancel (&(sv->timers), &(s->timeout));
+	  if (s->cpu_timed)
+	    wheel_cancel (&(sv->timers), &(s->cpu_timeout.timer));
+	  timeline_cancel (p);
+	}
+
+      p->supervised = false;
+      p->supervision = NULL;
+      free (s);
+      __sync_sub_and_fetch (&(sv->active), 1);
+    }
+
+  return ret;
+}
+
+/* Ask the supervisor to read the resumed streams again (p->mutex
+ * must be locked) */
+static void
+supervision_resume (subprocess_t * p)
+{
+  struct supervision *s = p->supervision;
+
+  if (s == NULL)
+    return;
+
+  for (int kind = WATCH_STDOUT; kind <= WATCH_STDERR; kind++)
+    if (s->watches[kind].fd != -1)
+      {
+	struct epoll_event event = {.events = EPOLLIN,.data.ptr =
+	    &(s->watches[kind])
+	};
+
+	epoll_ctl (s->supervisor->epoll_fd, EPOLL_CTL_MOD,
+		   s->watches[kind].fd, &event);
+      }
+}
+
+/* Ask the supervisor to write the stdin queue (p->write_mutex locked) */
+static void
+supervision_arm_stdin (subprocess_t * p)
+{
+  pthread_mutex_lock (&(p->mutex));
+
+  if ((p->supervision != NULL) &&
+      (p->supervision->watches[WATCH_STDIN].fd != -1))
+    {
+      struct supervision *s = p->supervision;
+      struct epoll_event event = {.events = EPOLLOUT,.data.ptr =
+	  &(s->watches[WATCH_STDIN])
+      };
+
+      epoll_ctl (s->supervisor->epoll_fd, EPOLL_CTL_MOD,
+		 s->watches[WATCH_STDIN].fd, &event);
+    }
+
+  pthread_mutex_unlock (&(p->mutex));
+}
+#endif /* HAVE_SUPERVISOR */
+
+int
+rlimit_supervisor_start (int threads)
+{
+  int ret = RETURN_SUCCESS;
+
+#ifdef HAVE_SUPERVISOR
+  if (threads < 1)
+    threads = 1;
+
+  pthread_mutex_lock (&engine_mutex);
+
+  CHECK_ERROR ((engine != NULL), "supervisor engine already started");
+
+  /* Checking that the kernel provides pidfds */
+  pthread_once (&pidfd_once, pidfd_probe);
+  CHECK_ERROR (!pidfd_supported, "pidfd_open failed");
+
+  engine = calloc (threads, sizeof (supervisor_t));
+  CHECK_ERROR ((engine == NULL), "supervisor allocation failed");
+
+  engine_size = 0;
+  while (engine_size < threads)
+    {
+      supervisor_t *sv = &(engine[engine_size]);
+      struct epoll_event event = {.events = EPOLLIN,.data.ptr = NULL };
+      struct epoll_event timers = {.events = EPOLLIN,.data.ptr =
+	  &(sv->timers_watch)
+      };
+      bool timers_ready;
+
+      sv->active = 0;
+      sv->event_fd = eventfd (0, EFD_CLOEXEC);
+      sv->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+      timers_ready = (wheel_init (&(sv->timers)) == RETURN_SUCCESS);
+
+      sv->timers_watch.s = NULL;
+      sv->timers_watch.kind = WATCH_TIMERS;
+      sv->timers_watch.fd = sv->timers.fd;
+
+      if ((sv->event_fd == -1) || (sv->epoll_fd == -1) || !timers_ready ||
+	  (epoll_ctl (sv->epoll_fd, EPOLL_CTL_ADD, sv->event_fd, &event) == -1)
+	  || (epoll_ctl (sv->epoll_fd, EPOLL_CTL_ADD, sv->timers.fd,
+			 &timers) == -1)
+	  || (pthread_create (&(sv->thread), NULL, supervisor_loop, sv) != 0))
+	{
+	  if (sv->event_fd != -1)
+	    close (sv->event_fd);
+	  if (sv->epoll_fd != -1)
+	    close (sv->epoll_fd);
+	  if (timers_ready)
+	    wheel_destroy (&(sv->timers));
+
+	  pthread_mutex_unlock (&engine_mutex);
+	  rlimit_supervisor_stop ();
+	  pthread_mutex_lock (&engine_mutex);
+	  CHECK_ERROR (true, "supervisor creation failed");
+	}
+
+      engine_size++;
+    }
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  pthread_mutex_unlock (&engine_mutex);
+#else
+  (void) threads;
+  rlimit_error ("supervisor engine is not supported");
+  ret = RETURN_FAILURE;
+#endif /* HAVE_SUPERVISOR */
+
+  return ret;
+}
+
+void
+rlimit_supervisor_stop (void)
+{
+#ifdef HAVE_SUPERVISOR
+  uint64_t value = 1;
+
+  pthread_mutex_lock (&engine_mutex);
+
+  if (engine == NULL)
+    {
+      pthread_mutex_unlock (&engine_mutex);
+      return;
+    }
+
+  engine_stopping = true;
+  pthread_mutex_unlock (&engine_mutex);
+
+  /* Waiting for the supervised subprocesses to finish */
+  for (int i = 0; i < engine_size; i++)
+    {
+      if (write (engine[i].event_fd, &value, sizeof (value)) == -1)
+	rlimit_error ("write(event_fd) failed");
+
+      pthread_join (engine[i].thread, NULL);
+      close (engine[i].event_fd);
+      close (engine[i].epoll_fd);
+      wheel_destroy (&(engine[i].timers));
+    }
+
+  pthread_mutex_lock (&engine_mutex);
+  free (engine);
+  engine = NULL;
+  engine_size = 0;
+  engine_stopping = false;
+  pthread_mutex_unlock (&engine_mutex);
+#endif /* HAVE_SUPERVISOR */
+}
+
+int
+rlimit_subprocess_run (subprocess_t * p)
+{
+  int ret = RETURN_SUCCESS;
+
+#ifdef HAVE_SUPERVISOR
+  /* Handing the subprocess over to the supervisor engine (if any) */
+  supervisor_t *sv = supervisor_pick (p);
+
+  if (sv != NULL)
+    return supervisor_run (sv, p);
+#endif /* HAVE_SUPERVISOR */
+
+  /* Running a monitor thread to wait for subprocess return value */
+  CHECK_ERROR ((pthread_create (p->monitor, NULL, monitor, p) != 0),
+	       "monitor creation failed");
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+int
+rlimit_subprocess_kill (subprocess_t * p)
+{
+  int ret;
+
+  if ((ret = subprocess_send_signal (p, SIGKILL)) == -1)
+    rlimit_error ("kill failed");
+
+  return ret;
+}
+
+int
+rlimit_subprocess_suspend (subprocess_t * p)
+{
+  int ret;
+
+  if ((ret = subprocess_send_signal (p, SIGSTOP)) == -1)
+    rlimit_error ("suspend failed");
+
+  return ret;
+}
+
+int
+rlimit_subprocess_resume (subprocess_t * p)
+{
+  int ret;
+
+  if ((ret = subprocess_send_signal (p, SIGCONT)) == -1)
+    rlimit_error ("resume failed");
+
+  return ret;
+}
+
+int
+rlimit_queue_stdin (subprocess_t * p, const void *data, size_t length)
+{
+  int ret = RETURN_SUCCESS;
+  struct io_chunk *chunk = malloc (sizeof (struct io_chunk) + length);
+
+  CHECK_ERROR ((chunk == NULL), "stdin chunk allocation failed");
+
+  memcpy (chunk->data, data, length);
+  chunk->length = length;
+  chunk->offset = 0;
+  chunk->next = NULL;
+
+  pthread_mutex_lock (&(p->write_mutex));
+
+  if (p->stdin_closed)
+    {
+      pthread_mutex_unlock (&(p->write_mutex));
+      free (chunk);
+      CHECK_ERROR (true, "stdin is closed");
+    }
+
+  if (p->stdin_tail != NULL)
+    p->stdin_tail->next = chunk;
+  else
+    {
+      p->stdin_head = chunk;
+
+      /* Waking up the writer of the queue */
+#ifdef HAVE_SUPERVISOR
+      if (p->supervised)
+	supervision_arm_stdin (p);
+#endif /* HAVE_SUPERVISOR */
+
+      pthread_mutex_lock (&(p->mutex));
+      if ((p->io_wake[1] != -1) && (write (p->io_wake[1], "", 1) == -1) &&
+	  (errno != EAGAIN))
+	rlimit_warning ("waking up the io_monitor failed");
+      pthread_mutex_unlock (&(p->mutex));
+    }
+  p->stdin_tail = chunk;
+
+  pthread_mutex_unlock (&(p->write_mutex));
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+int
+rlimit_flush_stdin (subprocess_t * p)
+{
+  int ret;
+
+  pthread_mutex_lock (&(p->write_mutex));
+
+  while (p->stdin_head != NULL)
+    pthread_cond_wait (&(p->stdin_flushed), &(p->write_mutex));
+
+  ret = (p->stdin_lost) ? RETURN_FAILURE : RETURN_SUCCESS;
+
+  pthread_mutex_unlock (&(p->write_mutex));
+
+  return ret;
+}
+
+void
+rlimit_write_stdin (subprocess_t * p, char * msg)
+{
+  if (rlimit_queue_stdin (p, msg, strlen (msg)) == RETURN_SUCCESS)
+    rlimit_flush_stdin (p);
+}
+
+int
+rlimit_set_stdin_fd (subprocess_t * p, int fd)
+{
+  int ret = RETURN_SUCCESS;
+
+  CHECK_ERROR ((p->status != READY), "subprocess is already started");
+  CHECK_ERROR ((fd < 0), "invalid stdin file descriptor");
+
+  free (p->stdin_path);
+  p->stdin_path = NULL;
+  p->stdin_file = fd;
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+int
+rlimit_set_stdin_path (subprocess_t * p, const char *path)
+{
+  int ret = RETURN_SUCCESS;
+  char *tmp;
+
+  CHECK_ERROR ((p->status != READY), "subprocess is already started");
+  CHECK_ERROR (((tmp = strdup (path)) == NULL), "stdin path allocation failed");
+
+  free (p->stdin_path);
+  p->stdin_path = tmp;
+  p->stdin_file = -1;
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+int
+rlimit_input_new (const void *data, size_t length)
+{
+  const char *buffer = data;
+  size_t written = 0;
+  int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create ("rlimit-input", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  fd = io_capture_file ();
+#endif /* HAVE_MEMFD_CREATE */
+  CHECK_ERROR ((fd == -1), "input file creation failed");
+
+  while (written < length)
+    {
+      ssize_t count = write (fd, &(buffer[written]), length - written);
+
+      if ((count == -1) && (errno == EINTR))
+	continue;
+
+      if (count == -1)
+	{
+	  close (fd);
+	  fd = -1;
+	  CHECK_ERROR (true, "write(input) failed");
+	}
+
+      written += count;
+    }
+
+#ifdef HAVE_MEMFD_CREATE
+  /* Sealing the content (shared by all the subprocesses) */
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE |
+	     F_SEAL_SEAL) == -1)
+    {
+      close (fd);
+      fd = -1;
+      CHECK_ERROR (true, "sealing input failed");
+    }
+#endif /* HAVE_MEMFD_CREATE */
+
+fail:
+  return fd;
+}
+
+char *
+rlimit_read_stdout (subprocess_t * p)
+{
+  return (p->stdout_buffer);
+}
+
+char *
+rlimit_read_stderr (subprocess_t * p)
+{
+  return (p->stderr_buffer);
+}
+
+void
+rlimit_set_syscall_profile (subprocess_t * p, bool enable)
+{
+  if (p->status != READY)
+    rlimit_error ("subprocess is already started");
+  else if (!enable)
+    {
+      free (p->syscall_stats);
+      p->syscall_stats = NULL;
+    }
+  else if ((p->syscall_stats == NULL) &&
+	   ((p->syscall_stats =
+	     calloc (RLIMIT_SYSCALLS, sizeof (rlimit_syscall_stat_t))) ==
+	    NULL))
+    rlimit_error ("syscall profile allocation failed");
+  else
+    for (int i = 0; i < RLIMIT_SYSCALLS; i++)
+      p->syscall_stats[i].syscall = i;
+}
+
+void
+rlimit_set_perf_counters (subprocess_t * p, bool enable)
+{
+  if (p->status != READY)
+    rlimit_error ("subprocess is already started");
+  else
+    p->perf_counters = enable;
+}
+
+void
+rlimit_set_file_capture (subprocess_t * p, bool enable)
+{
+  if (p->status != READY)
+    rlimit_error ("subprocess is already started");
+  else
+    p->file_capture = enable;
+}
+
+const char *
+rlimit_get_stdout_view (subprocess_t * p, size_t * length)
+{
+  *length = p->stdout_length;
+  return (p->stdout_buffer);
+}
+
+const char *
+rlimit_get_stderr_view (subprocess_t * p, size_t * length)
+{
+  *length = p->stderr_length;
+  return (p->stderr_buffer);
+}
+
+void
+rlimit_set_stdout_callback (subprocess_t * p, rlimit_output_cb callback,
+			    void *data)
+{
+  if (p->status != READY)
+    rlimit_error ("subprocess is already started");
+  else
+    {
+      p->stdout_callback = callback;
+      p->stdout_data = data;
+    }
+}
+
+void
+rlimit_set_stderr_callback (subprocess_t * p, rlimit_output_cb callback,
+			    void *data)
+{
+  if (p->status != READY)
+    rlimit_error ("subprocess is already started");
+  else
+    {
+      p->stderr_callback = callback;
+      p->stderr_data = data;
+    }
+}
+
+void
+rlimit_resume_output (subprocess_t * p)
+{
+  pthread_mutex_lock (&(p->mutex));
+
+  p->resumes++;
+  p->stdout_paused = false;
+  p->stderr_paused = false;
+
+#ifdef HAVE_SUPERVISOR
+  if (p->supervised)
+    supervision_resume (p);
+#endif /* HAVE_SUPERVISOR */
+
+  /* Waking up the io_monitor (if running) */
+  if ((p->io_wake[1] != -1) && (write (p->io_wake[1], "", 1) == -1) &&
+      (errno != EAGAIN))
+    rlimit_warning ("waking up the io_monitor failed");
+
+  pthread_mutex_unlock (&(p->mutex));
+}
+
+size_t
+rlimit_get_stdout_dropped (subprocess_t * p)
+{
+  return (p->stdout_dropped);
+}
+
+size_t
+rlimit_get_stderr_dropped (subprocess_t * p)
+{
+  return (p->stderr_dropped);
+}
+
+/***** Batch runner *****/
+
+/* A batch runs the subprocesses submitted with a fixed number of
+ * workers (each running one subprocess at a time). Each worker has a
+ * queue of its own, the submissions being spread over them. A worker
+ * takes the oldest subprocess of its queue and, once it is empty,
+ * steals the newest one of another queue, so uneven run times keep
+ * every worker busy. Terminated subprocesses are delivered through a
+ * completion queue. */
+
+#define BATCH_QUEUE_SIZE 64	/* Initial size of the worker queues */
+
+/* Subprocess submitted to a batch */
+struct batch_job
+{
+  subprocess_t *p;		/* Subprocess to run */
+  struct batch_job *next;	/* Next job in the completion queue */
+};
+
+/* Queue of a worker (ring buffer) */
+struct batch_queue
+{
+  pthread_mutex_t mutex;	/* Mutex locking the queue */
+  struct batch_job **jobs;	/* Jobs queued */
+  int size;			/* Allocated size of jobs[] */
+  int head;			/* Oldest job */
+  int count;			/* Number of jobs queued */
+};
+
+struct batch_worker
+{
+  rlimit_batch_t *batch;	/* Batch the worker belongs to */
+  pthread_t thread;		/* Worker thread */
+  int index;			/* Index of the worker */
+  struct batch_queue queue;	/* Jobs of the worker */
+};
+
+struct rlimit_batch
+{
+  int workers_size;		/* Number of workers */
+  struct batch_worker *workers;	/* Workers */
+  unsigned int next;		/* Worker getting the next submission */
+
+  pthread_mutex_t mutex;	/* Mutex locking the fields below */
+  pthread_cond_t work;		/* Signaled when jobs are queued */
+  pthread_cond_t completion;	/* Signaled when a job is completed */
+  int queued;			/* Jobs waiting in the worker queues */
+  int pending;			/* Jobs submitted and not collected */
+  bool stopping;		/* Workers have to exit */
+  struct batch_job *completed;	/* Completion queue (oldest first) */
+  struct batch_job *completed_tail;	/* Last completed job */
+};
+
+static int
+batch_queue_push (struct batch_queue *q, struct batch_job *job)
+{
+  int ret = RETURN_SUCCESS;
+
+  pthread_mutex_lock (&(q->mutex));
+
+  if (q->count == q->size)
+    {
+      struct batch_job **jobs =
+	malloc (2 * q->size * sizeof (struct batch_job *));
+      CHECK_ERROR ((jobs == NULL), "batch queue allocation failed");
+
+      for (int i = 0; i < q->count; i++)
+	jobs[i] = q->jobs[(q->head + i) % q->size];
+
+      free (q->jobs);
+      q->jobs = jobs;
+      q->size *= 2;
+      q->head = 0;
+    }
+
+  q->jobs[(q->head + q->count) % q->size] = job;
+  q->count++;
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  pthread_mutex_unlock (&(q->mutex));
+
+  return ret;
+}
+
+/* Take the oldest job of the queue (or the newest one when stealing) */
+static struct batch_job *
+batch_queue_pop (rlimit_batch_t * b, struct batch_queue *q, bool steal)
+{
+  struct batch_job *job = NULL;
+
+  pthread_mutex_lock (&(q->mutex));
+
+  if (q->count > 0)
+    {
+      if (steal)
+	job = q->jobs[(q->head + q->count - 1) % q->size];
+      else
+	{
+	  job = q->jobs[q->head];
+	  q->head = (q->head + 1) % q->size;
+	}
+
+      q->count--;
+
+      /* Counted under the queue lock, 'queued' never exceeds the jobs
+       * actually queued (idle workers do not spin) */
+      __sync_sub_and_fetch (&(b->queued), 1);
+    }
+
+  pthread_mutex_unlock (&(q->mutex));
+
+  return job;
+}
+
+static struct batch_job *
+batch_take (struct batch_worker *w)
+{
+  rlimit_batch_t *b = w->batch;
+  struct batch_job *job;
+
+  if ((job = batch_queue_pop (b, &(w->queue), false)) != NULL)
+    return job;
+
+  for (int i = 1; (i < b->workers_size) && (job == NULL); i++)
+    job = batch_queue_pop (b, &(b->workers[(w->index + i) %
+					  b->workers_size].queue), true);
+
+  return job;
+}
+
+static void *
+batch_worker (void *arg)
+{
+  struct batch_worker *w = arg;
+  rlimit_batch_t *b = w->batch;
+
+  placement_pin ();
+
+  while (true)
+    {
+      struct batch_job *job = batch_take (w);
+
+      if (job == NULL)
+	{
+	  pthread_mutex_lock (&(b->mutex));
+
+	  while ((b->queued <= 0) && !b->stopping)
+	    pthread_cond_wait (&(b->work), &(b->mutex));
+
+	  if ((b->queued <= 0) && b->stopping)
+	    {
+	      pthread_mutex_unlock (&(b->mutex));
+	      break;
+	    }
+
+	  pthread_mutex_unlock (&(b->mutex));
+	  continue;
+	}
+
+      if (rlimit_subprocess_run (job->p) == RETURN_SUCCESS)
+	rlimit_subprocess_wait (job->p);
+
+      job->next = NULL;
+
+      pthread_mutex_lock (&(b->mutex));
+      if (b->completed_tail == NULL)
+	b->completed = job;
+      else
+	b->completed_tail->next = job;
+      b->completed_tail = job;
+      pthread_cond_signal (&(b->completion));
+      pthread_mutex_unlock (&(b->mutex));
+    }
+
+  return NULL;
+}
+
+rlimit_batch_t *
+rlimit_batch_new (int concurrency)
+{
+  rlimit_batch_t *b = calloc (1, sizeof (rlimit_batch_t));
+  CHECK_ERROR ((b == NULL), "batch allocation failed");
+
+  if (concurrency < 1)
+    concurrency = sysconf (_SC_NPROCESSORS_ONLN);
+  if (concurrency < 1)
+    concurrency = 1;
+
+  pthread_mutex_init (&(b->mutex), NULL);
+  pthread_cond_init (&(b->work), NULL);
+  pthread_cond_init (&(b->completion), NULL);
+
+  b->workers = calloc (concurrency, sizeof (struct batch_worker));
+  CHECK_ERROR ((b->workers == NULL), "batch allocation failed");
+
+  while (b->workers_size < concurrency)
+    {
+      struct batch_worker *w = &(b->workers[b->workers_size]);
+
+      w->batch = b;
+      w->index = b->workers_size;
+      w->queue.size = BATCH_QUEUE_SIZE;
+      w->queue.jobs =
+	malloc (BATCH_QUEUE_SIZE * sizeof (struct batch_job *));
+      pthread_mutex_init (&(w->queue.mutex), NULL);
+
+      if ((w->queue.jobs == NULL) ||
+	  (pthread_create (&(w->thread), NULL, batch_worker, w) != 0))
+	{
+	  free (w->queue.jobs);
+	  pthread_mutex_destroy (&(w->queue.mutex));
+	  rlimit_batch_delete (b);
+	  b = NULL;
+	  CHECK_ERROR (true, "batch worker creation failed");
+	}
+
+      b->workers_size++;
+    }
+
+  return b;
+
+fail:
+  if ((b != NULL) && (b->workers == NULL))
+    {
+      pthread_mutex_destroy (&(b->mutex));
+      pthread_cond_destroy (&(b->work));
+      pthread_cond_destroy (&(b->completion));
+      free (b);
+    }
+
+  return NULL;
+}
+
+int
+rlimit_batch_submit (rlimit_batch_t * b, subprocess_t * p)
+{
+  struct batch_job *job = NULL;
+  unsigned int next;
+
+  CHECK_ERROR ((p->status != READY), "subprocess already started");
+
+  job = malloc (sizeof (struct batch_job));
+  CHECK_ERROR ((job == NULL), "batch job allocation failed");
+  job->p = p;
+  job->next = NULL;
+
+  /* Counted before a worker can complete it */
+  pthread_mutex_lock (&(b->mutex));
+
+  next = b->next++ % b->workers_size;
+  if (batch_queue_push (&(b->workers[next].queue), job) == RETURN_FAILURE)
+    {
+      pthread_mutex_unlock (&(b->mutex));
+      goto fail;
+    }
+
+  b->pending++;
+  __sync_add_and_fetch (&(b->queued), 1);
+  pthread_cond_signal (&(b->work));
+  pthread_mutex_unlock (&(b->mutex));
+
+  return RETURN_SUCCESS;
+
+fail:
+  free (job);
+
+  return RETURN_FAILURE;
+}
+
+subprocess_t *
+rlimit_batch_next (rlimit_batch_t * b)
+{
+  subprocess_t *p = NULL;
+  struct batch_job *job;
 
-  /* Initializing the pipes () */
-  int stdin_pipe[2];		/* '0' = child_read,  '1' = parent_write */
-  int stdout_pipe[2];		/* '0' = parent_read, '1' = child_write */
-  int stderr_pipe[2];		/* '0' = parent_read, '1' = child_write */
+  pthread_mutex_lock (&(b->mutex));
 
-  CHECK_ERROR (((pipe (stdin_pipe) == -1) ||
-		(pipe (stdout_pipe) == -1) ||
-		(pipe (stderr_pipe) == -1)), "pipe initialization failed");
+  while ((b->completed == NULL) && (b->pending > 0))
+    pthread_cond_wait (&(b->completion), &(b->mutex));
 
-  /* We create a child process running the subprocess and we wait for
-   * it to finish. If a timeout elapsed the child is killed. Waiting
-   * is done using sigtimedwait(). Race condition is avoided by
-   * blocking the SIGCHLD signal before fork() and storing it into the
-   * buffer while starting the timer in a separate pthread. */
+  if ((job = b->completed) != NULL)
+    {
+      if ((b->completed = job->next) == NULL)
+	b->completed_tail = NULL;
+      b->pending--;
 
-  /* Blocking SIGCHLD before forking */
-  sigset_t mask;
+      p = job->p;
+      free (job);
+    }
 
-  CHECK_ERROR ((sigemptyset (&mask) == -1), "sigemptyset failed");
-  CHECK_ERROR ((sigaddset (&mask, SIGCHLD) == -1), "sigaddset failed");
+  pthread_mutex_unlock (&(b->mutex));
 
-  CHECK_ERROR ((sigprocmask (SIG_BLOCK, &mask, NULL) == -1),
-	       "sigprocmask failed");
+  return p;
+}
 
-  /* Getting start time of the subprocess (profiling information) */
-  CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &start_time) == -1),
-	       "getting start time failed");
+void
+rlimit_batch_delete (rlimit_batch_t * b)
+{
+  subprocess_t *p;
+
+  if (b == NULL)
+    return;
 
-  /* Forking the process */
-  CHECK_ERROR (((p->pid = fork ()) == -1), "fork failed");
+  /* Running every job left and deleting those not collected */
+  while ((p = rlimit_batch_next (b)) != NULL)
+    rlimit_subprocess_delete (p);
 
-  if (p->pid == 0)	/***** Child process *****/
+  pthread_mutex_lock (&(b->mutex));
+  b->stopping = true;
+  pthread_cond_broadcast (&(b->work));
+  pthread_mutex_unlock (&(b->mutex));
+
+  for (int i = 0; i < b->workers_size; i++)
     {
-      /* TODO: What if the child_monitor fails miserably ? It should
-       * be signaled in the parent stderr and not in the child
-       * stderr. */
-      CHECK_ERROR ((child_monitor (p,
-				   stdin_pipe,
-				   stdout_pipe,
-				   stderr_pipe) == RETURN_FAILURE),
-		   "child monitor failed");
+      pthread_join (b->workers[i].thread, NULL);
+      free (b->workers[i].queue.jobs);
+      pthread_mutex_destroy (&(b->workers[i].queue.mutex));
     }
-  else			    /***** Parent process *****/
-    {
-      int status;
-      pthread_t watchdog_pthread, io_pthread;
-      struct rusage usage;
 
-      CHECK_ERROR ((close (stdin_pipe[0]) == -1), "close(stdin[0]) failed");
-      CHECK_ERROR (((p->stdin = fdopen (stdin_pipe[1], "w")) == NULL),
-		   "fdopen(stdin[1]) failed");
+  pthread_mutex_destroy (&(b->mutex));
+  pthread_cond_destroy (&(b->work));
+  pthread_cond_destroy (&(b->completion));
+  free (b->workers);
+  free (b);
+}
 
-      CHECK_ERROR ((close (stdout_pipe[1]) == -1), "close(stdout[1]) failed");
-      CHECK_ERROR (((p->stdout = fdopen (stdout_pipe[0], "r")) == NULL),
-		   "fdopen(stdout[0]) failed");
+/***** Repeated runs *****/
 
-      CHECK_ERROR ((close (stderr_pipe[1]) == -1), "close(stderr[1]) failed");
-      CHECK_ERROR (((p->stderr = fdopen (stderr_pipe[0], "r")) == NULL),
-		   "fdopen(stderr[0]) failed");
+/* Two-sided 95% quantiles of Student's t distribution (by degrees of
+ * freedom, the normal one being used above) */
+static const double student_t95[] = {
+  12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+  2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+  2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+};
 
-      /* Running a watchdog to timeout the subprocess */
-      if ((p->limits) && (p->limits->timeout > 0))
-	CHECK_ERROR ((pthread_create (&watchdog_pthread, NULL, watchdog, p) !=
-		      0), "watchdog creation failed");
+#define STUDENT_T95(df) (((df) <= 30) ? student_t95[(df) - 1] : 1.960)
 
-      /* Running the io monitor to watch stdout and stderr */
-      CHECK_ERROR ((pthread_create (&io_pthread, NULL, io_monitor, p) != 0),
-		   "io_monitor creation failed");
+/* Measures of a run */
+#define MEASURE_REAL   0
+#define MEASURE_USER   1
+#define MEASURE_SYS    2
+#define MEASURE_MEMORY 3
+#define MEASURES       4
 
-      p->status = RUNNING;
+static int
+stats_compare (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
 
-      /* Waiting for synchronization with monitored process */
-      CHECK_ERROR (wait4 (p->pid, &status, 0, &usage) == -1, "wait failed");
+  return (x > y) - (x < y);
+}
 
-      /* Filtering syscalls with ptrace */
-      if ((p->limits != NULL) && (p->limits->syscalls[0] > 0))
-	{
-	  if (syscall_filter (p, &status, &usage) == RETURN_FAILURE)
-	    goto fail;
-	}
+/* Statistics of the 'n' values kept (sorted in place) */
+static void
+stats_compute (double *values, int n, rlimit_stats_t * s)
+{
+  double sum = 0, squares = 0;
 
-      /***** The subprocess is finished now *****/
+  memset (s, 0, sizeof (rlimit_stats_t));
+  if (n == 0)
+    return;
 
-      /* Getting end time of the subprocess (profiling information) */
-      struct timespec tmp_time, end_time;
+  qsort (values, n, sizeof (double), stats_compare);
 
-      CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &end_time) == -1),
-		   "getting end time failed");
-      tmp_time = timespec_diff (start_time, end_time);
+  for (int i = 0; i < n; i++)
+    sum += values[i];
+  s->mean = sum / n;
 
-      p->real_time_usec =
-	(time_t) (tmp_time.tv_sec * 1000000 + tmp_time.tv_nsec / 1000);
+  for (int i = 0; i < n; i++)
+    squares += (values[i] - s->mean) * (values[i] - s->mean);
+  s->stddev = (n > 1) ? sqrt (squares / (n - 1)) : 0;
 
-      /* Finding out what the status and retval are really */
-      if (WIFEXITED (status))
-	{			/* Exited normally */
-	  p->status = TERMINATED;
-	  p->retval = WEXITSTATUS (status);	/* Return value */
-	}
-      else if (WIFSIGNALED (status))
-	{
-	  p->retval = WTERMSIG (status);	/* Kill signal */
+  s->min = values[0];
+  s->median = (values[(n - 1) / 2] + values[n / 2]) / 2;
+  s->p95 = values[(95 * n + 99) / 100 - 1];	/* Nearest rank */
+}
 
-	  if (p->status < TERMINATED)
-	    {
-	      /* Trying to guess why by looking at errno value */
-	      switch (WTERMSIG (status))
-		{
-		case SIGSEGV:
-		  p->status = MEMORYOUT;
-		  break;
+/* Mark the runs whose real time lies out of the Tukey fences (1.5
+ * inter-quartile range away from the quartiles) as outliers and return
+ * the number of runs kept */
+static int
+repeat_discard (double *real, int n, bool *kept, double *sorted)
+{
+  double q1, q3, low, high;
+  int count = 0;
 
-		default:
-		  p->status = KILLED;
-		}
-	    }
-	  /* FIXME: It may be interesting to store the termination signal
-	   * into another variable and to 'p->retval = errno' */
-	}
-      else if (WIFSTOPPED (status))
-	{
-	  p->status = STOPPED;
-	  p->retval = WSTOPSIG (status);	/* Stop signal */
-	}
-      else if (WIFCONTINUED (status))
-	{
-	  p->status = RUNNING;
-	  p->retval = 0;	/* Process is still running */
-	}
+  memcpy (sorted, real, n * sizeof (double));
+  qsort (sorted, n, sizeof (double), stats_compare);
 
-    fail:
-      /* Cleaning the io_monitor */
-      pthread_cancel (io_pthread);
+  q1 = sorted[(n - 1) / 4];
+  q3 = sorted[(3 * (n - 1)) / 4];
+  low = q1 - 1.5 * (q3 - q1);
+  high = q3 + 1.5 * (q3 - q1);
+
+  for (int i = 0; i < n; i++)
+    {
+      /* Too few runs to tell the outliers */
+      kept[i] = (n < 4) || ((real[i] >= low) && (real[i] <= high));
+      count += kept[i];
+    }
+
+  return count;
+}
+
+/* Statistics of the runs measured so far */
+static void
+repeat_stats (double *measures[MEASURES], int n, bool discard, bool *kept,
+	      double *values, rlimit_repeat_t * result)
+{
+  rlimit_stats_t *stats[MEASURES] = { &(result->real_usec),
+    &(result->user_usec), &(result->sys_usec), &(result->memory_kbytes)
+  };
 
-      /* Cleaning the watchdog if not already exited */
-      if ((p->limits) && (p->limits->timeout > 0))
-	pthread_cancel (watchdog_pthread);
+  result->runs = n;
+  result->kept = n;
+  for (int i = 0; i < n; i++)
+    kept[i] = true;
 
-      /* Cleaning and setting the profile information */
-      /* User time in us */
-      p->user_time_usec =
-	usage.ru_utime.tv_sec * 1000 + usage.ru_utime.tv_usec;
+  if (discard)
+    result->kept = repeat_discard (measures[MEASURE_REAL], n, kept, values);
+
+  for (int m = 0; m < MEASURES; m++)
+    {
+      int count = 0;
 
-      /* System time in us */
-      p->sys_time_usec =
-	usage.ru_stime.tv_sec * 1000 + usage.ru_stime.tv_usec;
+      for (int i = 0; i < n; i++)
+	if (kept[i])
+	  values[count++] = measures[m][i];
 
-      /* Memory usage */
-      p->memory_kbytes = usage.ru_maxrss;
+      stats_compute (values, count, stats[m]);
     }
 
-  return NULL;
+  /* Relative half-width of the confidence interval of the mean */
+  result->ci = 0;
+  if ((result->kept > 1) && (result->real_usec.mean > 0))
+    result->ci = STUDENT_T95 (result->kept - 1) * result->real_usec.stddev /
+      sqrt (result->kept) / result->real_usec.mean;
 }
 
-int
-rlimit_subprocess_run (subprocess_t * p)
+/* New subprocess with the command line, limits and stdin of 'p' */
+static subprocess_t *
+repeat_copy (subprocess_t * p)
 {
-  int ret = RETURN_SUCCESS;
+  subprocess_t *copy = rlimit_subprocess_create (p->argc, p->argv, p->envp);
+  CHECK_ERROR ((copy == NULL), "subprocess allocation failed");
 
-  /* Running a monitor thread to wait for subprocess return value */
-  CHECK_ERROR ((pthread_create (p->monitor, NULL, monitor, p) != 0),
-	       "monitor creation failed");
+  CHECK_ERROR ((limits_copy (copy, p) == RETURN_FAILURE),
+	       "limits allocation failed");
+  copy->file_capture = p->file_capture;
+  copy->perf_counters = p->perf_counters;
+
+  if (p->stdin_path != NULL)
+    CHECK_ERROR ((rlimit_set_stdin_path (copy, p->stdin_path) ==
+		  RETURN_FAILURE), "stdin path allocation failed");
+  copy->stdin_file = p->stdin_file;
+
+  for (struct io_chunk * chunk = p->stdin_head; chunk != NULL;
+       chunk = chunk->next)
+    CHECK_ERROR ((rlimit_queue_stdin (copy, chunk->data, chunk->length) ==
+		  RETURN_FAILURE), "stdin chunk allocation failed");
 
   if (false)
   fail:
-    ret = RETURN_FAILURE;
+    {
+      rlimit_subprocess_delete (copy);
+      copy = NULL;
+    }
 
-  return ret;
+  return copy;
 }
 
 int
-rlimit_subprocess_kill (subprocess_t * p)
+rlimit_subprocess_repeat (subprocess_t * p, const rlimit_repeat_opts_t * opts,
+			  rlimit_repeat_t * result)
 {
-  int ret;
+  int ret = RETURN_SUCCESS;
+  rlimit_repeat_opts_t o = {.warmup = 1,.min_runs = 5,.max_runs = 30,
+    .ci_target = 0.02,.keep_outliers = false
+  };
+  double *measures[MEASURES] = { NULL };
+  double *values = NULL;
+  bool *kept = NULL;
+  int n = 0;
+
+  memset (result, 0, sizeof (rlimit_repeat_t));
+  result->status = READY;
+
+  CHECK_ERROR ((p->status != READY), "subprocess is already started");
+
+  if (opts != NULL)
+    o = *opts;
+  CHECK_ERROR (((o.warmup < 0) || (o.max_runs < 1) || (o.ci_target < 0)),
+	       "invalid repeat options");
+  /* A confidence interval needs two runs at least */
+  o.min_runs = (o.min_runs < 2) ? 2 : o.min_runs;
+  o.min_runs = (o.min_runs > o.max_runs) ? o.max_runs : o.min_runs;
+
+  for (int m = 0; m < MEASURES; m++)
+    CHECK_ERROR (((measures[m] = malloc (o.max_runs * sizeof (double)))
+		  == NULL), "measures allocation failed");
+  CHECK_ERROR ((((values = malloc (o.max_runs * sizeof (double))) == NULL) ||
+		((kept = malloc (o.max_runs * sizeof (bool))) == NULL)),
+	       "measures allocation failed");
+
+  for (int i = -o.warmup; n < o.max_runs; i++)
+    {
+      subprocess_t *run = repeat_copy (p);
+      CHECK_ERROR ((run == NULL), "subprocess copy failed");
 
-  if ((ret = kill (p->pid, SIGKILL)) == -1)
-    rlimit_error ("kill failed");
+      if (rlimit_subprocess_run (run) == RETURN_FAILURE)
+	{
+	  rlimit_subprocess_delete (run);
+	  CHECK_ERROR (true, "subprocess run failed");
+	}
+      rlimit_subprocess_wait (run);
 
-  return ret;
-}
+      result->status = run->status;
+      if (i >= 0)
+	{
+	  measures[MEASURE_REAL][n] = run->real_time_usec;
+	  measures[MEASURE_USER][n] = run->user_time_usec;
+	  measures[MEASURE_SYS][n] = run->sys_time_usec;
+	  measures[MEASURE_MEMORY][n] = run->memory_kbytes;
+	}
+      rlimit_subprocess_delete (run);
 
-int
-rlimit_subprocess_suspend (subprocess_t * p)
-{
-  int ret;
+      /* Timing a run that did not complete tells nothing */
+      if (result->status != TERMINATED)
+	break;
 
-  if ((ret = kill (p->pid, SIGSTOP)) == -1)
-    rlimit_error ("suspend failed");
+      if (i < 0)
+	continue;
+
+      if ((++n >= o.min_runs) && (o.ci_target > 0))
+	{
+	  repeat_stats (measures, n, !o.keep_outliers, kept, values, result);
+	  if (result->ci <= o.ci_target)
+	    {
+	      result->converged = true;
+	      break;
+	    }
+	}
+    }
+
+  repeat_stats (measures, n, !o.keep_outliers, kept, values, result);
+  CHECK_ERROR ((result->status != TERMINATED), "subprocess did not terminate");
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  for (int m = 0; m < MEASURES; m++)
+    free (measures[m]);
+  free (values);
+  free (kept);
 
   return ret;
 }
 
-int
-rlimit_subprocess_resume (subprocess_t * p)
+/***** Expect *****/
+
+#define EXPECT_CACHE_SIZE 64	/* Compiled patterns kept (direct-mapped) */
+#define EXPECT_OVERLAP 4096	/* Bytes scanned again with new output */
+
+/* Compiled pattern (shared through the cache) */
+struct expect_pattern
 {
-  int ret;
+  char *source;			/* Regular expression */
+  regex_t regex;		/* Compiled regular expression */
+  int refcount;			/* References (cache included) */
+};
 
-  if ((ret = kill (p->pid, SIGCONT)) == -1)
-    rlimit_error ("resume failed");
+static pthread_mutex_t expect_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct expect_pattern *expect_cache[EXPECT_CACHE_SIZE];
 
-  return ret;
+static void
+expect_pattern_unref (struct expect_pattern *pattern)
+{
+  if ((pattern == NULL) ||
+      (__sync_sub_and_fetch (&(pattern->refcount), 1) > 0))
+    return;
+
+  regfree (&(pattern->regex));
+  free (pattern->source);
+  free (pattern);
 }
 
-void
-rlimit_write_stdin (subprocess_t * p, char * msg)
+/* Get the compiled pattern from the cache (compiling it if missing) */
+static struct expect_pattern *
+expect_pattern_get (const char *source)
 {
-  ssize_t size = strlen (msg);
+  struct expect_pattern *pattern, *evicted = NULL;
+  unsigned long hash = 5381;
+  int error;
 
-  struct timespec tick;
-  tick.tv_sec = 0;
-  tick.tv_nsec = 100;
+  for (const char *c = source; *c != '\0'; c++)
+    hash = hash * 33 + (unsigned char) *c;
 
-  pthread_mutex_lock (&(p->write_mutex));
+  pthread_mutex_lock (&expect_cache_mutex);
 
-  char * tmp = malloc ((size + 1) * sizeof (char));
-  CHECK_ERROR ((tmp == NULL), "write failed");
+  pattern = expect_cache[hash % EXPECT_CACHE_SIZE];
+  if ((pattern != NULL) && (strcmp (pattern->source, source) == 0))
+    {
+      __sync_add_and_fetch (&(pattern->refcount), 1);
+      pthread_mutex_unlock (&expect_cache_mutex);
+      return pattern;
+    }
 
-  memcpy (tmp, msg, size);
-  tmp[size] = '\0';
+  pthread_mutex_unlock (&expect_cache_mutex);
 
-  p->stdin_buffer = tmp;
+  /* Compiling it out of the lock */
+  pattern = malloc (sizeof (struct expect_pattern));
+  CHECK_ERROR ((pattern == NULL), "pattern allocation failed");
 
-  /* Wait until msg has been read or the process is finished */
-  while ((p->stdin_buffer != NULL) && (p->status < TERMINATED))
-    nanosleep (&tick, NULL);
+  if ((pattern->source = strdup (source)) == NULL)
+    {
+      free (pattern);
+      pattern = NULL;
+      CHECK_ERROR (true, "pattern allocation failed");
+    }
 
- fail:
-  pthread_mutex_unlock (&(p->write_mutex));
+  if ((error = regcomp (&(pattern->regex), source, REG_EXTENDED)) != 0)
+    {
+      char msgbuf[128];
+      regerror (error, &(pattern->regex), msgbuf, sizeof (msgbuf));
+
+      free (pattern->source);
+      free (pattern);
+      pattern = NULL;
+      CHECK_ERROR (true, msgbuf);
+    }
+
+  /* One reference for the caller, one for the cache */
+  pattern->refcount = 2;
+
+  pthread_mutex_lock (&expect_cache_mutex);
+  evicted = expect_cache[hash % EXPECT_CACHE_SIZE];
+  expect_cache[hash % EXPECT_CACHE_SIZE] = pattern;
+  pthread_mutex_unlock (&expect_cache_mutex);
+
+  expect_pattern_unref (evicted);
+
+fail:
+  return pattern;
 }
 
-char *
-rlimit_read_stdout (subprocess_t * p)
+/* Aho-Corasick automaton matching literal patterns in one pass (the
+ * failure links are resolved into the transitions, so a byte costs a
+ * single lookup) */
+struct ac_node
 {
-  return (p->stdout_buffer);
+  int next[256];		/* Transitions */
+  int fail;			/* Longest proper suffix in the automaton */
+  int out;			/* Longest literal ending here ('-1' if none) */
+  int depth;			/* Length of the prefix read to get here */
+};
+
+/* Patterns searched by an expect */
+struct expect_matcher
+{
+  int n;			/* Number of patterns */
+  struct expect_pattern *pattern;	/* Combined regular expression */
+  int *first;			/* First group of each pattern */
+  int *groups;			/* Number of groups of each pattern */
+  size_t nmatch;		/* Number of groups of the combination */
+  regmatch_t *match;		/* Groups matched */
+  struct ac_node *nodes;	/* Automaton ('NULL' with regexps) */
+  int *lengths;			/* Length of the literals */
+  int state[2];			/* State of the automaton on each stream */
+};
+
+/* Check if the pattern can be matched as a literal */
+static bool
+expect_is_literal (const char *pattern)
+{
+  return ((pattern[0] != '\0') &&
+	  (strpbrk (pattern, "\\^$.[]|()*+?{}") == NULL));
 }
 
-char *
-rlimit_read_stderr (subprocess_t * p)
+/* Count the groups of an extended regular expression */
+static int
+expect_count_groups (const char *pattern)
 {
-  return (p->stderr_buffer);
+  int groups = 0;
+
+  for (const char *c = pattern; *c != '\0'; c++)
+    {
+      if ((*c == '\\') && (c[1] != '\0'))
+	c++;
+      else if (*c == '(')
+	groups++;
+      else if (*c == '[')
+	{
+	  /* Skipping the bracket expression ('[]...]' and '[^]...]'
+	   * included) and its classes ('[:alpha:]', ...) */
+	  c++;
+	  if (*c == '^')
+	    c++;
+	  if (*c == ']')
+	    c++;
+
+	  while ((*c != '\0') && (*c != ']'))
+	    {
+	      if ((*c == '[') &&
+		  ((c[1] == ':') || (c[1] == '.') || (c[1] == '=')))
+		{
+		  char end = c[1];
+
+		  for (c += 2; (*c != '\0') && !((*c == end) && (c[1] == ']'));
+		       c++)
+		    continue;
+		  if (*c != '\0')
+		    c++;
+		}
+	      if (*c != '\0')
+		c++;
+	    }
+
+	  if (*c == '\0')
+	    break;
+	}
+    }
+
+  return groups;
+}
+
+static void
+expect_matcher_delete (struct expect_matcher *m)
+{
+  expect_pattern_unref (m->pattern);
+  free (m->first);
+  free (m->groups);
+  free (m->match);
+  free (m->nodes);
+  free (m->lengths);
 }
 
-bool rlimit_expect (subprocess_t * p, char * pattern, int timeout)
+/* Build the Aho-Corasick automaton of the literal patterns */
+static int
+expect_matcher_literals (struct expect_matcher *m, char **patterns)
 {
-  regex_t regex;
-  bool result = false;
-  int new_expect_stdout = 0;
-  int new_expect_stderr = 0;
-  struct timespec start_time, current_time;
+  int ret = RETURN_SUCCESS;
+  int size = 1, *queue = NULL, head = 0, tail = 0;
 
-  struct timespec tick;
-  tick.tv_sec = 0;
-  tick.tv_nsec = 100;
+  for (int i = 0; i < m->n; i++)
+    size += strlen (patterns[i]);
 
-  /* Getting start time */
-  CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &start_time) == -1),
-	       "getting start time failed");
+  m->nodes = malloc (size * sizeof (struct ac_node));
+  m->lengths = malloc (m->n * sizeof (int));
+  queue = malloc (size * sizeof (int));
+  CHECK_ERROR (((m->nodes == NULL) || (m->lengths == NULL) ||
+		(queue == NULL)), "automaton allocation failed");
 
-  /* Getting the regular expression compiled */
-  int error = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
-  char * str_stdout = &(p->stdout_buffer[p->expect_stdout]);
-  char * str_stderr = &(p->stderr_buffer[p->expect_stderr]);
+  /* Trie of the literals */
+  size = 1;
+  memset (m->nodes[0].next, -1, sizeof (m->nodes[0].next));
+  m->nodes[0].out = -1;
+  m->nodes[0].depth = 0;
 
-  /* Dealing with errors (if any) */
-  if (error != 0)
+  for (int i = 0; i < m->n; i++)
     {
-      char msgbuf[128];
-      regerror(error, &regex, msgbuf, sizeof(msgbuf));
+      int node = 0;
+
+      m->lengths[i] = strlen (patterns[i]);
+
+      for (const unsigned char *c = (unsigned char *) patterns[i];
+	   *c != '\0'; c++)
+	{
+	  if (m->nodes[node].next[*c] == -1)
+	    {
+	      memset (m->nodes[size].next, -1, sizeof (m->nodes[size].next));
+	      m->nodes[size].out = -1;
+	      m->nodes[size].depth = m->nodes[node].depth + 1;
+	      m->nodes[node].next[*c] = size++;
+	    }
+	  node = m->nodes[node].next[*c];
+	}
 
-      CHECK_ERROR(true, msgbuf);
+      /* Duplicates keep the first index */
+      if (m->nodes[node].out == -1)
+	m->nodes[node].out = i;
     }
 
-  /* Main loop: Wait until the pattern appears or the timeout is hit */
-  do
+  /* Failure links (breadth-first) resolved into the transitions */
+  m->nodes[0].fail = 0;
+  for (int c = 0; c < 256; c++)
     {
-      /* Wait a tick */
-      nanosleep (&tick, NULL);
+      int child = m->nodes[0].next[c];
 
-      if (!p->stdout_buffer)
-	continue;
+      if (child == -1)
+	m->nodes[0].next[c] = 0;
+      else
+	{
+	  m->nodes[child].fail = 0;
+	  queue[tail++] = child;
+	}
+    }
 
-      /* Get future expect_stdout/stderr (avoiding increase after search) */
-      new_expect_stdout = strlen (p->stdout_buffer);
-      new_expect_stderr = strlen (p->stderr_buffer);
+  while (head < tail)
+    {
+      int node = queue[head++];
+      int fail = m->nodes[node].fail;
+
+      /* A literal may end on a suffix of the prefix */
+      if (m->nodes[node].out == -1)
+	m->nodes[node].out = m->nodes[fail].out;
 
-      /* Searching for pattern */
-      if (regexec(&regex, str_stdout, (size_t) 0, NULL, 0) == 0)
+      for (int c = 0; c < 256; c++)
 	{
-	  result = true;
-	  break;
+	  int child = m->nodes[node].next[c];
+
+	  if (child == -1)
+	    m->nodes[node].next[c] = m->nodes[fail].next[c];
+	  else
+	    {
+	      m->nodes[child].fail = m->nodes[fail].next[c];
+	      queue[tail++] = child;
+	    }
 	}
+    }
 
-      if (!p->stderr_buffer)
-	continue;
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  free (queue);
+
+  return ret;
+}
+
+/* Combine the patterns into '(p1)|(p2)|...' */
+static int
+expect_matcher_regex (struct expect_matcher *m, char **patterns)
+{
+  int ret = RETURN_SUCCESS;
+  size_t length = 1;
+  char *source = NULL;
+
+  m->first = malloc (m->n * sizeof (int));
+  m->groups = malloc (m->n * sizeof (int));
+  CHECK_ERROR (((m->first == NULL) || (m->groups == NULL)),
+	       "pattern allocation failed");
+
+  if (m->n == 1)
+    {
+      m->first[0] = 0;
+      m->groups[0] = expect_count_groups (patterns[0]);
+      m->nmatch = m->groups[0] + 1;
+      m->pattern = expect_pattern_get (patterns[0]);
+    }
+  else
+    {
+      for (int i = 0; i < m->n; i++)
+	length += strlen (patterns[i]) + 3;
 
-      /* Get future expect_stdout (avoiding increase after search) */
-      new_expect_stderr = strlen (p->stderr_buffer);
+      source = malloc (length);
+      CHECK_ERROR ((source == NULL), "pattern allocation failed");
 
-      /* Searching for pattern */
-      if (regexec(&regex, str_stderr, (size_t) 0, NULL, 0) == 0)
+      source[0] = '\0';
+      m->nmatch = 1;
+      for (int i = 0; i < m->n; i++)
 	{
-	  result = true;
-	  break;
+	  strcat (source, (i == 0) ? "(" : "|(");
+	  strcat (source, patterns[i]);
+	  strcat (source, ")");
+
+	  m->first[i] = m->nmatch;
+	  m->groups[i] = expect_count_groups (patterns[i]);
+	  m->nmatch += m->groups[i] + 1;
 	}
 
-      /* Getting current time */
-      CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &current_time) == -1),
-	       "getting current time failed");
+      m->pattern = expect_pattern_get (source);
     }
-  while ((current_time.tv_sec - start_time.tv_sec) < timeout);
 
-  /* Setting expect_stdout/stderr to the new value */
-  p->expect_stdout = new_expect_stdout;
-  p->expect_stderr = new_expect_stderr;
+  CHECK_ERROR ((m->pattern == NULL), "pattern compilation failed");
 
- fail:
-  regfree(&regex);
+  m->match = malloc (m->nmatch * sizeof (regmatch_t));
+  CHECK_ERROR ((m->match == NULL), "pattern allocation failed");
 
-  return result;
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  free (source);
+
+  return ret;
 }
 
-bool rlimit_expect_stdout (subprocess_t * p, char * pattern, int timeout)
+static int
+expect_matcher_new (struct expect_matcher *m, char **patterns, int n)
 {
-  regex_t regex;
-  bool result = false;
-  int new_expect_stdout = 0;
-  struct timespec start_time, current_time;
+  bool literals = true;
 
-  struct timespec tick;
-  tick.tv_sec = 0;
-  tick.tv_nsec = 100;
+  memset (m, 0, sizeof (struct expect_matcher));
+  m->n = n;
 
-  /* Getting start time */
-  CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &start_time) == -1),
-	       "getting start time failed");
+  for (int i = 0; (i < n) && literals; i++)
+    literals = expect_is_literal (patterns[i]);
 
-  /* Getting the regular expression compiled */
-  int error = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
-  char * str = &(p->stdout_buffer[p->expect_stdout]);
+  if (literals)
+    return expect_matcher_literals (m, patterns);
 
-  /* Dealing with errors (if any) */
-  if (error != 0)
-    {
-      char msgbuf[128];
-      regerror(error, &regex, msgbuf, sizeof(msgbuf));
+  return expect_matcher_regex (m, patterns);
+}
 
-      CHECK_ERROR(true, msgbuf);
-    }
+/* Scan the output of 'stream' from 'start' for the patterns (p->mutex
+ * locked). The automaton goes on from its previous state unless
+ * 'restart' is set. On success, 'match' is filled and the cursor is
+ * moved. */
+static bool
+expect_scan (subprocess_t * p, int stream, struct expect_matcher *m,
+	     size_t start, bool restart, rlimit_match_t * match)
+{
+  struct io_stream io;
+  regmatch_t *groups = m->match;
+  int index = -1, eflags = 0;
+  const char *buffer;
+  size_t length;
 
-  /* Main loop: Wait until the pattern appears or the timeout is hit */
-  do
-    {
-      /* Wait a tick */
-      nanosleep (&tick, NULL);
+  io_stream (p, (stream == RLIMIT_STDOUT) ? STDOUT_FILENO : STDERR_FILENO,
+	     &io);
 
-      if (!p->stdout_buffer)
-	continue;
+  if (((buffer = *(io.buffer)) == NULL) || (start > *(io.length)))
+    return false;
+
+  length = *(io.length);
+
+  for (int i = 0; i < RLIMIT_MATCH_GROUPS; i++)
+    match->start[i] = match->end[i] = -1;
+
+  if (m->nodes != NULL)
+    {
+      int *state = &(m->state[(stream == RLIMIT_STDOUT) ? 0 : 1]);
 
-      /* Get future expect_stdout (avoiding increase after search) */
-      new_expect_stdout = strlen (p->stdout_buffer);
+      if (restart)
+	*state = 0;
 
-      /* Searching for pattern */
-      if (regexec(&regex, str, (size_t) 0, NULL, 0) == 0)
+      /* The literal starting first wins (the longest one on ties): the
+       * scan goes on past a match as long as the prefix in the
+       * automaton may still complete one starting before, or at the
+       * same position but longer */
+      for (size_t i = start; i < length; i++)
 	{
-	  result = true;
-	  break;
+	  int out;
+
+	  *state = m->nodes[*state].next[(unsigned char) buffer[i]];
+
+	  /* Longest literal ending here, hence starting first */
+	  if (((out = m->nodes[*state].out) != -1) &&
+	      ((index == -1) ||
+	       (i + 1 - m->lengths[out] < (size_t) match->start[0]) ||
+	       ((i + 1 - m->lengths[out] == (size_t) match->start[0]) &&
+		(m->lengths[out] > m->lengths[index]))))
+	    {
+	      index = out;
+	      match->start[0] = i + 1 - m->lengths[index];
+	      match->end[0] = i + 1;
+	    }
+
+	  if ((index != -1) &&
+	      (i + 1 - m->nodes[*state].depth > (size_t) match->start[0]))
+	    break;
 	}
 
-      /* Getting current time */
-      CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &current_time) == -1),
-	       "getting current time failed");
+      if (index == -1)
+	return false;
     }
-  while (((current_time.tv_sec - start_time.tv_sec) < timeout) &&
-	 (p->status < TERMINATED));
+  else
+    {
+      /* The beginning of the scan is not the beginning of the search */
+      if (start > (size_t) *(io.expect))
+	eflags |= REG_NOTBOL;
+
+#ifdef REG_STARTEND
+      groups[0].rm_so = start;
+      groups[0].rm_eo = length;
+      eflags |= REG_STARTEND;
+
+      if (regexec (&(m->pattern->regex), buffer, m->nmatch, groups,
+		   eflags) != 0)
+	return false;
+#else
+      if (regexec (&(m->pattern->regex), &(buffer[start]), m->nmatch,
+		   groups, eflags) != 0)
+	return false;
+
+      for (size_t i = 0; i < m->nmatch; i++)
+	if (groups[i].rm_so != -1)
+	  {
+	    groups[i].rm_so += start;
+	    groups[i].rm_eo += start;
+	  }
+#endif /* REG_STARTEND */
+
+      /* The alternative matched is the one whose group is set */
+      for (index = 0; index < m->n - 1; index++)
+	if (groups[m->first[index]].rm_so != -1)
+	  break;
 
-  /* Setting expect_stdout to the new value */
-  p->expect_stdout = new_expect_stdout;
+      for (int i = 0; (i <= m->groups[index]) && (i < RLIMIT_MATCH_GROUPS);
+	   i++)
+	{
+	  match->start[i] = groups[m->first[index] + i].rm_so;
+	  match->end[i] = groups[m->first[index] + i].rm_eo;
+	}
+    }
 
- fail:
-  regfree(&regex);
+  match->stream = stream;
+  match->index = index;
+  *(io.expect) = match->end[0];
 
-  return result;
+  return true;
 }
 
-bool rlimit_expect_stderr (subprocess_t * p, char * pattern, int timeout)
+/* Wait for the patterns on the streams, scanning only the new output */
+static bool
+expect_wait (subprocess_t * p, int streams, struct expect_matcher *m,
+	     int timeout, rlimit_match_t * match)
 {
-  regex_t regex;
-  bool result = false;
-  int new_expect_stderr = 0;
-  struct timespec start_time, current_time;
+  struct timespec deadline;
+  size_t scanned[2] = { 0, 0 };	/* Position scanned (with the shift) */
+  bool first = true, found = false;
 
-  struct timespec tick;
-  tick.tv_sec = 0;
-  tick.tv_nsec = 100;
-
-  /* Getting start time */
-  CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &start_time) == -1),
+  CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &deadline) == -1),
 	       "getting start time failed");
+  deadline.tv_sec += timeout;
 
-  /* Getting the regular expression compiled */
-  int error = regcomp(&regex, pattern, REG_EXTENDED | REG_NOSUB);
-  char * str = &(p->stderr_buffer[p->expect_stderr]);
+  pthread_mutex_lock (&(p->mutex));
 
-  /* Dealing with errors (if any) */
-  if (error != 0)
+  while (!found)
     {
-      char msgbuf[128];
-      regerror(error, &regex, msgbuf, sizeof(msgbuf));
+      bool done = p->done;
+
+      for (int i = 0; (i < 2) && !found; i++)
+	{
+	  int stream = (i == 0) ? RLIMIT_STDOUT : RLIMIT_STDERR;
+	  struct io_stream io;
+	  bool restart = first;
+	  size_t start;
+
+	  if (!(streams & stream))
+	    continue;
+
+	  io_stream (p, (i == 0) ? STDOUT_FILENO : STDERR_FILENO, &io);
+
+	  /* Nothing new since the last scan */
+	  if (!first && (scanned[i] == *(io.length) + *(io.shift)))
+	    continue;
+
+	  start = *(io.expect);
+	  if (first)
+	    ;
+	  else if (m->nodes != NULL)
+	    {
+	      /* The automaton goes on where it stopped (unless the output
+	       * it has not seen yet has been dropped) */
+	      if (scanned[i] >= *(io.shift) + start)
+		start = scanned[i] - *(io.shift);
+	      else
+		restart = true;
+	    }
+	  else if (scanned[i] > *(io.shift) + start + EXPECT_OVERLAP)
+	    /* Scanning the new output (and a bit of the previous one) */
+	    start = scanned[i] - *(io.shift) - EXPECT_OVERLAP;
 
-      CHECK_ERROR(true, msgbuf);
+	  found = expect_scan (p, stream, m, start, restart, match);
+	  scanned[i] = *(io.length) + *(io.shift);
+	}
+
+      first = false;
+
+      /* Everything has been read */
+      if (found || done)
+	break;
+
+      if (pthread_cond_timedwait (&(p->output), &(p->mutex), &deadline) ==
+	  ETIMEDOUT)
+	break;
     }
 
-  /* Main loop: Wait until the pattern appears or the timeout is hit */
-  do
-    {
-      /* Wait a tick */
-      nanosleep (&tick, NULL);
+  pthread_mutex_unlock (&(p->mutex));
+
+fail:
+  return found;
+}
+
+int
+rlimit_expect_any_match (subprocess_t * p, int streams, char **patterns,
+			 int n, int timeout, rlimit_match_t * match)
+{
+  struct expect_matcher m;
+  rlimit_match_t tmp;
+  int index = -1;
+
+  if (match == NULL)
+    match = &tmp;
+
+  CHECK_ERROR ((n < 1), "no pattern to expect");
 
-      if (!p->stderr_buffer)
-	continue;
+  if (expect_matcher_new (&m, patterns, n) == RETURN_SUCCESS)
+    if (expect_wait (p, streams, &m, timeout, match))
+      index = match->index;
 
-      /* Get future expect_stderr (avoiding increase after search) */
-      new_expect_stderr = strlen (p->stderr_buffer);
+  expect_matcher_delete (&m);
 
-      /* Searching for pattern */
-      if (regexec(&regex, str, (size_t) 0, NULL, 0) == 0)
-	{
-	  result = true;
-	  break;
-	}
+fail:
+  return index;
+}
 
-      /* Getting current time */
-      CHECK_ERROR ((clock_gettime (CLOCK_MONOTONIC, &current_time) == -1),
-	       "getting current time failed");
-    }
-  while ((current_time.tv_sec - start_time.tv_sec) < timeout);
+int
+rlimit_expect_any (subprocess_t * p, char **patterns, int n, int timeout)
+{
+  return rlimit_expect_any_match (p, RLIMIT_STDOUT, patterns, n, timeout,
+				  NULL);
+}
 
-  /* Setting expect_stderr to the new value */
-  p->expect_stderr = new_expect_stderr;
+bool
+rlimit_expect_match (subprocess_t * p, int streams, const char *pattern,
+		     int timeout, rlimit_match_t * match)
+{
+  return (rlimit_expect_any_match (p, streams, (char **) &pattern, 1,
+				   timeout, match) == 0);
+}
 
- fail:
-  regfree(&regex);
+bool
+rlimit_expect (subprocess_t * p, char * pattern, int timeout)
+{
+  return rlimit_expect_match (p, RLIMIT_STDOUT | RLIMIT_STDERR, pattern,
+			      timeout, NULL);
+}
 
-  return result;
+bool
+rlimit_expect_stdout (subprocess_t * p, char * pattern, int timeout)
+{
+  return rlimit_expect_match (p, RLIMIT_STDOUT, pattern, timeout, NULL);
+}
+
+bool
+rlimit_expect_stderr (subprocess_t * p, char * pattern, int timeout)
+{
+  return rlimit_expect_match (p, RLIMIT_STDERR, pattern, timeout, NULL);
 }
 
 int
@@ -1069,7 +6572,14 @@ rlimit_subprocess_poll (subprocess_t * p)
 int
 rlimit_subprocess_wait (subprocess_t * p)
 {
-  if (pthread_join (*(p->monitor), NULL) != 0)
+  if (p->supervised)
+    {
+      pthread_mutex_lock (&(p->mutex));
+      while (!p->done)
+	pthread_cond_wait (&(p->terminated), &(p->mutex));
+      pthread_mutex_unlock (&(p->mutex));
+    }
+  else if (pthread_join (*(p->monitor), NULL) != 0)
     perror ("pthread_join to monitor failed");
 
   return p->retval;
@@ -1080,7 +6590,7 @@ rlimit_subprocess_signal (subprocess_t * p, int signal)
 {
   int ret;
 
-  if ((ret = kill (p->pid, signal)) == -1)
+  if ((ret = subprocess_send_signal (p, signal)) == -1)
     rlimit_error ("signal failed");
 
   return ret;
@@ -1091,32 +6601,93 @@ rlimit_subprocess_signal (subprocess_t * p, int signal)
 
 void
 rlimit_set_time_limit (subprocess_t * p, int timeout)
+{
+  rlimit_set_time_limit_ns (p, (timeout > 0) ?
+			    (uint64_t) timeout * 1000000000ULL : 0);
+}
+
+int
+rlimit_get_time_limit (subprocess_t * p)
+{
+  /* Rounded up to the second */
+  return (int) ((rlimit_get_time_limit_ns (p) + 999999999ULL) /
+		1000000000ULL);
+}
+
+void
+rlimit_set_time_limit_ns (subprocess_t * p, uint64_t timeout)
 {
   if (p->limits == NULL)
-    p->limits = limits_new ();
+    p->limits = limits_new (p);
 
   if (p->limits != NULL)
-    p->limits->timeout = timeout;
+    p->limits->timeout_ns = timeout;
   else
     rlimit_error ("setting time limit failed");
 }
 
-int
-rlimit_get_time_limit (subprocess_t * p)
+uint64_t
+rlimit_get_time_limit_ns (subprocess_t * p)
 {
-  int time = 0;
+  uint64_t time = 0;
 
   if (p->limits != NULL)
-    time = p->limits->timeout;
+    time = p->limits->timeout_ns;
 
   return time;
 }
 
+void
+rlimit_set_cpu_time_limit_ns (subprocess_t * p, uint64_t timeout)
+{
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+
+  if (p->limits != NULL)
+    p->limits->cpu_timeout_ns = timeout;
+  else
+    rlimit_error ("setting CPU time limit failed");
+}
+
+uint64_t
+rlimit_get_cpu_time_limit_ns (subprocess_t * p)
+{
+  uint64_t time = 0;
+
+  if (p->limits != NULL)
+    time = p->limits->cpu_timeout_ns;
+
+  return time;
+}
+
+void
+rlimit_set_instruction_limit (subprocess_t * p, uint64_t instructions)
+{
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+
+  if (p->limits != NULL)
+    p->limits->instructions = instructions;
+  else
+    rlimit_error ("setting instruction limit failed");
+}
+
+uint64_t
+rlimit_get_instruction_limit (subprocess_t * p)
+{
+  uint64_t instructions = 0;
+
+  if (p->limits != NULL)
+    instructions = p->limits->instructions;
+
+  return instructions;
+}
+
 void
 rlimit_set_memory_limit (subprocess_t * p, int memory)
 {
   if (p->limits == NULL)
-    p->limits = limits_new ();
+    p->limits = limits_new (p);
 
   if (p->limits != NULL)
     p->limits->memory = memory;
@@ -1139,7 +6710,7 @@ void
 rlimit_set_fsize_limit (subprocess_t * p, int fsize)
 {
   if (p->limits == NULL)
-    p->limits = limits_new ();
+    p->limits = limits_new (p);
 
   if (p->limits != NULL)
     p->limits->fsize = fsize;
@@ -1162,7 +6733,7 @@ void
 rlimit_set_fd_limit (subprocess_t * p, int fd)
 {
   if (p->limits == NULL)
-    p->limits = limits_new ();
+    p->limits = limits_new (p);
 
   if (p->limits != NULL)
     p->limits->fd = fd;
@@ -1185,7 +6756,7 @@ void
 rlimit_set_proc_limit (subprocess_t * p, int proc)
 {
   if (p->limits == NULL)
-    p->limits = limits_new ();
+    p->limits = limits_new (p);
 
   if (p->limits != NULL)
     p->limits->proc = proc;
@@ -1204,25 +6775,226 @@ rlimit_get_proc_limit (subprocess_t * p)
   return proc;
 }
 
+void
+rlimit_set_cpu_bandwidth (subprocess_t * p, int percent)
+{
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+
+  if (p->limits != NULL)
+    p->limits->cpu_bandwidth = percent;
+  else
+    rlimit_error ("setting cpu bandwidth failed");
+}
+
+int
+rlimit_get_cpu_bandwidth (subprocess_t * p)
+{
+  int percent = 0;
+
+  if (p->limits != NULL)
+    percent = p->limits->cpu_bandwidth;
+
+  return percent;
+}
+
+int
+rlimit_set_cpu_list (subprocess_t * p, const char *list)
+{
+  int ret = RETURN_SUCCESS;
+  uint64_t cpus[RLIMIT_CPU_WORDS];
+
+  CHECK_ERROR ((cpu_list_parse (list, cpus, RLIMIT_CPUS) == RETURN_FAILURE),
+	       "setting cpu list failed");
+
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+  CHECK_ERROR ((p->limits == NULL), "limits allocation failed");
+
+  memcpy (p->limits->cpus, cpus, sizeof (cpus));
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+int
+rlimit_get_cpu_list (subprocess_t * p, char *buffer, size_t size)
+{
+  uint64_t none[RLIMIT_CPU_WORDS] = { 0 };
+
+  cpu_list_format ((p->limits != NULL) ? p->limits->cpus : none,
+		   RLIMIT_CPUS, buffer, size);
+
+  return RETURN_SUCCESS;
+}
+
+int
+rlimit_set_memory_policy (subprocess_t * p, int mode, const char *nodes)
+{
+  int ret = RETURN_SUCCESS;
+  uint64_t mask;
+
+  CHECK_ERROR (((mode < MEMPOLICY_DEFAULT) || (mode > MEMPOLICY_INTERLEAVE)),
+	       "invalid memory policy");
+  CHECK_ERROR ((cpu_list_parse (nodes, &mask, RLIMIT_NODES) ==
+		RETURN_FAILURE), "invalid node list");
+  CHECK_ERROR (((mode != MEMPOLICY_DEFAULT) && (mask == 0)),
+	       "memory policy without nodes");
+
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+  CHECK_ERROR ((p->limits == NULL), "limits allocation failed");
+
+  p->limits->mempolicy = mode;
+  p->limits->mem_nodes = (mode != MEMPOLICY_DEFAULT) ? mask : 0;
+
+  if (false)
+  fail:
+    ret = RETURN_FAILURE;
+
+  return ret;
+}
+
+int
+rlimit_get_memory_policy (subprocess_t * p)
+{
+  int mode = MEMPOLICY_DEFAULT;
+
+  if (p->limits != NULL)
+    mode = p->limits->mempolicy;
+
+  return mode;
+}
+
+void
+rlimit_set_exclusive_cpus (subprocess_t * p, int cpus)
+{
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+
+  if (p->limits != NULL)
+    p->limits->exclusive_cpus = cpus;
+  else
+    rlimit_error ("setting exclusive cpus failed");
+}
+
+int
+rlimit_get_exclusive_cpus (subprocess_t * p)
+{
+  int cpus = 0;
+
+  if (p->limits != NULL)
+    cpus = p->limits->exclusive_cpus;
+
+  return cpus;
+}
+
+void
+rlimit_set_sample_interval_ns (subprocess_t * p, uint64_t interval)
+{
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+
+  if (p->limits != NULL)
+    p->limits->sample_interval_ns = interval;
+  else
+    rlimit_error ("setting sample interval failed");
+}
+
+uint64_t
+rlimit_get_sample_interval_ns (subprocess_t * p)
+{
+  uint64_t interval = 0;
+
+  if (p->limits != NULL)
+    interval = p->limits->sample_interval_ns;
+
+  return interval;
+}
+
+void
+rlimit_set_stdout_limit (subprocess_t * p, size_t limit, int policy)
+{
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+
+  if (p->limits != NULL)
+    {
+      p->limits->stdout_limit = limit;
+      p->limits->stdout_capture = policy;
+    }
+  else
+    rlimit_error ("setting stdout limit failed");
+}
+
+size_t
+rlimit_get_stdout_limit (subprocess_t * p)
+{
+  size_t limit = 0;
+
+  if (p->limits != NULL)
+    limit = p->limits->stdout_limit;
+
+  return limit;
+}
+
+void
+rlimit_set_stderr_limit (subprocess_t * p, size_t limit, int policy)
+{
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+
+  if (p->limits != NULL)
+    {
+      p->limits->stderr_limit = limit;
+      p->limits->stderr_capture = policy;
+    }
+  else
+    rlimit_error ("setting stderr limit failed");
+}
+
+size_t
+rlimit_get_stderr_limit (subprocess_t * p)
+{
+  size_t limit = 0;
+
+  if (p->limits != NULL)
+    limit = p->limits->stderr_limit;
+
+  return limit;
+}
+
 void
 rlimit_disable_syscall (subprocess_t * p, int syscall)
 {
   if (p->limits == NULL)
-    p->limits = limits_new ();
+    p->limits = limits_new (p);
 
   if (p->limits != NULL)
     {
-      p->limits->syscalls[0] += 1;
-      p->limits->syscalls = realloc (p->limits->syscalls,
-				     (p->limits->syscalls[0] + 1)
-				     * sizeof p->limits->syscalls[0]);
+      rlimit_policy_t *policy = p->limits->policy;
 
-      /* Check if realloc failed or not */
-      if (p->limits->syscalls == NULL)
+      /* Shared or compiled policies are never modified (copy-on-write) */
+      if (policy == NULL)
+	policy = rlimit_policy_new ();
+      else if (policy->compiled || (policy->refcount > 1))
+	policy = policy_copy (policy);
+
+      if (policy == NULL)
 	goto fail;
 
+      if (policy != p->limits->policy)
+	{
+	  rlimit_policy_unref (p->limits->policy);
+	  p->limits->policy = policy;
+	}
+
       /* Adding the syscall to the list */
-      p->limits->syscalls[(p->limits->syscalls[0])] = syscall;
+      if (rlimit_policy_deny_syscall (policy, syscall) == RETURN_FAILURE)
+	goto fail;
     }
   else
     {
@@ -1236,34 +7008,146 @@ rlimit_get_disabled_syscalls (subprocess_t * p)
 {
   int *syscalls = NULL;
 
-  if (p->limits != NULL)
-    syscalls = p->limits->syscalls;
+  if ((p->limits != NULL) && (p->limits->policy != NULL))
+    syscalls = p->limits->policy->syscalls;
 
   return syscalls;
 }
 
+void
+rlimit_set_syscall_policy (subprocess_t * p, rlimit_policy_t * policy)
+{
+  if (p->limits == NULL)
+    p->limits = limits_new (p);
+
+  if (p->limits != NULL)
+    {
+      rlimit_policy_ref (policy);
+      rlimit_policy_unref (p->limits->policy);
+      p->limits->policy = policy;
+    }
+  else
+    rlimit_error ("setting syscall policy failed");
+}
+
+rlimit_policy_t *
+rlimit_get_syscall_policy (subprocess_t * p)
+{
+  rlimit_policy_t *policy = NULL;
+
+  if (p->limits != NULL)
+    policy = p->limits->policy;
+
+  return policy;
+}
+
 
 /***** Profile information *****/
 time_t
-rlimit_get_real_time (subprocess_t * p)
+rlimit_get_real_time_profile (subprocess_t * p)
 {
   return p->real_time_usec;
 }
 
 time_t
-rlimit_get_user_time (subprocess_t * p)
+rlimit_get_user_time_profile (subprocess_t * p)
 {
   return p->user_time_usec;
 }
 
 time_t
-rlimit_get_sys_time (subprocess_t * p)
+rlimit_get_sys_time_profile (subprocess_t * p)
 {
   return p->sys_time_usec;
 }
 
 size_t
-rlimit_get_memory (subprocess_t * p)
+rlimit_get_memory_profile (subprocess_t * p)
 {
   return p->memory_kbytes;
 }
+
+uint64_t
+rlimit_get_instructions_profile (subprocess_t * p)
+{
+  return p->instructions;
+}
+
+/* Former names of the profile getters (still exported) */
+time_t
+rlimit_get_real_time (subprocess_t * p)
+{
+  return rlimit_get_real_time_profile (p);
+}
+
+time_t
+rlimit_get_user_time (subprocess_t * p)
+{
+  return rlimit_get_user_time_profile (p);
+}
+
+time_t
+rlimit_get_sys_time (subprocess_t * p)
+{
+  return rlimit_get_sys_time_profile (p);
+}
+
+size_t
+rlimit_get_memory (subprocess_t * p)
+{
+  return rlimit_get_memory_profile (p);
+}
+
+const rlimit_sample_t *
+rlimit_get_samples (subprocess_t * p, size_t *count)
+{
+  *count = (p->timeline != NULL) ? p->timeline->count : 0;
+
+  return (p->timeline != NULL) ? p->timeline->samples : NULL;
+}
+
+const rlimit_perf_t *
+rlimit_get_perf_profile (subprocess_t * p)
+{
+  return (perf_needed (p)) ? &(p->perf) : NULL;
+}
+
+const rlimit_syscall_stat_t *
+rlimit_get_syscall_stats (subprocess_t * p)
+{
+  return p->syscall_stats;
+}
+
+int
+rlimit_get_syscall_top (subprocess_t * p, rlimit_syscall_stat_t * top, int n)
+{
+  int count = 0;
+
+  if (p->syscall_stats == NULL)
+    return 0;
+
+  /* Insertion in the (small) sorted array of the hottest ones */
+  for (int i = 0; i < RLIMIT_SYSCALLS; i++)
+    {
+      rlimit_syscall_stat_t *stat = &(p->syscall_stats[i]);
+      int j;
+
+      if (stat->count == 0)
+	continue;
+
+      for (j = count; (j > 0) && ((top[j - 1].total_ns < stat->total_ns) ||
+				  ((top[j - 1].total_ns == stat->total_ns) &&
+				   (top[j - 1].count < stat->count))); j--)
+	if (j < n)
+	  top[j] = top[j - 1];
+
+      if (j < n)
+	{
+	  top[j] = *stat;
+	  if (count < n)
+	    count++;
+	}
+    }
+
+  return count;
+}
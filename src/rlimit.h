@@ -35,6 +35,7 @@
 #define RLIMIT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -59,19 +60,134 @@
 #define FDEXCEED      10	/* Number of file descriptors exceeded */
 #define PROCEXCEED    11	/* Number of processes exceeded */
 #define DENIEDSYSCALL 12	/* Use of forbidden syscall */
+#define OUTPUTEXCEED  13	/* Output capture limit exceeded */
+#define CPUTIMEOUT    14	/* CPU time limit exceeded */
+#define INSTREXCEED   15	/* Instruction limit exceeded */
+
+/* Output capture policies */
+#define CAPTURE_ALL      0	/* Keep the whole output (unbounded) */
+#define CAPTURE_HEAD     1	/* Keep the first bytes */
+#define CAPTURE_TAIL     2	/* Keep the last bytes */
+#define CAPTURE_HEADTAIL 3	/* Keep the first and the last bytes */
+#define CAPTURE_KILL     4	/* Flag: kill the subprocess on overflow */
+
+/* Set of forbidden syscalls that can be shared among subprocesses */
+typedef struct rlimit_policy rlimit_policy_t;
+
+/* Program stopped at a snapshot point and forked for each subprocess */
+typedef struct rlimit_forkserver rlimit_forkserver_t;
+
+/* Snapshot points of a fork server */
+#define SNAPSHOT_STDIN   0	/* First read on stdin */
+#define SNAPSHOT_SIGSTOP 1	/* SIGSTOP raised by the program itself */
+
+/* Pool of workers running subprocesses */
+typedef struct rlimit_batch rlimit_batch_t;
+
+/* Values returned by the output callbacks */
+#define RLIMIT_CONTINUE 0	/* Keep reading the output */
+#define RLIMIT_PAUSE    1	/* Stop reading until rlimit_resume_output() */
+
+struct subprocess;
+
+/* Callback receiving the output of a subprocess chunk by chunk */
+typedef int (*rlimit_output_cb) (struct subprocess * p, const char *chunk,
+				 size_t length, void *data);
+
+/* Streams watched by expect */
+#define RLIMIT_STDOUT 1
+#define RLIMIT_STDERR 2
+
+/* Maximum number of groups reported by expect (whole match included) */
+#define RLIMIT_MATCH_GROUPS 10
+
+/* Match found by expect: offsets of the match ([0]) and of its groups
+ * in the output buffer of the stream ('-1' for unmatched groups) */
+typedef struct rlimit_match
+{
+  int stream;			/* Stream matched (RLIMIT_STDOUT/STDERR) */
+  int index;			/* Index of the pattern matched */
+  ssize_t start[RLIMIT_MATCH_GROUPS];	/* Start of the groups */
+  ssize_t end[RLIMIT_MATCH_GROUPS];	/* End of the groups */
+} rlimit_match_t;
+
+/* Counters of the perf profile (see: rlimit_get_perf_profile()) */
+#define RLIMIT_PERF_INSTRUCTIONS     0	/* Instructions (user-space) */
+#define RLIMIT_PERF_CYCLES           1	/* CPU cycles (user-space) */
+#define RLIMIT_PERF_CACHE_REFERENCES 2	/* Cache accesses */
+#define RLIMIT_PERF_CACHE_MISSES     3	/* Cache misses */
+#define RLIMIT_PERF_BRANCH_MISSES    4	/* Branches mispredicted */
+#define RLIMIT_PERF_CONTEXT_SWITCHES 5	/* Context switches (software) */
+#define RLIMIT_PERF_PAGE_FAULTS      6	/* Page faults (software) */
+#define RLIMIT_PERF_COUNTERS         7
+
+/* Perf counters of a subprocess and of its descendants */
+typedef struct rlimit_perf
+{
+  uint64_t counters[RLIMIT_PERF_COUNTERS];	/* Counts (RLIMIT_PERF_*) */
+  unsigned int available;	/* Counters read (bit 'i' for counters[i]) */
+} rlimit_perf_t;
+
+/* Syscall numbers profiled (see: rlimit_get_syscall_stats()) */
+#define RLIMIT_SYSCALLS 512
+
+/* Statistics of a syscall of a subprocess */
+typedef struct rlimit_syscall_stat
+{
+  int syscall;			/* Syscall number */
+  uint64_t count;		/* Number of calls */
+  uint64_t total_ns;		/* Time from the entries to the exits */
+  uint64_t max_ns;		/* Longest call */
+} rlimit_syscall_stat_t;
+
+/* CPUs and NUMA nodes a subprocess can be placed on */
+#define RLIMIT_CPUS  1024
+#define RLIMIT_NODES 64
+#define RLIMIT_CPU_WORDS (RLIMIT_CPUS / 64)
+
+/* Memory policies (see: set_mempolicy(2)) */
+#define MEMPOLICY_DEFAULT    0	/* Policy of the caller */
+#define MEMPOLICY_PREFERRED  1	/* Preferably on the (first) node */
+#define MEMPOLICY_BIND       2	/* Only on the nodes */
+#define MEMPOLICY_INTERLEAVE 3	/* Interleaved over the nodes */
+
+/* Maximum number of samples kept in the resource timeline */
+#define RLIMIT_SAMPLES 256
+
+/* Resources used by a subprocess at some point of its run */
+typedef struct rlimit_sample
+{
+  time_t time_usec;		/* Date since the start (in micro-seconds) */
+  time_t cpu_usec;		/* User and system time used so far */
+  size_t rss_kbytes;		/* Resident memory (in kilo-bytes) */
+  int threads;			/* Number of threads */
+  int fds;			/* Number of open file descriptors */
+} rlimit_sample_t;
 
 /* Limit over the subprocess */
 typedef struct limits
 {
-  int timeout;			/* Timeout (in seconds) */
+  uint64_t timeout_ns;		/* Timeout (in nano-seconds) */
+  uint64_t cpu_timeout_ns;	/* CPU time limit (in nano-seconds) */
+  uint64_t instructions;	/* Maximum user-space instructions retired */
   int memory;			/* Maximum memory size (in bytes) */
   int fsize;			/* Maximum file size (in bytes) */
   int fd;			/* Maximum number of open file descriptor */
   int proc;			/* Maximum number of processes */
-  int *syscalls;		/* Forbiden syscalls (syscalls[0] is
-				   the number of forbiden syscalls and
-				   syscalls[i] (i>0) are the ids' of
-				   the forbiden syscalls). */
+  rlimit_policy_t *policy;	/* Forbiden syscalls (shared, replaces
+				   'int *syscalls', see:
+				   rlimit_get_disabled_syscalls()) */
+  size_t stdout_limit;		/* Maximum stdout captured (in bytes) */
+  int stdout_capture;		/* Capture policy of stdout (CAPTURE_*) */
+  size_t stderr_limit;		/* Maximum stderr captured (in bytes) */
+  int stderr_capture;		/* Capture policy of stderr (CAPTURE_*) */
+  int cpu_bandwidth;		/* Share of one CPU (in percent, cgroup) */
+  int cgroup_limits;		/* Limits enforced by the cgroup (private) */
+  uint64_t sample_interval_ns;	/* Interval between samples ('0' if none) */
+  uint64_t cpus[RLIMIT_CPU_WORDS];	/* CPUs allowed (any if none) */
+  int mempolicy;		/* Memory policy (MEMPOLICY_*) */
+  uint64_t mem_nodes;		/* NUMA nodes of the memory policy */
+  int exclusive_cpus;		/* CPUs to get from the placement */
 } limits_t;
 
 typedef struct subprocess
@@ -88,7 +204,7 @@ typedef struct subprocess
   FILE *stdout;			/* Subprocess stdout handler */
   FILE *stderr;			/* Subprocess stderr handler */
 
-  char *stdin_buffer;		/* Buffer storing stdin input */
+  char *stdin_buffer;		/* Unused (stdin input is queued) */
   char *stdout_buffer;		/* Buffer storing stdout output */
   char *stderr_buffer;		/* Buffer storing stderr output */
 
@@ -103,16 +219,71 @@ typedef struct subprocess
   int expect_stdout;            /* Position of the expect cursor in stdout */
   int expect_stderr;            /* Position of the expect cursor in stderr */
   pthread_t *monitor;		/* Reference to the monitor thread */
-  pthread_mutex_t write_mutex;	/* Mutex locking the writing on stdin */
+  pthread_mutex_t write_mutex;	/* Mutex locking the stdin queue */
+
+  size_t stdout_size;		/* Allocated size of stdout_buffer */
+  size_t stdout_length;		/* Length of the output in stdout_buffer */
+  size_t stderr_size;		/* Allocated size of stderr_buffer */
+  size_t stderr_length;		/* Length of the output in stderr_buffer */
+  struct io_chunk *stdin_head;	/* Chunks queued to be written on stdin */
+  struct io_chunk *stdin_tail;	/* Last chunk queued */
+  pthread_cond_t stdin_flushed;	/* Signaled when the queue gets empty */
+  bool stdin_closed;		/* Nothing can be written anymore */
+  bool stdin_lost;		/* Queued chunks have been dropped */
+  int stdin_file;		/* File read as stdin ('-1' if none) */
+  char *stdin_path;		/* Path of the file read as stdin */
+  size_t stdout_dropped;	/* Bytes of stdout dropped by the limit */
+  size_t stderr_dropped;	/* Bytes of stderr dropped by the limit */
+  size_t stdout_shift;		/* Bytes moved out of stdout_buffer */
+  size_t stderr_shift;		/* Bytes moved out of stderr_buffer */
+  bool file_capture;		/* Output captured in files (mapped) */
+
+  rlimit_output_cb stdout_callback;	/* Consumer of stdout (if any) */
+  void *stdout_data;		/* Data given to stdout_callback */
+  rlimit_output_cb stderr_callback;	/* Consumer of stderr (if any) */
+  void *stderr_data;		/* Data given to stderr_callback */
+  bool stdout_paused;		/* Reading stdout is paused */
+  bool stderr_paused;		/* Reading stderr is paused */
+  unsigned int resumes;		/* Number of calls to resume the output */
+  int io_wake[2];		/* Pipe waking up the io_monitor */
+
+  int pidfd;			/* Process file descriptor ('-1' if none) */
+  bool arena_owned;		/* Memory of the subprocess is freed with it */
+  rlimit_forkserver_t *forkserver;	/* Forked from this server (if any) */
+  char *cgroup;			/* Path of its cgroup (NULL if none) */
+  int cgroup_fd;		/* Directory of its cgroup ('-1' if none) */
+  struct timeline *timeline;	/* Resources sampled (NULL if none) */
+  bool perf_counters;		/* Perf counters attached to the run */
+  int perf_fds[RLIMIT_PERF_COUNTERS];	/* Counters ('-1' if unavailable) */
+  rlimit_perf_t perf;		/* Counts read once reaped */
+  uint64_t instructions;	/* Instructions retired ('0' if not counted) */
+  rlimit_syscall_stat_t *syscall_stats;	/* Syscall profile (NULL if off) */
+  bool cpus_held;		/* Exclusive CPUs taken from the placement */
+
+  bool supervised;		/* Run by the supervisor engine */
+  struct supervision *supervision;	/* Supervisor handle (while running) */
+  pthread_mutex_t mutex;	/* Mutex protecting the supervision end */
+  pthread_cond_t terminated;	/* Signaled when the supervision is over */
+  pthread_cond_t output;	/* Signaled when output has been read */
+  bool done;			/* Supervision of the subprocess is over */
 } subprocess_t;
 
 /* Handling subprocesses */
 /* ********************* */
 
-/* Create/delete a subprocess */
+/* Create/delete a subprocess. The subprocess, its limits, argv and
+ * envp are stored in a single block of memory (freed at once). */
 subprocess_t *rlimit_subprocess_create (int argc, char **argv, char **envp);
 void rlimit_subprocess_delete (subprocess_t * p);
 
+/* Create a subprocess in 'memory' provided by the caller (e.g. taken
+ * from a pool), of at least rlimit_subprocess_size() bytes and aligned
+ * as for malloc(). The memory is not freed by rlimit_subprocess_delete()
+ * and can be reused once the subprocess is deleted. */
+size_t rlimit_subprocess_size (int argc, char **argv, char **envp);
+subprocess_t *rlimit_subprocess_create_at (void *memory, int argc,
+					   char **argv, char **envp);
+
 #ifdef DEBUG
 /* Display a subprocess for debug */
 void rlimit_subprocess_print (subprocess_t * p);
@@ -126,15 +297,106 @@ int rlimit_subprocess_suspend (subprocess_t * p);
 int rlimit_subprocess_resume (subprocess_t * p);
 
 /* Handling input/output to a subprocess */
+
+/* Queue 'length' bytes of 'data' (copied) to be written on stdin as
+ * soon as the pipe is writable, without waiting.
+ * Returns '0' if everything went fine, '-1' otherwise. */
+int rlimit_queue_stdin (subprocess_t * p, const void *data, size_t length);
+
+/* Wait until the queued input has been written (or the subprocess is
+ * over). Returns '0' if it has all been written, '-1' otherwise. */
+int rlimit_flush_stdin (subprocess_t * p);
+
+/* Queue 'msg' on stdin and flush it */
 void rlimit_write_stdin (subprocess_t * p, char * msg);
+
+/* Read stdin straight from a file (to be set before running the
+ * subprocess), either an open file descriptor (still owned by the
+ * caller, it must stay open until the subprocess is started) or a
+ * path. Each subprocess opens the file anew and reads it from the
+ * beginning with its own offset, so a single descriptor can feed any
+ * number of concurrent runs. Nothing can be queued on stdin then.
+ * Returns '0' if everything went fine, '-1' otherwise. */
+int rlimit_set_stdin_fd (subprocess_t * p, int fd);
+int rlimit_set_stdin_path (subprocess_t * p, const char *path);
+
+/* Create a sealed (immutable) anonymous file holding 'length' bytes of
+ * 'data', to be shared as stdin (see: rlimit_set_stdin_fd()).
+ * Returns the file descriptor ('-1' on error), closed by the caller. */
+int rlimit_input_new (const void *data, size_t length);
 char *rlimit_read_stdout (subprocess_t * p);
 char *rlimit_read_stderr (subprocess_t * p);
 
-/* Look for 'pattern' in recent output of the subprocess (see: regex.h) */
+/* Capture the output straight into anonymous files (memfd) instead
+ * of pipes (to be set before running the subprocess). The output is
+ * then mapped read-only in stdout_buffer/stderr_buffer once the
+ * subprocess is over, without any copy. It is not available while
+ * the subprocess runs (no expect) and the capture limits do not apply
+ * (the file size limit does). */
+void rlimit_set_file_capture (subprocess_t * p, bool enable);
+
+/* Profile the syscalls of the subprocess (to be set before running
+ * it). The subprocess then runs under the ptrace tracer, which stops
+ * it at each entry and exit of a syscall (much slower), it is not
+ * supervised by the engine nor forked by a fork server. Subprocesses
+ * not profiled pay nothing. See: rlimit_get_syscall_stats() */
+void rlimit_set_syscall_profile (subprocess_t * p, bool enable);
+
+/* Count instructions, cycles, cache and branch misses, context
+ * switches and page faults of the subprocess and of its descendants
+ * with perf_event_open() (to be set before running the subprocess).
+ * The counters missing on the host (e.g. hardware ones without PMU)
+ * are left out. The subprocess is then not forked by the spawn helper.
+ * See: rlimit_get_perf_profile() */
+void rlimit_set_perf_counters (subprocess_t * p, bool enable);
+
+/* Get the captured output and its length (binary-safe view, valid
+ * until the subprocess is deleted) */
+const char *rlimit_get_stdout_view (subprocess_t * p, size_t * length);
+const char *rlimit_get_stderr_view (subprocess_t * p, size_t * length);
+
+/* Stream the output to 'callback' as it is read instead of storing it
+ * into stdout_buffer/stderr_buffer (to be set before running the
+ * subprocess). When the callback returns RLIMIT_PAUSE, the pipe is not
+ * read anymore (and the subprocess blocks when it is full) until
+ * rlimit_resume_output() is called. The output left once the
+ * subprocess is over is delivered at once. */
+void rlimit_set_stdout_callback (subprocess_t * p, rlimit_output_cb callback,
+				 void *data);
+void rlimit_set_stderr_callback (subprocess_t * p, rlimit_output_cb callback,
+				 void *data);
+void rlimit_resume_output (subprocess_t * p);
+
+/* Number of output bytes dropped by the capture limits */
+size_t rlimit_get_stdout_dropped (subprocess_t * p);
+size_t rlimit_get_stderr_dropped (subprocess_t * p);
+
+/* Look for 'pattern' in recent output of the subprocess (see: regex.h)
+ * and wait for it at most 'timeout' seconds. The search starts at the
+ * expect cursor of the stream, which is moved after the match. */
 bool rlimit_expect (subprocess_t * p, char * pattern, int timeout);
 bool rlimit_expect_stdout (subprocess_t * p, char * pattern, int timeout);
 bool rlimit_expect_stderr (subprocess_t * p, char * pattern, int timeout);
 
+/* Same on the 'streams' (RLIMIT_STDOUT and/or RLIMIT_STDERR), filling
+ * 'match' (if not NULL) with the position of the match and its groups.
+ * Compiled patterns are cached. Only the new output is scanned while
+ * waiting (with an overlap of 4 KiB, longer matches spanning two reads
+ * may be missed). */
+bool rlimit_expect_match (subprocess_t * p, int streams, const char *pattern,
+			  int timeout, rlimit_match_t * match);
+
+/* Wait for any of the 'n' patterns on stdout, scanning the output once
+ * for all of them: literals go through an Aho-Corasick automaton and
+ * regular expressions are combined into one. Either way, the match
+ * starting first in the output read so far wins (the longest one on
+ * ties, as in POSIX). Returns the
+ * index of the pattern matched ('-1' if none matched in time), which is
+ * also set in 'match->index' with the groups of that pattern. */
+int rlimit_expect_any (subprocess_t * p, char **patterns, int n, int timeout);
+int rlimit_expect_any_match (subprocess_t * p, int streams, char **patterns,
+			     int n, int timeout, rlimit_match_t * match);
+
 /* Check if the subprocess is terminated ('1' if terminated, '0' otherwise). */
 int rlimit_subprocess_poll (subprocess_t * p);
 
@@ -144,6 +406,154 @@ int rlimit_subprocess_wait (subprocess_t * p);
 /* Send a signal to the subprocess */
 int rlimit_subprocess_signal (subprocess_t * p, int signal);
 
+/* Supervisor engine */
+/* ***************** */
+
+/* Start/stop the supervisor engine. Once started, the subprocesses
+ * are run by a fixed pool of 'threads' threads (instead of three
+ * threads per subprocess). Stopping waits for the supervised
+ * subprocesses to terminate. Subprocesses that need the ptrace
+ * syscall tracer are still run by their own threads.
+ * Returns '0' if everything went fine, '-1' otherwise. */
+int rlimit_supervisor_start (int threads);
+void rlimit_supervisor_stop (void);
+
+/* Spawn helper */
+/* ************ */
+
+/* Start/stop the spawn helper: a small process forked at once which
+ * then forks the subprocesses on request, so that spawning does not
+ * get slower as the caller grows (page tables copied by fork()). It
+ * should be started early, before the caller gets large or starts
+ * threads. The subprocesses remain children of the caller.
+ * Subprocesses that need the ptrace syscall tracer are still forked by
+ * the caller. Returns '0' if everything went fine, '-1' otherwise. */
+int rlimit_spawn_helper_start (void);
+void rlimit_spawn_helper_stop (void);
+
+/* Cgroup backend */
+/* ************** */
+
+/* Start/stop running each subprocess in a cgroup (v2) of its own,
+ * created under the 'parent' cgroup (which must be writable and hold
+ * no process). The memory and processes limits are then enforced by
+ * the memory and pids controllers (rlimits are kept for the
+ * controllers 'parent' cannot provide), the cpu bandwidth by the cpu
+ * controller, and the profile covers the whole process tree (cpu.stat
+ * and memory.peak). Whatever is left of the tree is killed when the
+ * subprocess terminates. Returns '0' if everything went fine, '-1'
+ * otherwise. */
+int rlimit_cgroup_start (const char *parent);
+void rlimit_cgroup_stop (void);
+
+/* CPU placement */
+/* ************* */
+
+/* Start/stop handing out exclusive CPUs to the subprocesses. The CPUs
+ * of 'reserved' (a CPU list such as "0-1,8", or NULL) are kept for the
+ * threads of the library (monitors, supervisor engine, batch workers,
+ * timers) started from then on; the other CPUs the caller may run on
+ * form the pool. A subprocess asking for exclusive CPUs waits for them
+ * when it is run, gets them on a single NUMA node if possible (its
+ * memory then bound to that node unless it has a memory policy) and
+ * gives them back once it is over. The other subprocesses run on the
+ * whole pool. Returns '0' if everything went fine, '-1' otherwise. */
+int rlimit_placement_start (const char *reserved);
+void rlimit_placement_stop (void);
+
+/* Fork server */
+/* *********** */
+
+/* Start the command line of 'p' once (without limits, its output
+ * discarded) and stop it at the 'snapshot' point (SNAPSHOT_*). The
+ * subprocesses created by the server are then forked from the stopped
+ * program instead of being started anew, only the thread reaching the
+ * snapshot being copied. They get the limits and the syscall policy of
+ * 'p' by default (policies need seccomp). Only available on x86-64.
+ * Returns NULL on failure (e.g. the program ended before its snapshot). */
+rlimit_forkserver_t *rlimit_forkserver_new (subprocess_t * p, int snapshot);
+
+/* Create a subprocess forked from the snapshot when run (its limits,
+ * stdin and output are set as for any other subprocess) */
+subprocess_t *rlimit_forkserver_create (rlimit_forkserver_t * fs);
+
+/* Kill the program of the server (the subprocesses of the server must
+ * have been run before) */
+void rlimit_forkserver_delete (rlimit_forkserver_t * fs);
+
+/* Batch runner */
+/* ************ */
+
+/* Create a batch running at most 'concurrency' subprocesses at once
+ * (the number of online CPUs if '0'), one worker thread each. Idle
+ * workers steal the subprocesses queued for busy ones. */
+rlimit_batch_t *rlimit_batch_new (int concurrency);
+
+/* Hand a subprocess (not started, with its limits and stdin source
+ * set) over to the batch until it is returned by rlimit_batch_next().
+ * Returns '0' if everything went fine, '-1' otherwise. */
+int rlimit_batch_submit (rlimit_batch_t * b, subprocess_t * p);
+
+/* Wait for a subprocess of the batch to terminate and return it (in
+ * completion order), to be deleted by the caller. Returns NULL once
+ * every subprocess submitted has been returned. */
+subprocess_t *rlimit_batch_next (rlimit_batch_t * b);
+
+/* Wait for the subprocesses left (deleting them) and free the batch */
+void rlimit_batch_delete (rlimit_batch_t * b);
+
+/* Repeated runs */
+/* ************* */
+
+/* Statistics of a measure over the runs kept */
+typedef struct rlimit_stats
+{
+  double min;
+  double median;
+  double mean;
+  double stddev;		/* Sample standard deviation */
+  double p95;			/* 95th percentile (nearest rank) */
+} rlimit_stats_t;
+
+/* Options of repeated runs */
+typedef struct rlimit_repeat_opts
+{
+  int warmup;			/* Runs done first and not measured */
+  int min_runs;			/* Runs measured before checking the target */
+  int max_runs;			/* Runs measured at most */
+  double ci_target;		/* Relative half-width of the 95% confidence
+				   interval of the mean real time to reach
+				   ('0' to always measure max_runs runs) */
+  bool keep_outliers;		/* Do not discard the outliers */
+} rlimit_repeat_opts_t;
+
+/* Outcome of repeated runs */
+typedef struct rlimit_repeat
+{
+  int runs;			/* Runs measured (warmup excluded) */
+  int kept;			/* Runs left once the outliers discarded */
+  int status;			/* Status of the last run */
+  bool converged;		/* Target met before max_runs */
+  double ci;			/* Relative half-width reached */
+  rlimit_stats_t real_usec;
+  rlimit_stats_t user_usec;
+  rlimit_stats_t sys_usec;
+  rlimit_stats_t memory_kbytes;
+} rlimit_repeat_t;
+
+/* Run copies of 'p' (not started: its command line, limits and stdin
+ * source are used) one after the other, 'warmup' times and then until
+ * the confidence interval of the mean real time is narrow enough or
+ * 'max_runs' runs are measured. The runs whose real time lies out of
+ * the Tukey fences (1.5 inter-quartile range away from the quartiles)
+ * are discarded from the statistics. With 'opts' NULL, 1 warmup run
+ * and 5 to 30 runs are done for a 2% target. Repeating stops at the
+ * first run that does not terminate normally. Returns '0' if every run
+ * terminated normally, '-1' otherwise. */
+int rlimit_subprocess_repeat (subprocess_t * p,
+			      const rlimit_repeat_opts_t * opts,
+			      rlimit_repeat_t * result);
+
 /* Setting/getting the subprocess limitation (default: 0 (unlimited)) */
 /* ****************************************************************** */
 
@@ -151,6 +561,27 @@ int rlimit_subprocess_signal (subprocess_t * p, int signal);
 void rlimit_set_time_limit (subprocess_t * p, int timeout);
 int rlimit_get_time_limit (subprocess_t * p);
 
+/* Set/get the timeout (in nano-seconds, rounded up to milliseconds) */
+void rlimit_set_time_limit_ns (subprocess_t * p, uint64_t timeout);
+uint64_t rlimit_get_time_limit_ns (subprocess_t * p);
+
+/* Set/get the CPU time (user and system) the subprocess may use (in
+ * nano-seconds, checked every millisecond at best). It ends with
+ * CPUTIMEOUT, the wall-clock timeout being kept apart. RLIMIT_CPU is
+ * set as well, rounded up to the next second. */
+void rlimit_set_cpu_time_limit_ns (subprocess_t * p, uint64_t timeout);
+uint64_t rlimit_get_cpu_time_limit_ns (subprocess_t * p);
+
+/* Set/get the number of user-space instructions the subprocess and
+ * its descendants may retire. It ends with INSTREXCEED, whatever the
+ * load of the host. The subprocess is killed (overflow signal) as
+ * soon as one process of its tree reaches the limit, the count of the
+ * whole tree being checked at exit. Needs the hardware instructions
+ * counter (not enforced, with a warning, otherwise). The count is in
+ * the perf profile (see: rlimit_get_perf_profile()). */
+void rlimit_set_instruction_limit (subprocess_t * p, uint64_t instructions);
+uint64_t rlimit_get_instruction_limit (subprocess_t * p);
+
 /* Set/get the maximum memory consumption (in bytes) */
 void rlimit_set_memory_limit (subprocess_t * p, int memory);
 int rlimit_get_memory_limit (subprocess_t * p);
@@ -167,10 +598,74 @@ int rlimit_get_fd_limit (subprocess_t * p);
 void rlimit_set_proc_limit (subprocess_t * p, int proc);
 int rlimit_get_proc_limit (subprocess_t * p);
 
-/* Disable specific syscalls */
+/* Set/get the share of one CPU the subprocess may use (in percent,
+ * over 100 for several CPUs). Only enforced by the cgroup backend. */
+void rlimit_set_cpu_bandwidth (subprocess_t * p, int percent);
+int rlimit_get_cpu_bandwidth (subprocess_t * p);
+
+/* Set/get the CPUs the subprocess may run on, as a CPU list such as
+ * "0-3,8" (NULL or "" for any CPU). The list is written in 'buffer'
+ * (truncated to 'size' bytes). Returns '0' if everything went fine,
+ * '-1' otherwise. */
+int rlimit_set_cpu_list (subprocess_t * p, const char *list);
+int rlimit_get_cpu_list (subprocess_t * p, char *buffer, size_t size);
+
+/* Set/get the memory policy of the subprocess (MEMPOLICY_*) over the
+ * NUMA nodes of 'nodes' (a node list such as "0,2", NULL for
+ * MEMPOLICY_DEFAULT). Not available with a fork server. Returns '0' if
+ * everything went fine, '-1' otherwise. */
+int rlimit_set_memory_policy (subprocess_t * p, int mode, const char *nodes);
+int rlimit_get_memory_policy (subprocess_t * p);
+
+/* Set/get the number of CPUs the subprocess gets for itself from the
+ * placement (see: rlimit_placement_start()), replacing its CPU list */
+void rlimit_set_exclusive_cpus (subprocess_t * p, int cpus);
+int rlimit_get_exclusive_cpus (subprocess_t * p);
+
+/* Set/get the interval between two samples of the resources used by
+ * the subprocess (in nano-seconds, rounded up to milliseconds, '0' not
+ * to sample). See: rlimit_get_samples() */
+void rlimit_set_sample_interval_ns (subprocess_t * p, uint64_t interval);
+uint64_t rlimit_get_sample_interval_ns (subprocess_t * p);
+
+/* Set/get the maximum output captured (in bytes) and how it is kept
+ * (CAPTURE_HEAD, CAPTURE_TAIL or CAPTURE_HEADTAIL, possibly or'ed with
+ * CAPTURE_KILL to end the subprocess with OUTPUTEXCEED on overflow) */
+void rlimit_set_stdout_limit (subprocess_t * p, size_t limit, int policy);
+size_t rlimit_get_stdout_limit (subprocess_t * p);
+void rlimit_set_stderr_limit (subprocess_t * p, size_t limit, int policy);
+size_t rlimit_get_stderr_limit (subprocess_t * p);
+
+/* Disable specific syscalls (the returned array stores the number of
+ * forbiden syscalls in [0] and their ids' in [i] (i>0)) */
 void rlimit_disable_syscall (subprocess_t * p, int syscall);
 int *rlimit_get_disabled_syscalls (subprocess_t * p);
 
+/* Set/get a syscall policy shared with other subprocesses (a reference
+ * is taken on the policy, it is compiled at the first run) */
+void rlimit_set_syscall_policy (subprocess_t * p, rlimit_policy_t * policy);
+rlimit_policy_t *rlimit_get_syscall_policy (subprocess_t * p);
+
+/* Syscall policies */
+/* **************** */
+
+/* Create a new (empty) policy, owned by the caller */
+rlimit_policy_t *rlimit_policy_new (void);
+
+/* Take/release a reference on the policy (freed with the last one) */
+rlimit_policy_t *rlimit_policy_ref (rlimit_policy_t * policy);
+void rlimit_policy_unref (rlimit_policy_t * policy);
+
+/* Forbid a syscall (returns '-1' if the policy is already compiled) */
+int rlimit_policy_deny_syscall (rlimit_policy_t * policy, int syscall);
+
+/* Freeze the policy and precompile its filter program.
+ * Returns '0' if everything went fine, '-1' otherwise. */
+int rlimit_policy_compile (rlimit_policy_t * policy);
+
+/* Check if a syscall is forbidden by the policy (O(1)) */
+bool rlimit_policy_is_denied (rlimit_policy_t * policy, int syscall);
+
 /* Getting subprocess profiling information */
 /* **************************************** */
 /* Time spend in total by the process (idle time included) */
@@ -180,7 +675,38 @@ time_t rlimit_get_user_time_profile (subprocess_t * p);
 /* Time spend in kernel-land by the subprocess and its childs */
 time_t rlimit_get_sys_time_profile (subprocess_t * p);
 
+/* Syscall profile of the subprocess (NULL if not profiled), indexed
+ * by syscall number (RLIMIT_SYSCALLS entries). Times are seen from the
+ * tracer, its own stops included. */
+const rlimit_syscall_stat_t *rlimit_get_syscall_stats (subprocess_t * p);
+
+/* Copy the 'n' syscalls the subprocess spent most time in (hottest
+ * first) in 'top'. Returns the number of syscalls copied. */
+int rlimit_get_syscall_top (subprocess_t * p, rlimit_syscall_stat_t * top,
+			    int n);
+
 /* Maximum amount of memory used */
 size_t rlimit_get_memory_profile (subprocess_t * p);
 
+/* Instructions retired by the subprocess ('0' if not counted, i.e.
+ * neither perf counters nor an instruction limit set) */
+uint64_t rlimit_get_instructions_profile (subprocess_t * p);
+
+/* Former names of the getters above, kept for compatibility */
+time_t rlimit_get_real_time (subprocess_t * p);
+time_t rlimit_get_user_time (subprocess_t * p);
+time_t rlimit_get_sys_time (subprocess_t * p);
+size_t rlimit_get_memory (subprocess_t * p);
+
+/* Resources sampled while the subprocess ran (oldest first), their
+ * number being stored in 'count'. Once RLIMIT_SAMPLES samples are
+ * taken, they are merged by pairs (latest date and cpu time, highest
+ * memory, threads and fds) and the interval is doubled. */
+const rlimit_sample_t *rlimit_get_samples (subprocess_t * p, size_t *count);
+
+/* Perf counters read once the subprocess is over (NULL if not
+ * counted, i.e. neither perf counters nor an instruction limit set),
+ * 'available' telling which ones could be counted */
+const rlimit_perf_t *rlimit_get_perf_profile (subprocess_t * p);
+
 #endif /* RLIMIT_H */
@@ -0,0 +1,68 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <rlimit.h>
+
+int
+main ()
+{
+  int myargc = 1;
+  char *myargv[] = { "./utils/test_fork" };
+
+  rlimit_policy_t *policy = rlimit_policy_new ();
+
+  rlimit_policy_deny_syscall (policy, SYS_fork);
+  rlimit_policy_deny_syscall (policy, SYS_clone);
+  assert (rlimit_policy_compile (policy) == 0);
+
+  /* A compiled policy is immutable */
+  assert (rlimit_policy_deny_syscall (policy, SYS_vfork) == -1);
+  assert (rlimit_policy_is_denied (policy, SYS_fork));
+  assert (!rlimit_policy_is_denied (policy, SYS_vfork));
+
+  subprocess_t *p1 = rlimit_subprocess_create (myargc, myargv, NULL);
+  subprocess_t *p2 = rlimit_subprocess_create (myargc, myargv, NULL);
+
+  rlimit_set_syscall_policy (p1, policy);
+  rlimit_set_syscall_policy (p2, policy);
+  rlimit_policy_unref (policy);
+
+  /* Disabling a syscall on p2 must not modify the shared policy */
+  rlimit_disable_syscall (p2, SYS_vfork);
+  assert (rlimit_get_syscall_policy (p1) == policy);
+  assert (rlimit_get_syscall_policy (p2) != policy);
+  assert (rlimit_get_disabled_syscalls (p1)[0] == 2);
+  assert (rlimit_get_disabled_syscalls (p2)[0] == 3);
+
+  /* Same layout as the former limits_t.syscalls: the count, then ids */
+  assert (rlimit_get_disabled_syscalls (p1)[1] == SYS_fork);
+  assert (rlimit_get_disabled_syscalls (p1)[2] == SYS_clone);
+  assert (rlimit_get_disabled_syscalls (p2)[3] == SYS_vfork);
+
+  rlimit_subprocess_run (p1);
+  rlimit_subprocess_run (p2);
+  rlimit_subprocess_wait (p1);
+  rlimit_subprocess_wait (p2);
+
+  assert (p1->status == DENIEDSYSCALL);
+  assert (p2->status == DENIEDSYSCALL);
+
+  rlimit_subprocess_delete (p1);
+  rlimit_subprocess_delete (p2);
+
+  /* A SIGSYS which is not sent by the filter is not a denied syscall */
+  char *sigsys_argv[] = { "/bin/sh", "-c", "kill -SYS $$" };
+  subprocess_t *p3 = rlimit_subprocess_create (3, sigsys_argv, NULL);
+
+  rlimit_disable_syscall (p3, SYS_reboot);
+  rlimit_subprocess_run (p3);
+  rlimit_subprocess_wait (p3);
+
+  assert (p3->status == KILLED);
+  assert (p3->retval == SIGSYS);
+
+  rlimit_subprocess_delete (p3);
+
+  return EXIT_SUCCESS;
+}
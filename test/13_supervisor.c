@@ -0,0 +1,70 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rlimit.h>
+
+#define RUNS 32
+
+int
+main ()
+{
+  char *io_argv[] = { "./utils/test_io" };
+  char *sleep_argv[] = { "/bin/sleep", "10" };
+  char *fork_argv[] = { "./utils/test_fork" };
+  char *true_argv[] = { "/bin/true" };
+  subprocess_t *runs[RUNS];
+
+  assert (rlimit_supervisor_start (2) == 0);
+
+  subprocess_t *io = rlimit_subprocess_create (1, io_argv, NULL);
+  subprocess_t *timeout = rlimit_subprocess_create (2, sleep_argv, NULL);
+  subprocess_t *denied = rlimit_subprocess_create (1, fork_argv, NULL);
+
+  rlimit_set_time_limit (timeout, 1);
+  rlimit_disable_syscall (denied, SYS_fork);
+  rlimit_disable_syscall (denied, SYS_clone);
+
+  rlimit_subprocess_run (io);
+  rlimit_subprocess_run (timeout);
+  rlimit_subprocess_run (denied);
+
+  for (int i = 0; i < RUNS; i++)
+    {
+      runs[i] = rlimit_subprocess_create (1, true_argv, NULL);
+      rlimit_subprocess_run (runs[i]);
+    }
+
+  /* Input/output are handled by the supervisor */
+  rlimit_write_stdin (io, "42\n");
+  rlimit_subprocess_wait (io);
+
+  assert (!strncmp (rlimit_read_stdout (io), "stdout\n42\n", 10));
+  assert (!strncmp (rlimit_read_stderr (io), "stderr\n", 7));
+  assert (io->retval == EXIT_SUCCESS);
+  assert (io->status == TERMINATED);
+
+  rlimit_subprocess_wait (timeout);
+  assert (timeout->retval == SIGKILL);
+  assert (timeout->status == TIMEOUT);
+
+  rlimit_subprocess_wait (denied);
+  assert (denied->status == DENIEDSYSCALL);
+
+  for (int i = 0; i < RUNS; i++)
+    {
+      rlimit_subprocess_wait (runs[i]);
+      assert (runs[i]->status == TERMINATED);
+      assert (runs[i]->retval == EXIT_SUCCESS);
+      rlimit_subprocess_delete (runs[i]);
+    }
+
+  rlimit_subprocess_delete (io);
+  rlimit_subprocess_delete (timeout);
+  rlimit_subprocess_delete (denied);
+
+  rlimit_supervisor_stop ();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,47 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <rlimit.h>
+
+#define RUNS 16
+
+int
+main ()
+{
+  char *short_argv[] = { "/bin/sleep", "1" };
+  char *long_argv[] = { "/bin/sleep", "10" };
+  subprocess_t *runs[RUNS];
+
+  /* The exit of the short ones must not wake up the other watchdogs */
+  subprocess_t *p = rlimit_subprocess_create (2, long_argv, NULL);
+  rlimit_set_time_limit (p, 2);
+  rlimit_subprocess_run (p);
+
+  for (int i = 0; i < RUNS; i++)
+    {
+      runs[i] = rlimit_subprocess_create (2, short_argv, NULL);
+      rlimit_set_time_limit (runs[i], 5);
+      rlimit_subprocess_run (runs[i]);
+    }
+
+  for (int i = 0; i < RUNS; i++)
+    {
+      rlimit_subprocess_wait (runs[i]);
+      assert (runs[i]->retval == EXIT_SUCCESS);
+      assert (runs[i]->status == TERMINATED);
+
+      /* Signaling a reaped subprocess never reaches another process */
+      assert (rlimit_subprocess_signal (runs[i], 0) == -1);
+      rlimit_subprocess_delete (runs[i]);
+    }
+
+  rlimit_subprocess_wait (p);
+  assert (p->retval == SIGKILL);
+  assert (p->status == TIMEOUT);
+  assert (p->real_time_usec < 5000000);
+
+  rlimit_subprocess_delete (p);
+
+  return EXIT_SUCCESS;
+}
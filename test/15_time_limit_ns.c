@@ -0,0 +1,85 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include <rlimit.h>
+
+#define MS 1000000ULL
+
+/* A sleep of 10s limited to 200ms must be killed well before 1s */
+static void
+check_timeout (void)
+{
+  char *argv[] = { "/bin/sleep", "10" };
+  subprocess_t *p = rlimit_subprocess_create (2, argv, NULL);
+
+  rlimit_set_time_limit_ns (p, 200 * MS);
+  assert (rlimit_get_time_limit_ns (p) == 200 * MS);
+  assert (rlimit_get_time_limit (p) == 1);
+
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+
+  assert (p->retval == SIGKILL);
+  assert (p->status == TIMEOUT);
+  assert (p->real_time_usec >= 200000);
+  assert (p->real_time_usec < 1000000);
+
+  rlimit_subprocess_delete (p);
+}
+
+/* A quick subprocess must not be hit by a sub-second timeout */
+static void
+check_no_timeout (void)
+{
+  char *argv[] = { "/bin/true" };
+  subprocess_t *p = rlimit_subprocess_create (1, argv, NULL);
+
+  rlimit_set_time_limit_ns (p, 500 * MS);
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+
+  assert (p->retval == EXIT_SUCCESS);
+  assert (p->status == TERMINATED);
+
+  rlimit_subprocess_delete (p);
+}
+
+/* A timeout an hour away (top level of the wheel) must neither fire
+ * nor delay the short ones */
+static void
+check_far_timeout (void)
+{
+  char *argv[] = { "/bin/sleep", "0.3" };
+  subprocess_t *p = rlimit_subprocess_create (2, argv, NULL);
+
+  rlimit_set_time_limit_ns (p, 3600000 * MS);
+  rlimit_subprocess_run (p);
+
+  check_timeout ();
+
+  rlimit_subprocess_wait (p);
+  assert (p->retval == EXIT_SUCCESS);
+  assert (p->status == TERMINATED);
+
+  rlimit_subprocess_delete (p);
+}
+
+int
+main ()
+{
+  check_timeout ();
+  check_no_timeout ();
+  check_far_timeout ();
+
+  /* Same checks with the supervisor engine (when available) */
+  if (rlimit_supervisor_start (1) == 0)
+    {
+      check_timeout ();
+      check_no_timeout ();
+      check_far_timeout ();
+      rlimit_supervisor_stop ();
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rlimit.h>
+
+#define LIMIT 1024
+
+/* Runs 'seq 1 100000' (588895 bytes) with a capture policy */
+static subprocess_t *
+run_seq (int policy)
+{
+  char *argv[] = { "/usr/bin/seq", "1", "100000" };
+  subprocess_t *p = rlimit_subprocess_create (3, argv, NULL);
+
+  rlimit_set_stdout_limit (p, LIMIT, policy);
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+
+  return p;
+}
+
+/* Writes 1.5 times the limit and hangs (unless killed) */
+static subprocess_t *
+run_overflow (int policy)
+{
+  char *argv[] = { "/bin/sh", "-c", "yes | head -c 1536; exec sleep 10" };
+  subprocess_t *p = rlimit_subprocess_create (3, argv, NULL);
+
+  rlimit_set_stdout_limit (p, LIMIT, policy);
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+
+  return p;
+}
+
+int
+main ()
+{
+  subprocess_t *p;
+
+  /* Keeping the head */
+  p = run_seq (CAPTURE_HEAD);
+  assert (p->status == TERMINATED);
+  assert (strlen (rlimit_read_stdout (p)) == LIMIT);
+  assert (strncmp (rlimit_read_stdout (p), "1\n2\n3\n", 6) == 0);
+  assert (rlimit_get_stdout_dropped (p) == 588895 - LIMIT);
+  rlimit_subprocess_delete (p);
+
+  /* Keeping the tail */
+  p = run_seq (CAPTURE_TAIL);
+  assert (p->status == TERMINATED);
+  assert (strlen (rlimit_read_stdout (p)) == LIMIT);
+  assert (strcmp (&(rlimit_read_stdout (p)[LIMIT - 13]),
+		  "99999\n100000\n") == 0);
+  assert (rlimit_get_stdout_dropped (p) == 588895 - LIMIT);
+  rlimit_subprocess_delete (p);
+
+  /* Keeping both */
+  p = run_seq (CAPTURE_HEADTAIL);
+  assert (p->status == TERMINATED);
+  assert (strlen (rlimit_read_stdout (p)) == LIMIT);
+  assert (strncmp (rlimit_read_stdout (p), "1\n2\n3\n", 6) == 0);
+  assert (strcmp (&(rlimit_read_stdout (p)[LIMIT - 13]),
+		  "99999\n100000\n") == 0);
+  rlimit_subprocess_delete (p);
+
+  /* Killing on overflow */
+  p = run_seq (CAPTURE_HEAD | CAPTURE_KILL);
+  assert (p->status == OUTPUTEXCEED);
+  assert (p->retval == SIGKILL);
+  assert (strlen (rlimit_read_stdout (p)) == LIMIT);
+  rlimit_subprocess_delete (p);
+
+  /* Killing as soon as the output does not fit anymore */
+  p = run_overflow (CAPTURE_TAIL | CAPTURE_KILL);
+  assert (p->status == OUTPUTEXCEED);
+  assert (p->retval == SIGKILL);
+  assert (strlen (rlimit_read_stdout (p)) == LIMIT);
+  assert (rlimit_get_stdout_dropped (p) == 1536 - LIMIT);
+  rlimit_subprocess_delete (p);
+
+  p = run_overflow (CAPTURE_HEADTAIL | CAPTURE_KILL);
+  assert (p->status == OUTPUTEXCEED);
+  assert (p->retval == SIGKILL);
+  assert (strlen (rlimit_read_stdout (p)) == LIMIT);
+  assert (rlimit_get_stdout_dropped (p) == 1536 - LIMIT);
+  rlimit_subprocess_delete (p);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,48 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rlimit.h>
+
+/* 'seq 1 100000' writes 588895 bytes */
+static void
+check_capture (void)
+{
+  char *argv[] = { "/usr/bin/seq", "1", "100000" };
+  subprocess_t *p = rlimit_subprocess_create (3, argv, NULL);
+  const char *output;
+  size_t length;
+
+  rlimit_set_file_capture (p, true);
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+
+  assert (p->status == TERMINATED);
+
+  output = rlimit_get_stdout_view (p, &length);
+  assert (length == 588895);
+  assert (strncmp (output, "1\n2\n3\n", 6) == 0);
+  assert (strcmp (&(output[length - 13]), "99999\n100000\n") == 0);
+  assert (rlimit_read_stdout (p) == output);
+
+  output = rlimit_get_stderr_view (p, &length);
+  assert (length == 0);
+  assert (output[0] == '\0');
+
+  rlimit_subprocess_delete (p);
+}
+
+int
+main ()
+{
+  check_capture ();
+
+  /* Same check with the supervisor engine (when available) */
+  if (rlimit_supervisor_start (1) == 0)
+    {
+      check_capture ();
+      rlimit_supervisor_stop ();
+    }
+
+  return EXIT_SUCCESS;
+}
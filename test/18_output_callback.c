@@ -0,0 +1,68 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <rlimit.h>
+
+static volatile size_t received = 0;
+static volatile bool throttle = true;
+
+static int
+consume (subprocess_t * p, const char *chunk, size_t length, void *data)
+{
+  (void) p;
+  (void) chunk;
+  (void) data;
+
+  received += length;
+
+  return (throttle) ? RLIMIT_PAUSE : RLIMIT_CONTINUE;
+}
+
+/* 'seq 1 1000000' writes 6888896 bytes */
+static void
+check_callback (void)
+{
+  char *argv[] = { "/usr/bin/seq", "1", "1000000" };
+  subprocess_t *p = rlimit_subprocess_create (3, argv, NULL);
+  struct timespec delay = {.tv_sec = 0,.tv_nsec = 200000000 };
+
+  received = 0;
+  throttle = true;
+
+  rlimit_set_stdout_callback (p, consume, NULL);
+  rlimit_subprocess_run (p);
+
+  /* The subprocess is blocked on the full pipe */
+  nanosleep (&delay, NULL);
+  assert (p->status == RUNNING);
+  assert (received > 0);
+  assert (received < 1000000);
+
+  throttle = false;
+  rlimit_resume_output (p);
+  rlimit_subprocess_wait (p);
+
+  assert (p->status == TERMINATED);
+  assert (received == 6888896);
+  assert (rlimit_read_stdout (p) == NULL);
+
+  rlimit_subprocess_delete (p);
+}
+
+int
+main ()
+{
+  check_callback ();
+
+  /* Same check with the supervisor engine (when available) */
+  if (rlimit_supervisor_start (1) == 0)
+    {
+      check_callback ();
+      rlimit_supervisor_stop ();
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,62 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rlimit.h>
+
+#define CHUNK  100
+#define CHUNKS 10000
+
+/* Binary input (with zeros) echoed back by 'head -c' */
+static void
+check_queue (void)
+{
+  char *argv[] = { "/usr/bin/head", "-c", "1000000" };
+  subprocess_t *p = rlimit_subprocess_create (3, argv, NULL);
+  char chunk[CHUNK];
+  const char *output;
+  size_t length;
+
+  rlimit_subprocess_run (p);
+
+  for (int i = 0; i < CHUNKS; i++)
+    {
+      for (int j = 0; j < CHUNK; j++)
+	chunk[j] = (char) (i + j);
+
+      assert (rlimit_queue_stdin (p, chunk, CHUNK) == 0);
+    }
+
+  assert (rlimit_flush_stdin (p) == 0);
+  rlimit_subprocess_wait (p);
+
+  assert (p->status == TERMINATED);
+  assert (p->retval == EXIT_SUCCESS);
+
+  output = rlimit_get_stdout_view (p, &length);
+  assert (length == CHUNK * CHUNKS);
+
+  for (int i = 0; i < CHUNKS; i++)
+    for (int j = 0; j < CHUNK; j++)
+      assert (output[i * CHUNK + j] == (char) (i + j));
+
+  /* Nothing can be written once the subprocess is over */
+  assert (rlimit_queue_stdin (p, chunk, CHUNK) == -1);
+
+  rlimit_subprocess_delete (p);
+}
+
+int
+main ()
+{
+  check_queue ();
+
+  /* Same check with the supervisor engine (when available) */
+  if (rlimit_supervisor_start (1) == 0)
+    {
+      check_queue ();
+      rlimit_supervisor_stop ();
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,74 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rlimit.h>
+
+#define RUNS   8
+#define LENGTH 100000
+
+int
+main ()
+{
+  char *argv[] = { "/bin/cat" };
+  char tmp_path[] = "/tmp/rlimit-test-XXXXXX";
+  subprocess_t *runs[RUNS];
+  char *input = malloc (LENGTH);
+  const char *output;
+  size_t length;
+  int fd, tmp_fd;
+
+  for (int i = 0; i < LENGTH; i++)
+    input[i] = 'a' + (i % 26);
+
+  /* A single sealed input feeding concurrent runs */
+  assert ((fd = rlimit_input_new (input, LENGTH)) != -1);
+
+  for (int i = 0; i < RUNS; i++)
+    {
+      runs[i] = rlimit_subprocess_create (1, argv, NULL);
+      assert (rlimit_set_stdin_fd (runs[i], fd) == 0);
+      rlimit_subprocess_run (runs[i]);
+    }
+
+  for (int i = 0; i < RUNS; i++)
+    {
+      rlimit_subprocess_wait (runs[i]);
+      assert (runs[i]->status == TERMINATED);
+
+      output = rlimit_get_stdout_view (runs[i], &length);
+      assert (length == LENGTH);
+      assert (memcmp (output, input, LENGTH) == 0);
+
+      /* stdin cannot be written anymore */
+      assert (rlimit_queue_stdin (runs[i], "a", 1) == -1);
+
+      rlimit_subprocess_delete (runs[i]);
+    }
+
+  close (fd);
+
+  /* Reading a file given by its path */
+  assert ((tmp_fd = mkstemp (tmp_path)) != -1);
+  assert (write (tmp_fd, input, LENGTH) == LENGTH);
+  close (tmp_fd);
+
+  runs[0] = rlimit_subprocess_create (1, argv, NULL);
+  assert (rlimit_set_stdin_path (runs[0], tmp_path) == 0);
+  rlimit_subprocess_run (runs[0]);
+  rlimit_subprocess_wait (runs[0]);
+
+  output = rlimit_get_stdout_view (runs[0], &length);
+  assert (length == LENGTH);
+  assert (memcmp (output, input, LENGTH) == 0);
+
+  rlimit_subprocess_delete (runs[0]);
+  unlink (tmp_path);
+  free (input);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,51 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rlimit.h>
+
+int
+main ()
+{
+  char *argv[] = { "/bin/sh", "-c",
+    "echo start; sleep 0.2; echo value=42; echo oops >&2; sleep 0.2; "
+      "echo end"
+  };
+  subprocess_t *p = rlimit_subprocess_create (3, argv, NULL);
+  struct timespec start, end;
+  rlimit_match_t match;
+  char *output;
+
+  rlimit_subprocess_run (p);
+
+  /* Getting a group of the match */
+  assert (rlimit_expect_match (p, RLIMIT_STDOUT, "value=([0-9]+)", 5,
+			       &match));
+  output = rlimit_read_stdout (p);
+  assert (match.stream == RLIMIT_STDOUT);
+  assert (match.end[1] - match.start[1] == 2);
+  assert (strncmp (&(output[match.start[1]]), "42", 2) == 0);
+  assert (match.start[2] == -1);
+
+  /* Both streams */
+  assert (rlimit_expect_match (p, RLIMIT_STDOUT | RLIMIT_STDERR, "o+ps", 5,
+			       &match));
+  assert (match.stream == RLIMIT_STDERR);
+
+  /* The cursor moved after the previous match */
+  assert (rlimit_expect_stdout (p, "end", 5));
+
+  /* Nothing more can come once the subprocess is over */
+  rlimit_subprocess_wait (p);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  assert (!rlimit_expect_stdout (p, "start", 5));
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  assert (end.tv_sec - start.tv_sec < 2);
+
+  rlimit_subprocess_delete (p);
+
+  return EXIT_SUCCESS;
+}
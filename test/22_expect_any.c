@@ -0,0 +1,62 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rlimit.h>
+
+int
+main ()
+{
+  char *argv[] = { "/bin/sh", "-c",
+    "printf 'login: '; sleep 0.2; echo 'password: '; sleep 0.2; "
+      "echo 'error 404' >&2; echo 'abcd'; echo '> '"
+  };
+  char *prompts[] = { "password:", "login:", "> " };
+  char *errors[] = { "fatal", "error ([0-9]+)" };
+  char *nested[] = { "abcd", "bc" };
+  subprocess_t *p = rlimit_subprocess_create (3, argv, NULL);
+  rlimit_match_t match;
+  char *output;
+
+  rlimit_subprocess_run (p);
+
+  /* Literals, in the order they come */
+  assert (rlimit_expect_any (p, prompts, 3, 5) == 1);
+  assert (rlimit_expect_any (p, prompts, 3, 5) == 0);
+
+  /* Regular expressions, with the groups of the pattern matched */
+  assert (rlimit_expect_any_match (p, RLIMIT_STDERR, errors, 2, 5, &match)
+	  == 1);
+  output = rlimit_read_stderr (p);
+  assert (match.index == 1);
+  assert (match.stream == RLIMIT_STDERR);
+  assert (strncmp (&(output[match.start[1]]), "404", 3) == 0);
+  assert (match.start[2] == -1);
+
+  /* The literal starting first wins, even if another one ends first */
+  assert (rlimit_expect_any_match (p, RLIMIT_STDOUT, nested, 2, 5, &match)
+	  == 0);
+  output = rlimit_read_stdout (p);
+  assert (strncmp (&(output[match.start[0]]), "abcd", 4) == 0);
+  assert (match.end[0] - match.start[0] == 4);
+
+  assert (rlimit_expect_any (p, prompts, 3, 5) == 2);
+
+  /* Nothing more once the subprocess is over */
+  rlimit_subprocess_wait (p);
+  assert (rlimit_expect_any (p, prompts, 3, 1) == -1);
+
+  rlimit_subprocess_delete (p);
+
+  /* The longest literal wins among the ones starting first */
+  char *echo_argv[] = { "/bin/echo", "abc" };
+  char *prefixes[] = { "ab", "abc", "bc" };
+
+  p = rlimit_subprocess_create (2, echo_argv, NULL);
+  rlimit_subprocess_run (p);
+  assert (rlimit_expect_any (p, prefixes, 3, 5) == 1);
+  rlimit_subprocess_wait (p);
+  rlimit_subprocess_delete (p);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rlimit.h>
+
+#define JOBS 32
+
+int
+main ()
+{
+  char *fast[] = { "/bin/echo", "done" };
+  char *slow[] = { "/bin/sh", "-c", "sleep 0.3; echo done" };
+  char *endless[] = { "/bin/sleep", "10" };
+  bool seen[JOBS] = { false };
+  rlimit_batch_t *b = rlimit_batch_new (4);
+  subprocess_t *runs[JOBS];
+  subprocess_t *p;
+  int collected = 0;
+
+  assert (b != NULL);
+
+  /* Very uneven run times, the slow ones all queued on the same worker */
+  for (int i = 0; i < JOBS; i++)
+    {
+      if (i == JOBS - 1)
+	{
+	  runs[i] = rlimit_subprocess_create (2, endless, NULL);
+	  rlimit_set_time_limit (runs[i], 1);
+	}
+      else if (i % 4 == 0)
+	runs[i] = rlimit_subprocess_create (3, slow, NULL);
+      else
+	runs[i] = rlimit_subprocess_create (2, fast, NULL);
+
+      assert (rlimit_batch_submit (b, runs[i]) == 0);
+    }
+
+  while ((p = rlimit_batch_next (b)) != NULL)
+    {
+      int i = 0;
+
+      while (runs[i] != p)
+	i++;
+
+      assert (!seen[i]);
+      seen[i] = true;
+      collected++;
+
+      if (i == JOBS - 1)
+	assert (p->status == TIMEOUT);
+      else
+	{
+	  assert (p->status == TERMINATED);
+	  assert (strcmp (rlimit_read_stdout (p), "done\n") == 0);
+	}
+
+      rlimit_subprocess_delete (p);
+    }
+
+  assert (collected == JOBS);
+
+  /* Subprocesses left are run and deleted with the batch */
+  assert (rlimit_batch_submit (b, rlimit_subprocess_create (2, fast, NULL))
+	  == 0);
+  rlimit_batch_delete (b);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rlimit.h>
+
+int
+main ()
+{
+  char *io_argv[] = { "./utils/test_io" };
+  char *sleep_argv[] = { "/bin/sleep", "10" };
+  char *fork_argv[] = { "./utils/test_fork" };
+  char *ppid_argv[] = { "/bin/sh", "-c", "echo $PPID" };
+  char *fd_argv[] = { "/bin/sh", "-c", NULL };
+  char pid[32], test[64];
+  int fd;
+
+  assert (rlimit_spawn_helper_start () == 0);
+  assert (rlimit_spawn_helper_start () == -1);
+
+  /* Opened after the helper started, so not inherited by its children */
+  assert ((fd = open ("/dev/null", O_RDONLY)) != -1);
+  snprintf (test, sizeof (test), "test ! -e /dev/fd/%d", fd);
+  fd_argv[2] = test;
+
+  subprocess_t *io = rlimit_subprocess_create (1, io_argv, NULL);
+  subprocess_t *timeout = rlimit_subprocess_create (2, sleep_argv, NULL);
+  subprocess_t *denied = rlimit_subprocess_create (1, fork_argv, NULL);
+  subprocess_t *ppid = rlimit_subprocess_create (3, ppid_argv, NULL);
+  subprocess_t *fds = rlimit_subprocess_create (3, fd_argv, NULL);
+
+  rlimit_set_time_limit (timeout, 1);
+  rlimit_disable_syscall (denied, SYS_fork);
+  rlimit_disable_syscall (denied, SYS_clone);
+
+  rlimit_subprocess_run (io);
+  rlimit_subprocess_run (timeout);
+  rlimit_subprocess_run (denied);
+  rlimit_subprocess_run (ppid);
+  rlimit_subprocess_run (fds);
+
+  rlimit_write_stdin (io, "42\n");
+  rlimit_subprocess_wait (io);
+  assert (!strncmp (rlimit_read_stdout (io), "stdout\n42\n", 10));
+  assert (!strncmp (rlimit_read_stderr (io), "stderr\n", 7));
+  assert (io->status == TERMINATED);
+
+  rlimit_subprocess_wait (timeout);
+  assert (timeout->status == TIMEOUT);
+  assert (timeout->retval == SIGKILL);
+
+  rlimit_subprocess_wait (denied);
+  assert (denied->status == DENIEDSYSCALL);
+
+  /* The subprocesses are still children of the caller */
+  rlimit_subprocess_wait (ppid);
+  snprintf (pid, sizeof (pid), "%d\n", getpid ());
+  assert (strcmp (rlimit_read_stdout (ppid), pid) == 0);
+
+  rlimit_subprocess_wait (fds);
+  assert (fds->status == TERMINATED);
+  assert (fds->retval == EXIT_SUCCESS);
+
+  rlimit_subprocess_delete (io);
+  rlimit_subprocess_delete (timeout);
+  rlimit_subprocess_delete (denied);
+  rlimit_subprocess_delete (ppid);
+  rlimit_subprocess_delete (fds);
+
+  close (fd);
+  rlimit_spawn_helper_stop ();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,87 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rlimit.h>
+
+#define RUNS 8
+
+int
+main ()
+{
+  char *slow_argv[] = { "/bin/sh", "-c",
+    "sleep 1; read line; case $line in "
+      "sleep) sleep 10;; *) echo \"got $line\";; "
+      "esac"
+  };
+  char *marker_argv[] = { "/bin/sh", "-c",
+    "x=$(echo ready); kill -STOP $$; echo \"$x $$\""
+  };
+  subprocess_t *model = rlimit_subprocess_create (3, slow_argv, NULL);
+  subprocess_t *runs[RUNS];
+  rlimit_forkserver_t *fs;
+  subprocess_t *p;
+  char input[16], output[32];
+
+  /* Starting the program once (a second is spent before reading) */
+  assert ((fs = rlimit_forkserver_new (model, SNAPSHOT_STDIN)) != NULL);
+  rlimit_subprocess_delete (model);
+
+  for (int i = 0; i < RUNS; i++)
+    {
+      runs[i] = rlimit_forkserver_create (fs);
+      rlimit_subprocess_run (runs[i]);
+    }
+
+  for (int i = 0; i < RUNS; i++)
+    {
+      snprintf (input, sizeof (input), "%d\n", i);
+      snprintf (output, sizeof (output), "got %d\n", i);
+
+      rlimit_write_stdin (runs[i], input);
+      rlimit_subprocess_wait (runs[i]);
+
+      assert (runs[i]->status == TERMINATED);
+      assert (strcmp (rlimit_read_stdout (runs[i]), output) == 0);
+      assert (runs[i]->real_time_usec < 1000000);
+
+      rlimit_subprocess_delete (runs[i]);
+    }
+
+  /* Limits apply to each copy */
+  p = rlimit_forkserver_create (fs);
+  rlimit_set_time_limit (p, 1);
+  rlimit_subprocess_run (p);
+  rlimit_write_stdin (p, "sleep\n");
+  rlimit_subprocess_wait (p);
+  assert (p->status == TIMEOUT);
+  rlimit_subprocess_delete (p);
+
+  p = rlimit_forkserver_create (fs);
+  rlimit_disable_syscall (p, SYS_write);
+  rlimit_subprocess_run (p);
+  rlimit_write_stdin (p, "denied\n");
+  rlimit_subprocess_wait (p);
+  assert (p->status == DENIEDSYSCALL);
+  rlimit_subprocess_delete (p);
+
+  rlimit_forkserver_delete (fs);
+
+  /* Snapshot at an explicit marker */
+  model = rlimit_subprocess_create (3, marker_argv, NULL);
+  assert ((fs = rlimit_forkserver_new (model, SNAPSHOT_SIGSTOP)) != NULL);
+  rlimit_subprocess_delete (model);
+
+  p = rlimit_forkserver_create (fs);
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+  assert (p->status == TERMINATED);
+  assert (strncmp (rlimit_read_stdout (p), "ready ", 6) == 0);
+  rlimit_subprocess_delete (p);
+
+  rlimit_forkserver_delete (fs);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rlimit.h>
+
+#define RUNS 16
+
+int
+main ()
+{
+  char *argv[] = { "/usr/bin/env" };
+  char *envp[] = { "RLIMIT=42", "EMPTY=", NULL };
+  size_t size = rlimit_subprocess_size (1, argv, envp);
+  char *pool = malloc (2 * size);
+  subprocess_t *p;
+
+  /* argv, envp and their strings are in the block of the subprocess */
+  p = rlimit_subprocess_create (1, argv, envp);
+  assert ((uintptr_t) p->argv[0] > (uintptr_t) p);
+  assert ((uintptr_t) p->envp[1] < (uintptr_t) p + size);
+  assert (p->envp[2] == NULL);
+
+  rlimit_set_time_limit (p, 5);
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+  assert (strcmp (rlimit_read_stdout (p), "RLIMIT=42\nEMPTY=\n") == 0);
+  rlimit_subprocess_delete (p);
+
+  /* Memory provided by the caller, reused from one run to the next */
+  for (int i = 0; i < RUNS; i++)
+    {
+      p = rlimit_subprocess_create_at (pool + (i % 2) * size, 1, argv, envp);
+      assert ((char *) p == pool + (i % 2) * size);
+
+      rlimit_set_time_limit (p, 5);
+      rlimit_subprocess_run (p);
+      rlimit_subprocess_wait (p);
+      assert (p->status == TERMINATED);
+      assert (strcmp (rlimit_read_stdout (p), "RLIMIT=42\nEMPTY=\n") == 0);
+      rlimit_subprocess_delete (p);
+    }
+
+  /* Deleted while running: killed and reaped before being freed */
+  char *sleep_argv[] = { "/bin/sh", "-c", "echo ready; exec sleep 10" };
+  pid_t pid;
+
+  p = rlimit_subprocess_create (3, sleep_argv, NULL);
+  rlimit_subprocess_run (p);
+  assert (rlimit_expect_stdout (p, "ready", 5));
+  pid = p->pid;
+  rlimit_subprocess_delete (p);
+  assert ((kill (pid, 0) == -1) && (errno == ESRCH));
+
+  /* Never run */
+  p = rlimit_subprocess_create (1, argv, NULL);
+  assert (p->envp == NULL);
+  rlimit_subprocess_delete (p);
+
+  free (pool);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,98 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <rlimit.h>
+
+/* Find a writable cgroup (v2) mount point */
+static bool
+cgroup_mount (char *path, size_t size)
+{
+  char line[512], mount[256], type[64];
+  bool found = false;
+  FILE *mounts = fopen ("/proc/mounts", "r");
+
+  if (mounts == NULL)
+    return false;
+
+  while (!found && (fgets (line, sizeof (line), mounts) != NULL))
+    if ((sscanf (line, "%*s %255s %63s", mount, type) == 2) &&
+	(strcmp (type, "cgroup2") == 0) && (access (mount, W_OK) == 0))
+      {
+	snprintf (path, size, "%s/rlimit-test-%d", mount, getpid ());
+	found = true;
+      }
+
+  fclose (mounts);
+
+  return found;
+}
+
+int
+main ()
+{
+  char *cgroup_argv[] = { "/bin/cat", "/proc/self/cgroup" };
+  char *busy_argv[] = { "/bin/sh", "-c",
+    "i=0; while [ $i -lt 100000 ]; do i=$((i+1)); done"
+  };
+  char *left_argv[] = { "/bin/sh", "-c", "sleep 100 & echo started" };
+  char parent[512], path[1024];
+
+  /* No cgroup (v2) we can use, nothing to test */
+  if (!cgroup_mount (parent, sizeof (parent)) || (mkdir (parent, 0755) == -1))
+    return EXIT_SUCCESS;
+
+  assert (rlimit_cgroup_start (parent) == 0);
+  assert (rlimit_cgroup_start (parent) == -1);
+
+  subprocess_t *cgroup = rlimit_subprocess_create (2, cgroup_argv, NULL);
+  subprocess_t *busy = rlimit_subprocess_create (3, busy_argv, NULL);
+  subprocess_t *left = rlimit_subprocess_create (3, left_argv, NULL);
+
+  rlimit_subprocess_run (cgroup);
+  rlimit_subprocess_run (busy);
+  rlimit_subprocess_run (left);
+
+  /* Running in a cgroup of its own */
+  rlimit_subprocess_wait (cgroup);
+  assert (cgroup->status == TERMINATED);
+  assert (strstr (rlimit_read_stdout (cgroup), "/rlimit-") != NULL);
+
+  /* Profile read from cpu.stat */
+  rlimit_subprocess_wait (busy);
+  assert (busy->status == TERMINATED);
+  assert (busy->user_time_usec + busy->sys_time_usec > 0);
+
+  /* The process left behind is killed and the cgroup removed */
+  rlimit_subprocess_wait (left);
+  assert (left->status == TERMINATED);
+  snprintf (path, sizeof (path), "%s", left->cgroup);
+  assert (access (path, F_OK) == 0);
+
+  rlimit_subprocess_delete (cgroup);
+  rlimit_subprocess_delete (busy);
+  rlimit_subprocess_delete (left);
+
+  assert ((access (path, F_OK) == -1) && (errno == ENOENT));
+
+  /* Joining the cgroup when forked by the spawn helper */
+  assert (rlimit_spawn_helper_start () == 0);
+
+  cgroup = rlimit_subprocess_create (2, cgroup_argv, NULL);
+  rlimit_subprocess_run (cgroup);
+  rlimit_subprocess_wait (cgroup);
+  assert (strstr (rlimit_read_stdout (cgroup), "/rlimit-") != NULL);
+  rlimit_subprocess_delete (cgroup);
+
+  rlimit_spawn_helper_stop ();
+
+  rlimit_cgroup_stop ();
+  assert (rmdir (parent) == 0);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,76 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rlimit.h>
+
+/* Check the samples are ordered and look like a running sleep */
+static size_t
+check_samples (subprocess_t * p)
+{
+  size_t count;
+  const rlimit_sample_t *samples = rlimit_get_samples (p, &count);
+
+  for (size_t i = 0; i < count; i++)
+    {
+      assert ((i == 0) || (samples[i].time_usec > samples[i - 1].time_usec));
+      assert ((i == 0) || (samples[i].cpu_usec >= samples[i - 1].cpu_usec));
+      assert (samples[i].rss_kbytes > 0);
+      assert (samples[i].threads == 1);
+      assert (samples[i].fds >= 3);
+    }
+
+  return count;
+}
+
+int
+main ()
+{
+  char *short_argv[] = { "/bin/sleep", "0.5" };
+  char *long_argv[] = { "/bin/sleep", "3" };
+  size_t count;
+
+  subprocess_t *none = rlimit_subprocess_create (2, short_argv, NULL);
+  subprocess_t *sampled = rlimit_subprocess_create (2, short_argv, NULL);
+  subprocess_t *shrunk = rlimit_subprocess_create (2, long_argv, NULL);
+
+  rlimit_set_sample_interval_ns (sampled, 10000000);	/* 10ms */
+  rlimit_set_sample_interval_ns (shrunk, 1000000);	/* 1ms */
+  assert (rlimit_get_sample_interval_ns (shrunk) == 1000000);
+
+  rlimit_subprocess_run (none);
+  rlimit_subprocess_run (sampled);
+  rlimit_subprocess_run (shrunk);
+
+  rlimit_subprocess_wait (none);
+  rlimit_get_samples (none, &count);
+  assert (count == 0);
+
+  rlimit_subprocess_wait (sampled);
+  count = check_samples (sampled);
+  assert ((count >= 10) && (count <= 50));
+
+  /* Merged by pairs when full */
+  rlimit_subprocess_wait (shrunk);
+  count = check_samples (shrunk);
+  assert ((count >= RLIMIT_SAMPLES / 4) && (count <= RLIMIT_SAMPLES));
+
+  rlimit_subprocess_delete (none);
+  rlimit_subprocess_delete (sampled);
+  rlimit_subprocess_delete (shrunk);
+
+  /* Sampled by the timers of the supervisor */
+  assert (rlimit_supervisor_start (1) == 0);
+
+  sampled = rlimit_subprocess_create (2, short_argv, NULL);
+  rlimit_set_sample_interval_ns (sampled, 10000000);
+  rlimit_subprocess_run (sampled);
+  rlimit_subprocess_wait (sampled);
+  count = check_samples (sampled);
+  assert ((count >= 10) && (count <= 50));
+  rlimit_subprocess_delete (sampled);
+
+  rlimit_supervisor_stop ();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+#include <assert.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rlimit.h>
+
+#define CPU_LIMIT 200000000ULL	/* 200ms */
+
+/* Check a busy loop is ended by its CPU time limit */
+static void
+check_busy (subprocess_t * p)
+{
+  rlimit_subprocess_wait (p);
+  assert (p->status == CPUTIMEOUT);
+  assert (p->real_time_usec < 2000000);
+  assert ((uint64_t) (p->user_time_usec + p->sys_time_usec) * 1000 >=
+	  CPU_LIMIT);
+}
+
+/* Check the threads cannot overrun the limit between two checks */
+static void
+check_threads (void)
+{
+  char *threads_argv[] = { "./utils/test_threads" };
+  subprocess_t *p = rlimit_subprocess_create (1, threads_argv, NULL);
+
+  rlimit_set_cpu_time_limit_ns (p, CPU_LIMIT);
+  rlimit_set_time_limit (p, 10);
+  rlimit_subprocess_run (p);
+
+  check_busy (p);
+  assert ((uint64_t) (p->user_time_usec + p->sys_time_usec) * 1000 <
+	  2 * CPU_LIMIT);
+
+  rlimit_subprocess_delete (p);
+}
+
+int
+main ()
+{
+  char *busy_argv[] = { "/bin/sh", "-c", "while :; do :; done" };
+  char *sleep_argv[] = { "/bin/sleep", "0.5" };
+  char *xcpu_argv[] = { "/bin/sh", "-c", "kill -XCPU $$" };
+
+  subprocess_t *busy = rlimit_subprocess_create (3, busy_argv, NULL);
+  subprocess_t *idle = rlimit_subprocess_create (2, sleep_argv, NULL);
+
+  /* The wall-clock timeout is only a safety net */
+  rlimit_set_cpu_time_limit_ns (busy, CPU_LIMIT);
+  rlimit_set_time_limit (busy, 10);
+  assert (rlimit_get_cpu_time_limit_ns (busy) == CPU_LIMIT);
+
+  /* Waiting does not use CPU time */
+  rlimit_set_cpu_time_limit_ns (idle, 100000000);
+
+  rlimit_subprocess_run (busy);
+  rlimit_subprocess_run (idle);
+
+  check_busy (busy);
+
+  rlimit_subprocess_wait (idle);
+  assert (idle->status == TERMINATED);
+  assert (idle->retval == EXIT_SUCCESS);
+
+  rlimit_subprocess_delete (busy);
+  rlimit_subprocess_delete (idle);
+
+  check_threads ();
+
+  /* SIGXCPU is not a CPU timeout without a CPU time limit */
+  idle = rlimit_subprocess_create (3, xcpu_argv, NULL);
+  rlimit_subprocess_run (idle);
+  rlimit_subprocess_wait (idle);
+  assert (idle->status == KILLED);
+  assert (idle->retval == SIGXCPU);
+  rlimit_subprocess_delete (idle);
+
+  /* Checked by the timers of the supervisor */
+  assert (rlimit_supervisor_start (1) == 0);
+
+  busy = rlimit_subprocess_create (3, busy_argv, NULL);
+  rlimit_set_cpu_time_limit_ns (busy, CPU_LIMIT);
+  rlimit_subprocess_run (busy);
+  check_busy (busy);
+  rlimit_subprocess_delete (busy);
+
+  check_threads ();
+
+  rlimit_supervisor_stop ();
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,61 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rlimit.h>
+
+#define AVAILABLE(perf, counter) (((perf)->available & (1U << (counter))) != 0)
+
+int
+main ()
+{
+  char *single_argv[] = { "/bin/sh", "-c", "true" };
+  char *tree_argv[] = { "/bin/sh", "-c",
+    "for i in 1 2 3 4 5 6 7 8 9 10; do /bin/true; done"
+  };
+  const rlimit_perf_t *single_perf, *tree_perf;
+
+  subprocess_t *none = rlimit_subprocess_create (3, single_argv, NULL);
+  subprocess_t *single = rlimit_subprocess_create (3, single_argv, NULL);
+  subprocess_t *tree = rlimit_subprocess_create (3, tree_argv, NULL);
+
+  rlimit_set_perf_counters (single, true);
+  rlimit_set_perf_counters (tree, true);
+
+  rlimit_subprocess_run (none);
+  rlimit_subprocess_run (single);
+  rlimit_subprocess_run (tree);
+
+  rlimit_subprocess_wait (none);
+  assert (rlimit_get_perf_profile (none) == NULL);
+
+  rlimit_subprocess_wait (single);
+  assert (single->status == TERMINATED);
+  single_perf = rlimit_get_perf_profile (single);
+  assert (single_perf != NULL);
+
+  /* No perf events at all on this host, nothing more to check */
+  if (single_perf->available == 0)
+    return EXIT_SUCCESS;
+
+  /* The software counters are there even without a PMU */
+  assert (AVAILABLE (single_perf, RLIMIT_PERF_PAGE_FAULTS));
+  assert (AVAILABLE (single_perf, RLIMIT_PERF_CONTEXT_SWITCHES));
+  assert (single_perf->counters[RLIMIT_PERF_PAGE_FAULTS] > 0);
+
+  if (AVAILABLE (single_perf, RLIMIT_PERF_INSTRUCTIONS))
+    assert (single_perf->counters[RLIMIT_PERF_INSTRUCTIONS] > 0);
+
+  /* The descendants are counted as well */
+  rlimit_subprocess_wait (tree);
+  assert (tree->status == TERMINATED);
+  tree_perf = rlimit_get_perf_profile (tree);
+  assert (tree_perf->counters[RLIMIT_PERF_PAGE_FAULTS] >
+	  3 * single_perf->counters[RLIMIT_PERF_PAGE_FAULTS]);
+
+  rlimit_subprocess_delete (none);
+  rlimit_subprocess_delete (single);
+  rlimit_subprocess_delete (tree);
+
+  return EXIT_SUCCESS;
+}
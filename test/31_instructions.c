@@ -0,0 +1,52 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rlimit.h>
+
+int
+main ()
+{
+  char *busy_argv[] = { "/bin/sh", "-c",
+    "i=0; while [ $i -lt 50000 ]; do i=$((i+1)); done"
+  };
+  const rlimit_perf_t *perf;
+  bool counted;
+
+  subprocess_t *limited = rlimit_subprocess_create (3, busy_argv, NULL);
+  subprocess_t *enough = rlimit_subprocess_create (3, busy_argv, NULL);
+
+  rlimit_set_instruction_limit (limited, 1000000);
+  rlimit_set_instruction_limit (enough, 1000000000000ULL);
+  assert (rlimit_get_instruction_limit (limited) == 1000000);
+
+  /* Only a safety net */
+  rlimit_set_time_limit (limited, 10);
+
+  rlimit_subprocess_run (limited);
+  rlimit_subprocess_run (enough);
+
+  /* Counted even though no perf counters have been asked for */
+  rlimit_subprocess_wait (enough);
+  assert (enough->status == TERMINATED);
+  assert ((perf = rlimit_get_perf_profile (enough)) != NULL);
+  counted = ((perf->available & (1U << RLIMIT_PERF_INSTRUCTIONS)) != 0);
+
+  rlimit_subprocess_wait (limited);
+  if (counted)
+    {
+      assert (limited->status == INSTREXCEED);
+      assert (rlimit_get_instructions_profile (limited) >= 1000000);
+      assert (enough->perf.counters[RLIMIT_PERF_INSTRUCTIONS] > 1000000);
+      assert (rlimit_get_instructions_profile (enough) ==
+	      enough->perf.counters[RLIMIT_PERF_INSTRUCTIONS]);
+    }
+  else
+    assert (rlimit_get_instructions_profile (enough) == 0);
+
+  rlimit_subprocess_delete (limited);
+  rlimit_subprocess_delete (enough);
+
+  /* No instruction counter on this host, the limit cannot be checked */
+  return counted ? EXIT_SUCCESS : 77;
+}
@@ -0,0 +1,52 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rlimit.h>
+
+int
+main ()
+{
+  char *dd_argv[] = { "/bin/dd", "if=/dev/zero", "of=/dev/null", "bs=1",
+    "count=2000"
+  };
+  const rlimit_syscall_stat_t *stats;
+  rlimit_syscall_stat_t top[4];
+  int n;
+
+  subprocess_t *none = rlimit_subprocess_create (5, dd_argv, NULL);
+  subprocess_t *dd = rlimit_subprocess_create (5, dd_argv, NULL);
+
+  rlimit_set_syscall_profile (dd, true);
+
+  rlimit_subprocess_run (none);
+  rlimit_subprocess_run (dd);
+
+  rlimit_subprocess_wait (none);
+  assert (none->status == TERMINATED);
+  assert (rlimit_get_syscall_stats (none) == NULL);
+  assert (rlimit_get_syscall_top (none, top, 4) == 0);
+
+  /* One-byte reads and writes */
+  rlimit_subprocess_wait (dd);
+  assert (dd->status == TERMINATED);
+  assert (dd->retval == EXIT_SUCCESS);
+
+  stats = rlimit_get_syscall_stats (dd);
+  assert (stats != NULL);
+  assert (stats[SYS_read].count >= 2000);
+  assert (stats[SYS_write].count >= 2000);
+  assert (stats[SYS_write].max_ns <= stats[SYS_write].total_ns);
+
+  n = rlimit_get_syscall_top (dd, top, 4);
+  assert ((n > 2) && (n <= 4));
+  for (int i = 1; i < n; i++)
+    assert (top[i - 1].total_ns >= top[i].total_ns);
+  assert ((top[0].syscall == SYS_read) || (top[0].syscall == SYS_write));
+  assert ((top[1].syscall == SYS_read) || (top[1].syscall == SYS_write));
+
+  rlimit_subprocess_delete (none);
+  rlimit_subprocess_delete (dd);
+
+  return EXIT_SUCCESS;
+}
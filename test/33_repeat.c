@@ -0,0 +1,83 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <rlimit.h>
+
+#define COUNTER "/tmp/rlimit_33_repeat"
+
+/* Check the statistics are ordered */
+static void
+check_stats (rlimit_stats_t * s)
+{
+  assert (s->min <= s->median);
+  assert (s->median <= s->p95);
+  assert (s->min <= s->mean);
+  assert (s->stddev >= 0);
+}
+
+int
+main ()
+{
+  char *sleep_argv[] = { "/bin/sleep", "0.05" };
+  /* The fifth run (the fourth measured) is much slower */
+  char *slow_argv[] = { "/bin/sh", "-c",
+    "echo >> " COUNTER "; [ $(wc -l < " COUNTER ") -eq 5 ] && sleep 0.5; "
+    "sleep 0.02"
+  };
+  char *hang_argv[] = { "/bin/sleep", "10" };
+  rlimit_repeat_opts_t opts = {.warmup = 1,.min_runs = 3,.max_runs = 10,
+    .ci_target = 0.5,.keep_outliers = false
+  };
+  rlimit_repeat_t result;
+  subprocess_t *p;
+
+  /* Stopped as soon as the (loose) target is met */
+  p = rlimit_subprocess_create (2, sleep_argv, NULL);
+  assert (rlimit_subprocess_repeat (p, &opts, &result) == 0);
+  assert (result.converged);
+  assert (result.runs >= 3 && result.runs <= 10);
+  assert (result.ci <= 0.5);
+  assert (result.status == TERMINATED);
+  assert (result.real_usec.min >= 50000);
+  check_stats (&(result.real_usec));
+  check_stats (&(result.user_usec));
+  check_stats (&(result.sys_usec));
+  check_stats (&(result.memory_kbytes));
+  assert (result.memory_kbytes.median > 0);
+
+  /* The template is left untouched */
+  assert (p->status == READY);
+  rlimit_subprocess_delete (p);
+
+  /* Every run measured without a target, the slow one discarded */
+  unlink (COUNTER);
+  opts.ci_target = 0;
+  opts.max_runs = 8;
+  p = rlimit_subprocess_create (3, slow_argv, NULL);
+  assert (rlimit_subprocess_repeat (p, &opts, &result) == 0);
+  assert (!result.converged);
+  assert (result.runs == 8);
+  assert (result.kept <= 7);
+  assert (result.real_usec.p95 < 400000);
+
+  /* Unless the outliers are kept */
+  unlink (COUNTER);
+  opts.keep_outliers = true;
+  assert (rlimit_subprocess_repeat (p, &opts, &result) == 0);
+  assert (result.kept == 8);
+  assert (result.real_usec.p95 >= 500000);
+  rlimit_subprocess_delete (p);
+  unlink (COUNTER);
+
+  /* Runs hitting a limit are not measured */
+  p = rlimit_subprocess_create (2, hang_argv, NULL);
+  rlimit_set_time_limit_ns (p, 100000000);
+  assert (rlimit_subprocess_repeat (p, NULL, &result) == -1);
+  assert (result.status == TIMEOUT);
+  assert (result.runs == 0);
+  rlimit_subprocess_delete (p);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rlimit.h>
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Run 'p' and check its output holds 'expected' */
+static void
+check_output (subprocess_t * p, const char *expected)
+{
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+  assert (p->status == TERMINATED);
+  assert (strstr (rlimit_read_stdout (p), expected) != NULL);
+}
+
+int
+main ()
+{
+  char *cpus_argv[] = { "/bin/grep", "Cpus_allowed_list", "/proc/self/status" };
+  char *numa_argv[] = { "/bin/cat", "/proc/self/numa_maps" };
+  char *sleep_argv[] = { "/bin/sleep", "0.3" };
+  char list[64], all[64];
+  subprocess_t *p, *q;
+  double start;
+
+  /* CPU list */
+  p = rlimit_subprocess_create (3, cpus_argv, NULL);
+  assert (rlimit_set_cpu_list (p, "x") == -1);
+  assert (rlimit_set_cpu_list (p, "3-1") == -1);
+  assert (rlimit_set_cpu_list (p, "0,2048") == -1);
+  assert (rlimit_set_cpu_list (p, "0") == 0);
+  rlimit_get_cpu_list (p, list, sizeof (list));
+  assert (strcmp (list, "0") == 0);
+  check_output (p, ":\t0\n");
+  rlimit_subprocess_delete (p);
+
+  /* Memory policy (on node 0, always there) */
+  p = rlimit_subprocess_create (2, numa_argv, NULL);
+  assert (rlimit_set_memory_policy (p, 42, "0") == -1);
+  assert (rlimit_set_memory_policy (p, MEMPOLICY_BIND, NULL) == -1);
+  assert (rlimit_set_memory_policy (p, MEMPOLICY_BIND, "0") == 0);
+  assert (rlimit_get_memory_policy (p) == MEMPOLICY_BIND);
+  check_output (p, "bind:0");
+  rlimit_subprocess_delete (p);
+
+  /* Reserving every CPU leaves none to the subprocesses */
+  snprintf (all, sizeof (all), "0-%ld", sysconf (_SC_NPROCESSORS_CONF) - 1);
+  assert (rlimit_placement_start ("x") == -1);
+  assert (rlimit_placement_start (all) == -1);
+
+  assert (rlimit_placement_start (NULL) == 0);
+  assert (rlimit_placement_start (NULL) == -1);
+
+  /* Subprocesses run on the pool by default */
+  p = rlimit_subprocess_create (3, cpus_argv, NULL);
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_wait (p);
+  assert (p->status == TERMINATED);
+  rlimit_get_cpu_list (p, list, sizeof (list));
+  assert (strlen (list) > 0);
+  rlimit_subprocess_delete (p);
+
+  /* Asking for every CPU of the pool, the second one waits for the
+   * first to be over */
+  p = rlimit_subprocess_create (2, sleep_argv, NULL);
+  q = rlimit_subprocess_create (2, sleep_argv, NULL);
+  rlimit_set_exclusive_cpus (p, sysconf (_SC_NPROCESSORS_ONLN));
+  rlimit_set_exclusive_cpus (q, sysconf (_SC_NPROCESSORS_ONLN));
+  assert (rlimit_get_exclusive_cpus (p) == sysconf (_SC_NPROCESSORS_ONLN));
+
+  start = now ();
+  rlimit_subprocess_run (p);
+  rlimit_subprocess_run (q);
+  rlimit_subprocess_wait (p);
+  rlimit_subprocess_wait (q);
+  assert (p->status == TERMINATED);
+  assert (q->status == TERMINATED);
+  assert (now () - start >= 0.6);
+
+  rlimit_subprocess_delete (p);
+  rlimit_subprocess_delete (q);
+
+  rlimit_placement_stop ();
+
+  return EXIT_SUCCESS;
+}
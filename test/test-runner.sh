@@ -10,18 +10,46 @@ TESTS='01_io
        08_forbid_syscall_timeouted
        09_ls_R
        10_expect
-       11_expect_failed'
+       11_expect_failed
+       12_syscall_policy
+       13_supervisor
+       14_concurrent_timeouts
+       15_time_limit_ns
+       16_output_limit
+       17_file_capture
+       18_output_callback
+       19_stdin_queue
+       20_stdin_file
+       21_expect_match
+       22_expect_any
+       23_batch
+       24_spawn_helper
+       25_forkserver
+       26_arena
+       27_cgroup
+       28_timeline
+       29_cpu_timeout
+       30_perf
+       31_instructions
+       32_syscall_profile
+       33_repeat
+       34_placement'
 
 failed=0
+skipped=0
 success=0
 
 echo "Running the test suite:"
 
 for test in $TESTS; do
     ./${test} ;
-    if [ $? = 0 ]; then
+    result=$?
+    if [ $result = 0 ]; then
 	echo "* ${test}: success"
 	success=$((success + 1))
+    elif [ $result = 77 ]; then
+	echo "* ${test}: skipped"
+	skipped=$((skipped + 1))
     else
 	echo "* ${test}: failed"
 	failed=$((failed + 1))
@@ -29,5 +57,5 @@ for test in $TESTS; do
 done
 
 echo
-echo "Summary: $((success+failed)) tests have been processed" \
-     "($success success, $failed failed)"
+echo "Summary: $((success+failed+skipped)) tests have been processed" \
+     "($success success, $failed failed, $skipped skipped)"
@@ -0,0 +1,30 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#define THREADS 4
+
+static void *
+busy (void *arg)
+{
+  volatile unsigned long *counter = arg;
+
+  while (1)
+    (*counter)++;
+
+  return NULL;
+}
+
+int
+main ()
+{
+  static unsigned long counters[THREADS];
+  pthread_t threads[THREADS];
+
+  for (int i = 0; i < THREADS; i++)
+    pthread_create (&threads[i], NULL, busy, &counters[i]);
+
+  for (int i = 0; i < THREADS; i++)
+    pthread_join (threads[i], NULL);
+
+  return EXIT_SUCCESS;
+}